@@ -14,8 +14,12 @@ extern "C" {
 #include <datadog/trace_sampler_config.h>
 #ifdef WITH_RUM
 #include <injectbrowsersdk.h>
+
+#include "rum/telemetry.h"
 #endif
 
+#include <chrono>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <variant>
@@ -107,6 +111,18 @@ struct datadog_main_conf_t {
   std::vector<sampling_rule_t> sampling_rules;
   // `agent_url` is set by the `datadog_agent_url` directive.
   std::optional<std::string> agent_url;
+  // `sample_rate_overrides_file` and `sample_rate_overrides_interval` are set
+  // by the `datadog_sample_rate_overrides` directive. If there is a file,
+  // `sample_rate_overrides_zone` is the shared memory zone its overrides are
+  // published to.
+  std::optional<std::string> sample_rate_overrides_file;
+  std::chrono::seconds sample_rate_overrides_interval{10};
+  ngx_shm_zone_t *sample_rate_overrides_zone = nullptr;
+  // The default operation and resource name scripts, compiled when a context
+  // first needs them and shared by all the contexts that don't override them.
+  ngx_http_complex_value_t *default_request_operation_name_script = nullptr;
+  ngx_http_complex_value_t *default_location_operation_name_script = nullptr;
+  ngx_http_complex_value_t *default_resource_name_script = nullptr;
 
   // DD_APM_RESOURCE_RENAMING_ENABLED
   // Whether generation of http.endpoint is enabled.
@@ -191,6 +207,34 @@ struct datadog_main_conf_t {
   // DD_API_SECURITY_PROXY_SAMPLE_RATE (default: 300 samples per minute)
   ngx_int_t api_security_proxy_sample_rate{NGX_CONF_UNSET};
 
+  // DD_API_SECURITY_SAMPLE_DELAY (default: 0, disabled)
+  // Seconds during which requests to an endpoint (method, route and status)
+  // whose schema was just extracted are not considered for sampling again
+  time_t api_security_sample_delay{NGX_CONF_UNSET};
+
+  // (only nginx configuration: datadog_appsec_waf_inline_budget)
+  // Maximum average duration, in microseconds, of recent initial WAF runs for
+  // a small request to have its initial WAF run done directly on the event
+  // loop rather than on the thread pool. 0 (the default) disables this.
+  ngx_int_t appsec_waf_inline_budget_usec{NGX_CONF_UNSET};
+
+  // (only nginx configuration: datadog_appsec_waf_threads)
+  // Number of WAF threads started by each worker process. If positive, the
+  // WAF tasks are run on these threads instead of on the thread pool named
+  // by datadog_waf_thread_pool_name. 0 (the default) disables this.
+  ngx_int_t appsec_waf_threads{NGX_CONF_UNSET};
+
+  // (only nginx configuration: datadog_appsec_waf_thread_affinity)
+  // Whether each WAF thread is pinned to a single CPU from the set its worker
+  // process is bound to (see worker_cpu_affinity)
+  ngx_flag_t appsec_waf_thread_affinity{NGX_CONF_UNSET};
+
+  // (only nginx configuration: datadog_appsec_stream_response)
+  // Whether the response is sent to the client while the final WAF run is in
+  // progress, instead of being held until the WAF has run. Blocking is then
+  // only possible by resetting the connection
+  ngx_flag_t appsec_stream_response{NGX_CONF_UNSET};
+
   // TODO: missing settings and their functionality
   // DD_TRACE_CLIENT_IP_RESOLVER_ENABLED (whether to collect headers and run the
   // client ip resolution. Also requires AppSec to be enabled or
@@ -221,6 +265,9 @@ struct datadog_sample_rate_condition_t {
   // `same_line_index == 1`.
   // If `directive` is unique, then `same_line_index == 0`.
   int same_line_index;
+  // `rule_index` is the index of the corresponding `sampling_rule_t` in
+  // `datadog_main_conf_t::sampling_rules`.
+  std::size_t rule_index;
 
   // Return the name of the span tag that will be used by sampling rules to
   // match this `datadog_sample_rate` directive. It's a constant.
@@ -247,7 +294,11 @@ struct datadog_loc_conf_t {
   ngx_http_complex_value_t *service_env = DD_NGX_CONF_COMPLEX_UNSET;
   // `service_version` is set by the `datadog_version` directive.
   ngx_http_complex_value_t *service_version = DD_NGX_CONF_COMPLEX_UNSET;
-  std::unordered_map<std::string, ngx_http_complex_value_t *> tags;
+  // `tags` contains the span tags set by `datadog_tag` in this context and
+  // those inherited from enclosing contexts, or is null if there are none.
+  // Contexts that don't set any tag share their parent's map.
+  std::shared_ptr<std::unordered_map<std::string, ngx_http_complex_value_t *>>
+      tags;
   ngx_flag_t baggage_span_tags_enabled = NGX_CONF_UNSET;
   std::variant<std::vector<std::string>, bool> baggage_span_tags;
   // `parent` is the parent context (e.g. the `server` to this `location`), or
@@ -271,6 +322,19 @@ struct datadog_loc_conf_t {
   Snippet *rum_snippet = nullptr;
   std::string rum_application_id_tag;
   std::string rum_remote_config_tag;
+  // how much of a file-backed response is read to look for the injection
+  // point; 0 to have the whole response read into memory instead
+  std::size_t rum_file_scan_size = NGX_CONF_UNSET_SIZE;
+  // whether to remember where the snippet was injected into responses with an
+  // ETag or Last-Modified header, and splice it in there on the next ones
+  ngx_flag_t rum_offset_cache = NGX_CONF_UNSET;
+  // whether to inject into gzip responses, decompressing and compressing them
+  // again, rather than skip them
+  ngx_flag_t rum_gzip = NGX_CONF_UNSET;
+  // whether to create spans for the RUM filters of each request
+  ngx_flag_t rum_debug_spans = NGX_CONF_UNSET;
+  // built at merge, from rum_application_id_tag and rum_remote_config_tag
+  rum::telemetry::LocationTags rum_tags;
 #endif
 };
 
@@ -1,5 +1,10 @@
 #include "datadog_conf_handler.h"
 
+#include <new>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
 #include "ngx_http_datadog_module.h"
 
 namespace datadog {
@@ -9,6 +14,78 @@ static ngx_uint_t argument_number[] = {
     NGX_CONF_NOARGS, NGX_CONF_TAKE1, NGX_CONF_TAKE2, NGX_CONF_TAKE3,
     NGX_CONF_TAKE4,  NGX_CONF_TAKE5, NGX_CONF_TAKE6, NGX_CONF_TAKE7};
 
+namespace {
+
+struct Directive {
+  ngx_module_t *module;
+  ngx_command_t *cmd;
+};
+
+// Maps each directive name to the commands defined with that name, in the
+// order nginx would find them by going through the modules of the cycle.
+// Built once per cycle (and again if modules are loaded afterwards), so that
+// dispatching a directive doesn't go through every command of every module.
+struct DirectiveIndex {
+  ngx_cycle_t *cycle;
+  ngx_uint_t modules_n;
+  std::unordered_map<std::string_view, std::vector<Directive>> directives;
+};
+
+// the index of the cycle whose configuration is being read, if any
+DirectiveIndex *current_index = nullptr;
+
+void destroy_directive_index(void *data) noexcept {
+  auto *index = static_cast<DirectiveIndex *>(data);
+  if (current_index == index) {
+    current_index = nullptr;
+  }
+  delete index;
+}
+
+const DirectiveIndex *directive_index(ngx_cycle_t *cycle) noexcept {
+  if (current_index != nullptr && current_index->cycle == cycle &&
+      current_index->modules_n == cycle->modules_n) {
+    return current_index;
+  }
+
+  // The index lives as long as the cycle: a new one is built for the next
+  // configuration and this one deleted along with the old cycle.
+  ngx_pool_cleanup_t *cleanup = ngx_pool_cleanup_add(cycle->pool, 0);
+  if (cleanup == nullptr) {
+    return nullptr;
+  }
+
+  auto *index = new (std::nothrow) DirectiveIndex{cycle, cycle->modules_n, {}};
+  if (index == nullptr) {
+    return nullptr;
+  }
+  cleanup->handler = destroy_directive_index;
+  cleanup->data = index;
+
+  try {
+    for (ngx_uint_t i = 0; cycle->modules[i]; i++) {
+      ngx_command_t *cmd = cycle->modules[i]->commands;
+      if (cmd == NULL) {
+        continue;
+      }
+
+      for (; cmd->name.len; cmd++) {
+        std::string_view name{reinterpret_cast<char *>(cmd->name.data),
+                              cmd->name.len};
+        index->directives[name].push_back({cycle->modules[i], cmd});
+      }
+    }
+  } catch (const std::bad_alloc &) {
+    index->directives.clear();
+    return nullptr;
+  }
+
+  current_index = index;
+  return index;
+}
+
+}  // namespace
+
 ngx_int_t datadog_conf_handler(const DatadogConfHandlerConfig &args) noexcept {
   ngx_conf_t *const cf = args.conf;
   // `last` used to be a parameter, but we didn't use it.
@@ -16,38 +93,36 @@ ngx_int_t datadog_conf_handler(const DatadogConfHandlerConfig &args) noexcept {
 
   char *rv;
   void *conf, **confp;
-  ngx_uint_t i, found;
+  ngx_uint_t found;
   ngx_str_t *name;
+  ngx_module_t *module;
   ngx_command_t *cmd;
 
   name = static_cast<ngx_str_t *>(cf->args->elts);
 
   found = 0;
 
-  for (i = 0; cf->cycle->modules[i]; i++) {
-    cmd = cf->cycle->modules[i]->commands;
-    if (cmd == NULL) {
-      continue;
-    }
-
-    if (args.skip_this_module &&
-        cf->cycle->modules[i] == &ngx_http_datadog_module) {
-      continue;
-    }
+  const DirectiveIndex *index = directive_index(cf->cycle);
+  if (index == nullptr) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "failed to index directives for \"%s\"", name->data);
+    return NGX_ERROR;
+  }
 
-    for (; cmd->name.len; cmd++) {
-      if (name->len != cmd->name.len) {
-        continue;
-      }
+  auto entry = index->directives.find(
+      std::string_view{reinterpret_cast<char *>(name->data), name->len});
+  if (entry != index->directives.end()) {
+    for (const Directive &directive : entry->second) {
+      module = directive.module;
+      cmd = directive.cmd;
 
-      if (ngx_strcmp(name->data, cmd->name.data) != 0) {
+      if (args.skip_this_module && module == &ngx_http_datadog_module) {
         continue;
       }
 
       found = 1;
 
-      if (cf->cycle->modules[i]->type != NGX_CONF_MODULE &&
-          cf->cycle->modules[i]->type != cf->module_type) {
+      if (module->type != NGX_CONF_MODULE && module->type != cf->module_type) {
         continue;
       }
 
@@ -101,16 +176,16 @@ ngx_int_t datadog_conf_handler(const DatadogConfHandlerConfig &args) noexcept {
       conf = NULL;
 
       if (cmd->type & NGX_DIRECT_CONF) {
-        conf = ((void **)cf->ctx)[cf->cycle->modules[i]->index];
+        conf = ((void **)cf->ctx)[module->index];
 
       } else if (cmd->type & NGX_MAIN_CONF) {
-        conf = &(((void **)cf->ctx)[cf->cycle->modules[i]->index]);
+        conf = &(((void **)cf->ctx)[module->index]);
 
       } else if (cf->ctx) {
         confp = static_cast<void **>(*(void **)((char *)cf->ctx + cmd->conf));
 
         if (confp) {
-          conf = confp[cf->cycle->modules[i]->ctx_index];
+          conf = confp[module->ctx_index];
         }
       }
 
@@ -37,6 +37,7 @@ DatadogContext::DatadogContext(ngx_http_request_t *request,
 #ifdef WITH_WAF
     : sec_ctx_{security::Context::maybe_create(
           security::Library::max_saved_output_data(),
+          security::Library::stream_response(),
           is_apm_tracing_enabled(request))}
 #endif
 {
@@ -46,7 +47,7 @@ DatadogContext::DatadogContext(ngx_http_request_t *request,
 
 #ifdef WITH_RUM
   if (loc_conf->rum_enable) {
-    auto *trace = find_trace(request);
+    auto *trace = loc_conf->rum_debug_spans ? find_trace(request) : nullptr;
     if (trace != nullptr) {
       auto rum_span = trace->active_span().create_child();
       rum_span.set_name("rum_sdk_injection.on_rewrite_handler");
@@ -104,7 +105,7 @@ ngx_int_t DatadogContext::on_header_filter(ngx_http_request_t *request) {
 #ifdef WITH_RUM
   if (loc_conf->rum_enable) {
     trace = find_trace(request);
-    if (trace != nullptr) {
+    if (trace != nullptr && loc_conf->rum_debug_spans) {
       auto rum_span = trace->active_span().create_child();
       rum_span.set_name("rum_sdk_injection.on_header");
       auto status = rum_ctx_.on_header_filter(request, loc_conf,
@@ -113,9 +114,11 @@ ngx_int_t DatadogContext::on_header_filter(ngx_http_request_t *request) {
         rum_span.set_error(true);
       }
     } else {
-      // No trace/span found for this request (e.g. tracing is disabled via
-      // `datadog_tracing off`, or this is an untracked subrequest).
-      // Proceed with RUM injection without instrumentation.
+      // Spans for the RUM filters are only wanted for debugging
+      // (`datadog_rum_debug_spans`), and there may be no trace for this
+      // request (e.g. tracing is disabled via `datadog_tracing off`, or this
+      // is an untracked subrequest). Proceed with RUM injection without
+      // instrumentation; telemetry still records its outcome and duration.
       rum_ctx_.on_header_filter(request, loc_conf, ngx_http_next_header_filter);
     }
   }
@@ -180,7 +183,7 @@ ngx_int_t DatadogContext::on_output_body_filter(ngx_http_request_t *request,
 #ifdef WITH_RUM
   // TODO: If WAF is blocking, no need to inject the RUM SDK.
   if (loc_conf->rum_enable) {
-    auto *trace = find_trace(request);
+    auto *trace = loc_conf->rum_debug_spans ? find_trace(request) : nullptr;
     if (trace != nullptr) {
       auto rum_span = trace->active_span().create_child();
       rum_span.set_name("rum_sdk_injection.on_body_filter");
@@ -211,7 +214,7 @@ void DatadogContext::on_log_request(ngx_http_request_t *request) {
 
 #ifdef WITH_RUM
   if (loc_conf->rum_enable) {
-    rum_ctx_.on_log_request(request);
+    rum_ctx_.on_log_request(request, loc_conf);
   }
 #endif
 
@@ -7,6 +7,10 @@
 
 #include <algorithm>
 #include <cstdlib>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include "datadog_context.h"
 #include "global_tracer.h"
@@ -79,16 +83,83 @@ static ngx_int_t expand_span_variable(ngx_http_request_t *request,
   return NGX_ERROR;
 }
 
-// Load into the specified `variable_value` the result of looking up the value
-// of the variable name indicated by the specified `data`.  The variable name,
-// if valid, will resolve to some environment variable for the current process,
-// e.g.  `datadog_env_dd_agent_host` resolves to a string containing the value
+namespace {
+
+// The values of the environment variables in
+// `TracingLibrary::environment_variable_names()`, in the same order, as the
+// worker process sees them once `datadog_init_worker` has applied the ones
+// forwarded from the master process. Empty until `snapshot_variables`.
+std::vector<std::optional<std::string>> environment_values;
+
+// The tracer configuration as JSON, rendered by `snapshot_variables` for the
+// tracer installed in this worker, or empty if there is none.
+std::string tracer_configuration_json;
+// Whether `tracer_configuration_json` is an object, to which members can be
+// added. It's not if the tracer's configuration couldn't be parsed.
+bool tracer_configuration_is_object = false;
+
+void set_not_found(ngx_http_variable_value_t *variable_value) {
+  const ngx_str_t not_found_str = ngx_string("-");
+  variable_value->len = not_found_str.len;
+  variable_value->data = not_found_str.data;
+  variable_value->valid = true;
+  variable_value->no_cacheable = true;
+  variable_value->not_found = false;
+}
+
+void set_value(ngx_http_variable_value_t *variable_value,
+               std::string_view value) {
+  variable_value->len = value.size();
+  variable_value->data =
+      reinterpret_cast<u_char *>(const_cast<char *>(value.data()));
+  variable_value->valid = true;
+  variable_value->no_cacheable = true;
+  variable_value->not_found = false;
+}
+
+// Append to `json`, which is the representation of an object without its
+// closing brace, a member whose value is the string `value`.
+void append_json_member(std::string &json, std::string_view key,
+                        std::string_view value) {
+  rapidjson::StringBuffer buffer;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+  writer.String(key.data(), static_cast<rapidjson::SizeType>(key.size()));
+  buffer.Put(':');
+  writer.Reset(buffer);
+  writer.String(value.data(), static_cast<rapidjson::SizeType>(value.size()));
+
+  if (json.back() != '{') {
+    json += ',';
+  }
+  json.append(buffer.GetString(), buffer.GetSize());
+}
+
+}  // namespace
+
+// Load into the specified `variable_value` the value of the environment
+// variable at index `data` in `TracingLibrary::environment_variable_names`,
+// e.g. `datadog_env_dd_agent_host` resolves to a string containing the value
 // of the "DD_AGENT_HOST" environment variable as the current process inherited
-// it.  Only a subset of environment variables may be looked up this way --
-// only the environment variables listed in
-// `TracingLibrary::environment_variable_names`.  Return `NGX_OK` on success or
-// another value if an error occurs.
+// it.  Unset environment variables resolve to a hyphen.  Return `NGX_OK`.
 static ngx_int_t expand_environment_variable(
+    ngx_http_request_t *, ngx_http_variable_value_t *variable_value,
+    uintptr_t data) noexcept {
+  if (data >= environment_values.size() || !environment_values[data]) {
+    set_not_found(variable_value);
+    return NGX_OK;
+  }
+
+  set_value(variable_value, *environment_values[data]);
+  return NGX_OK;
+}
+
+// Load into the specified `variable_value` the value of the environment
+// variable named by the variable whose name is at `data`, an `ngx_str_t*`,
+// after the `datadog_env_` prefix.  Environment variables that aren't in
+// `TracingLibrary::environment_variable_names` resolve to a hyphen like unset
+// ones.  The others are registered by name, but resolve the same here should a
+// lookup fall through to the prefix.  Return `NGX_OK`.
+static ngx_int_t expand_prefixed_environment_variable(
     ngx_http_request_t *request, ngx_http_variable_value_t *variable_value,
     uintptr_t data) noexcept {
   auto variable_name = to_string_view(*reinterpret_cast<ngx_str_t *>(data));
@@ -96,100 +167,81 @@ static ngx_int_t expand_environment_variable(
       TracingLibrary::environment_variable_name_prefix().size();
   auto suffix = slice(variable_name, prefix_length);
 
-  std::string env_var_name{suffix.data(), suffix.size()};
-  std::transform(env_var_name.begin(), env_var_name.end(), env_var_name.begin(),
-                 to_upper);
-
-  const auto allow_list = TracingLibrary::environment_variable_names();
-  const char *env_value = nullptr;
-  if (std::find(allow_list.begin(), allow_list.end(), env_var_name) !=
-      allow_list.end()) {
-    env_value = std::getenv(env_var_name.c_str());
-  }
-
-  if (env_value == nullptr) {
-    const ngx_str_t not_found_str = ngx_string("-");
-    variable_value->len = not_found_str.len;
-    variable_value->data = not_found_str.data;
-    variable_value->valid = true;
-    variable_value->no_cacheable = true;
-    variable_value->not_found = false;
-    return NGX_OK;
-  }
-
-  const ngx_str_t value_str = to_ngx_str(request->pool, env_value);
-  variable_value->len = value_str.len;
-  variable_value->valid = true;
-  variable_value->no_cacheable = true;
-  variable_value->not_found = false;
-  variable_value->data = value_str.data;
-
-  return NGX_OK;
+  const auto env_var_names = TracingLibrary::environment_variable_names();
+  const auto found = std::find_if(
+      env_var_names.begin(), env_var_names.end(), [&](std::string_view name) {
+        return name.size() == suffix.size() &&
+               std::equal(name.begin(), name.end(), suffix.begin(),
+                          [](char a, char b) { return a == to_upper(b); });
+      });
+  return expand_environment_variable(
+      request, variable_value,
+      static_cast<uintptr_t>(found - env_var_names.begin()));
 }
 
 // Load into the specified `variable_value` the result of looking up the value
 // of the variable whose name is determined by
 // `TracingLibrary::configuration_json_variable_name()`.  The variable
-// evaluates to a JSON representation of the tracer configuration.  Return
-// `NGX_OK` on success or another value if an error occurs.
+// evaluates to a JSON representation of the tracer configuration, with the
+// service, environment and version configured for the request's location.
+// Return `NGX_OK` on success or another value if an error occurs.
 static ngx_int_t expand_configuration_variable(
     ngx_http_request_t *request, ngx_http_variable_value_t *variable_value,
-    uintptr_t /*data*/) noexcept {
-  variable_value->valid = true;
-  variable_value->no_cacheable = true;
-  variable_value->not_found = false;
-
-  const dd::Tracer *tracer = global_tracer();
-  if (tracer == nullptr) {
+    uintptr_t /*data*/) noexcept try {
+  if (global_tracer() == nullptr || tracer_configuration_json.empty()) {
     // No tracer, no config. Evaluate to "-" (hyphen).
-    const ngx_str_t not_found_str = ngx_string("-");
-    variable_value->len = not_found_str.len;
-    variable_value->data = not_found_str.data;
+    set_not_found(variable_value);
     return NGX_OK;
   }
 
-  // NOTE(@dmehala): Override the configuration with runtime configuration.
-  // We should find a better way to generate the configuration.
-  rapidjson::Document doc;
-  if (doc.Parse(tracer->config().c_str()).HasParseError()) {
-    auto errorCode = doc.GetParseError();
-    ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-                  "failed to parse tracer configuration: %d", errorCode);
-    const ngx_str_t json_str = to_ngx_str(request->pool, tracer->config());
-    variable_value->len = json_str.len;
-    variable_value->data = json_str.data;
-  }
-
-  auto &alloc = doc.GetAllocator();
-
-  // override
   const auto &loc_conf = *static_cast<datadog::nginx::datadog_loc_conf_t *>(
       ngx_http_get_module_loc_conf(request, ngx_http_datadog_module));
 
-  auto append_to_doc = [&](std::string_view key,
-                           ngx_http_complex_value_t *value) {
+  if (!tracer_configuration_is_object ||
+      (loc_conf.service_name == nullptr && loc_conf.service_env == nullptr &&
+       loc_conf.service_version == nullptr)) {
+    set_value(variable_value, tracer_configuration_json);
+    return NGX_OK;
+  }
+
+  // NOTE(@dmehala): Override the configuration with runtime configuration.
+  // We should find a better way to generate the configuration.
+  // `json` is `tracer_configuration_json` without its closing brace, once
+  // there is something to add to it.
+  std::string json;
+  auto append_to_json = [&](std::string_view key,
+                            ngx_http_complex_value_t *value) {
     if (value == nullptr) return;
 
     ngx_str_t res;
     if (ngx_http_complex_value(request, value, &res) == NGX_OK &&
         res.len != 0) {
-      doc.AddMember(rapidjson::Value(key.data(), key.size(), alloc),
-                    rapidjson::Value((char *)res.data, res.len, alloc), alloc);
+      if (json.empty()) {
+        json.assign(tracer_configuration_json, 0,
+                    tracer_configuration_json.size() - 1);
+      }
+      append_json_member(json, key, to_string_view(res));
     }
   };
 
-  append_to_doc("service", loc_conf.service_name);
-  append_to_doc("environment", loc_conf.service_env);
-  append_to_doc("version", loc_conf.service_version);
+  append_to_json("service", loc_conf.service_name);
+  append_to_json("environment", loc_conf.service_env);
+  append_to_json("version", loc_conf.service_version);
 
-  rapidjson::StringBuffer buffer;
-  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-  doc.Accept(writer);
+  if (json.empty()) {
+    set_value(variable_value, tracer_configuration_json);
+    return NGX_OK;
+  }
 
-  const ngx_str_t json_str = to_ngx_str(request->pool, buffer.GetString());
-  variable_value->len = json_str.len;
-  variable_value->data = json_str.data;
+  json += '}';
+  set_value(variable_value, to_string_view(to_ngx_str(request->pool, json)));
   return NGX_OK;
+} catch (const std::exception &e) {
+  ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                "failed to render the tracer configuration"
+                " for request %p: %s",
+                request, e.what());
+  return NGX_ERROR;
 }
 
 // Load into the specified `variable_value` the result of looking up the value
@@ -262,13 +314,31 @@ ngx_int_t add_variables(ngx_conf_t *cf) noexcept {
   variable->get_handler = expand_span_variable;
   variable->data = 0;
 
-  // Register the variable name prefix for Datadog-relevant environment
-  // variables.
-  prefix = to_ngx_str(TracingLibrary::environment_variable_name_prefix());
+  // Register a variable for each Datadog-relevant environment variable, with
+  // its index as data, and the variable name prefix for the others.
+  const auto env_var_prefix =
+      TracingLibrary::environment_variable_name_prefix();
+  const auto env_var_names = TracingLibrary::environment_variable_names();
+  for (std::size_t i = 0; i < env_var_names.size(); ++i) {
+    std::string variable_name{env_var_prefix};
+    std::transform(env_var_names[i].begin(), env_var_names[i].end(),
+                   std::back_inserter(variable_name), to_lower);
+    ngx_str_t name = to_ngx_str(cf->pool, variable_name);
+    // Not `NGX_HTTP_VAR_NOHASH`: the variable can be looked up by name at
+    // runtime, e.g. by SSI or njs.
+    variable = ngx_http_add_variable(cf, &name, NGX_HTTP_VAR_NOCACHEABLE);
+    if (variable == nullptr) {
+      return NGX_ERROR;
+    }
+    variable->get_handler = expand_environment_variable;
+    variable->data = i;
+  }
+
+  prefix = to_ngx_str(env_var_prefix);
   variable = ngx_http_add_variable(
       cf, &prefix,
       NGX_HTTP_VAR_NOCACHEABLE | NGX_HTTP_VAR_NOHASH | NGX_HTTP_VAR_PREFIX);
-  variable->get_handler = expand_environment_variable;
+  variable->get_handler = expand_prefixed_environment_variable;
   variable->data = 0;
 
   // Register the variable name prefix for OpenTelemetry-relevant environment
@@ -295,5 +365,39 @@ ngx_int_t add_variables(ngx_conf_t *cf) noexcept {
 
   return NGX_OK;
 }
+
+void snapshot_variables(ngx_log_t *log) {
+  const auto env_var_names = TracingLibrary::environment_variable_names();
+  environment_values.clear();
+  environment_values.reserve(env_var_names.size());
+  for (const auto &name : env_var_names) {
+    const char *value = std::getenv(std::string{name}.c_str());
+    environment_values.push_back(value ? std::optional<std::string>{value}
+                                       : std::nullopt);
+  }
+
+  tracer_configuration_json.clear();
+  tracer_configuration_is_object = false;
+  const dd::Tracer *tracer = global_tracer();
+  if (tracer == nullptr) {
+    return;
+  }
+
+  rapidjson::Document doc;
+  if (doc.Parse(tracer->config().c_str()).HasParseError() ||
+      !doc.IsObject()) {
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+                  "failed to parse tracer configuration: %d",
+                  doc.GetParseError());
+    tracer_configuration_json = tracer->config();
+    return;
+  }
+
+  rapidjson::StringBuffer buffer;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+  doc.Accept(writer);
+  tracer_configuration_json.assign(buffer.GetString(), buffer.GetSize());
+  tracer_configuration_is_object = true;
+}
 }  // namespace nginx
 }  // namespace datadog
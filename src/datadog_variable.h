@@ -21,5 +21,10 @@ namespace nginx {
 // corresponding static functions in `TracingLibrary`.
 ngx_int_t add_variables(ngx_conf_t* cf) noexcept;
 
+// Take the values that the environment and configuration variables resolve
+// to in this worker process. To be called once its environment and tracer are
+// set up. Errors are logged to the specified `log`.
+void snapshot_variables(ngx_log_t* log);
+
 }  // namespace nginx
 }  // namespace datadog
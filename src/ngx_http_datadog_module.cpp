@@ -3,6 +3,7 @@
 #include <datadog/runtime_id.h>
 #include <datadog/telemetry/telemetry.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 #include <exception>
@@ -24,9 +25,11 @@
 #endif
 #include "ngx_logger.h"
 #include "tracing/directives.h"
+#include "tracing/sample_rate_overrides.h"
 #if defined(WITH_WAF)
 #include "security/directives.h"
 #include "security/library.h"
+#include "security/waf_executor.h"
 #include "security/waf_remote_cfg.h"
 #endif
 #if defined(WITH_RUM)
@@ -311,6 +314,11 @@ static ngx_int_t datadog_module_init(ngx_conf_t *cf) noexcept {
     return NGX_ERROR;
   }
 
+  if (main_conf->sample_rate_overrides_file &&
+      add_sample_rate_overrides_zone(cf, *main_conf) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
   // Add default span tags.
   const auto tags = TracingLibrary::default_tags();
   if (!tags.empty()) {
@@ -367,15 +375,20 @@ static ngx_int_t datadog_init_worker(ngx_cycle_t *cycle) noexcept try {
   }
 #endif
 
-  auto maybe_tracer = TracingLibrary::make_tracer(*main_conf, logger);
-  if (auto *error = maybe_tracer.if_error()) {
+  auto maybe_config = TracingLibrary::make_tracer_config(*main_conf, logger);
+  if (auto *error = maybe_config.if_error()) {
     ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
                   "Failed to construct tracer: [error code %d] %s",
                   int(error->code), error->message.c_str());
     return NGX_ERROR;
   }
 
-  reset_global_tracer(std::move(*maybe_tracer));
+  reset_global_tracer(dd::Tracer{*maybe_config});
+  snapshot_variables(cycle->log);
+  // Traces kept by overridden sample rates are limited like those kept by the
+  // tracer's sampling rules.
+  start_sample_rate_overrides(cycle, *main_conf,
+                              maybe_config->trace_sampler.max_per_second);
   return NGX_OK;
 } catch (const std::exception &e) {
   ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "failed to initialize tracer: %s",
@@ -389,6 +402,11 @@ static void datadog_exit_worker(ngx_cycle_t *cycle) noexcept {
   // before reset_global_tracer() so the thread cannot call back into telemetry
   // data that is about to be destroyed.
   datadog::telemetry::shutdown();
+#ifdef WITH_WAF
+  // Join the WAF threads, if any were started in `datadog_init_worker`.
+  security::WafExecutor::stop();
+#endif
+  stop_sample_rate_overrides();
   // If the `dd::Tracer` singleton has been set (in `datadog_init_worker`),
   // destroy it.
   reset_global_tracer();
@@ -452,6 +470,19 @@ static void *create_datadog_loc_conf(ngx_conf_t *conf) noexcept {
   return loc_conf;
 }
 
+//------------------------------------------------------------------------------
+// shared_default_script
+//------------------------------------------------------------------------------
+// Return `script`, compiling it from `pattern` first if it hasn't been yet.
+static ngx_http_complex_value_t *shared_default_script(
+    ngx_conf_t *cf, ngx_http_complex_value_t *&script,
+    std::string_view pattern) noexcept {
+  if (script == nullptr) {
+    script = datadog::common::make_complex_value(cf, pattern);
+  }
+  return script;
+}
+
 //------------------------------------------------------------------------------
 // merge_datadog_loc_conf
 //------------------------------------------------------------------------------
@@ -461,10 +492,24 @@ static char *merge_datadog_loc_conf(ngx_conf_t *cf, void *parent,
 
   auto prev = static_cast<datadog_loc_conf_t *>(parent);
   auto conf = static_cast<datadog_loc_conf_t *>(child);
+  auto main_conf = static_cast<datadog_main_conf_t *>(
+      ngx_http_conf_get_module_main_conf(cf, ngx_http_datadog_module));
 
   conf->parent = prev;
   conf->depth = prev->depth + 1;
 
+  // Don't trace the locations serving probes (see
+  // `TracingLibrary::probe_uris`), unless told to in the location itself.
+  if (conf->enable_tracing == NGX_CONF_UNSET) {
+    auto core_loc_conf = static_cast<ngx_http_core_loc_conf_t *>(
+        ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module));
+    const auto probe_uris = TracingLibrary::probe_uris();
+    if (std::find(probe_uris.begin(), probe_uris.end(),
+                  to_string_view(core_loc_conf->name)) != probe_uris.end()) {
+      conf->enable_tracing = 0;
+    }
+  }
+
   ngx_conf_merge_value(conf->enable_tracing, prev->enable_tracing,
                        TracingLibrary::tracing_on_by_default());
   ngx_conf_merge_value(conf->enable_locations, prev->enable_locations,
@@ -478,29 +523,33 @@ static char *merge_datadog_loc_conf(ngx_conf_t *cf, void *parent,
                            nullptr);
   ngx_conf_merge_ptr_value(
       conf->operation_name_script, prev->operation_name_script,
-      make_complex_value(
-          cf, TracingLibrary::default_request_operation_name_pattern()));
+      shared_default_script(
+          cf, main_conf->default_request_operation_name_script,
+          TracingLibrary::default_request_operation_name_pattern()));
   ngx_conf_merge_ptr_value(
       conf->loc_operation_name_script, prev->loc_operation_name_script,
-      make_complex_value(
-          cf, TracingLibrary::default_location_operation_name_pattern()));
+      shared_default_script(
+          cf, main_conf->default_location_operation_name_script,
+          TracingLibrary::default_location_operation_name_pattern()));
   ngx_conf_merge_ptr_value(
       conf->resource_name_script, prev->resource_name_script,
-      make_complex_value(cf, TracingLibrary::default_resource_name_pattern()));
+      shared_default_script(cf, main_conf->default_resource_name_script,
+                            TracingLibrary::default_resource_name_pattern()));
   ngx_conf_merge_ptr_value(
       conf->loc_resource_name_script, prev->loc_resource_name_script,
-      make_complex_value(cf, TracingLibrary::default_resource_name_pattern()));
+      shared_default_script(cf, main_conf->default_resource_name_script,
+                            TracingLibrary::default_resource_name_pattern()));
   ngx_conf_merge_value(conf->trust_incoming_span, prev->trust_incoming_span, 1);
 
-  // Create a new array that joins `prev->tags` and `conf->tags`. Since tags
-  // are set consecutively and setting a tag with the same key as a previous
-  // one overwrites it, we need to ensure that the tags in `conf->tags` come
-  // after `prev->tags` so as to keep the value from the most specific
-  // configuration.
-  if (!prev->tags.empty()) {
-    auto parent_tags =
-        prev->tags;  ///< Make a copy because merge steal the nodes.
-    conf->tags.merge(parent_tags);
+  // Add the tags of `prev` to `conf->tags`, keeping the value from the most
+  // specific configuration for keys set in both. If `conf` sets no tags, it
+  // shares the map of `prev` instead of copying it.
+  if (prev->tags != nullptr) {
+    if (conf->tags == nullptr) {
+      conf->tags = prev->tags;
+    } else {
+      conf->tags->insert(prev->tags->begin(), prev->tags->end());
+    }
   }
 
   // Merge baggage span tags, but only if this conf has no specified baggage
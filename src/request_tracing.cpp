@@ -8,6 +8,7 @@
 #include <cassert>
 #include <chrono>
 #include <ctime>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -20,6 +21,7 @@
 #include "ngx_header_reader.h"
 #include "ngx_http_datadog_module.h"
 #include "string_util.h"
+#include "tracing/sample_rate_overrides.h"
 #include "tracing_library.h"
 
 namespace datadog {
@@ -54,9 +56,12 @@ static std::string get_request_resource_name(
 }
 
 static void add_script_tags(
-    const std::unordered_map<std::string, ngx_http_complex_value_t *> &tags,
+    const std::unordered_map<std::string, ngx_http_complex_value_t *> *tags,
     ngx_http_request_t *request, dd::Span &span) {
-  for (const auto &[key, complex_value] : tags) {
+  if (tags == nullptr) {
+    return;
+  }
+  for (const auto &[key, complex_value] : *tags) {
     auto value = common::eval_complex_value(complex_value, request);
     if (value) span.set_tag(key, std::move(*value));
   }
@@ -142,21 +147,54 @@ static dd::TimePoint estimate_past_time_point(
   return result;
 }
 
+// If the trace of the specified `span` starts here, no sampling decision has
+// been made for it yet, and the sample rate of the `datadog_sample_rate`
+// directive at `rule_index` (or of traces to which none applies, if null) is
+// overridden (see `datadog_sample_rate_overrides`), then make the sampling
+// decision at that rate, subject to the tracer's rate limit like the decisions
+// of its sampling rules.
+static void apply_sample_rate_override(std::optional<std::size_t> rule_index,
+                                       dd::Span &span) {
+  const SampleRateOverrides *overrides = sample_rate_overrides();
+  if (overrides == nullptr || span.parent_id() ||
+      span.trace_segment().sampling_decision()) {
+    return;
+  }
+
+  const auto rate = overrides->rate(rule_index);
+  if (!rate) {
+    return;
+  }
+
+  span.set_metric("_dd.rule_psr", static_cast<double>(*rate) /
+                                      SampleRateOverrides::kPrecision);
+  bool keep = SampleRateOverrides::keep(span.trace_id().low, *rate);
+  if (keep) {
+    TraceRateLimiter &limiter = sample_rate_overrides_limiter();
+    keep = limiter.allow(ngx_current_msec);
+    span.set_metric("_dd.limit_psr", limiter.effective_rate());
+  }
+
+  span.trace_segment().override_sampling_priority(keep ? 2 /* USER-KEEP */
+                                                       : -1 /* USER-DROP */);
+}
+
 // Search through `conf` and its ancestors for the first `datadog_sample_rate`
 // directive whose condition is satisfied for the specified `request`. If there
 // is such a `datadog_sample_rate`, then on the specified `span` set the
 // "nginx.sample_rate_source" tag to a value that identifies the particular
 // `datadog_sample_rate` directive. A sampling rule previously configured in the
 // tracer will then match on the tag value and apply the sample rate from the
-// `datadog_sample_rate` directive.
-void set_sample_rate_tag(ngx_http_request_t *request, datadog_loc_conf_t *conf,
-                         dd::Span &span) {
+// `datadog_sample_rate` directive. Return the directive, or null if there is
+// none.
+const datadog_sample_rate_condition_t *set_sample_rate_tag(
+    ngx_http_request_t *request, datadog_loc_conf_t *conf, dd::Span &span) {
   do {
     for (const datadog_sample_rate_condition_t &rate : conf->sample_rates) {
       const ngx_str_t expression = rate.condition.run(request);
       if (str(expression) == "on") {
         span.set_tag(rate.tag_name(), rate.tag_value());
-        return;
+        return &rate;
       }
       if (str(expression) != "off") {
         ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
@@ -171,6 +209,8 @@ void set_sample_rate_tag(ngx_http_request_t *request, datadog_loc_conf_t *conf,
 
     conf = conf->parent;
   } while (conf);
+
+  return nullptr;
 }
 
 RequestTracing::RequestTracing(ngx_http_request_t *request,
@@ -270,7 +310,14 @@ RequestTracing::RequestTracing(ngx_http_request_t *request,
 
   // We care about sampling rules for the request span only, because it's the
   // only span that could be the root span.
-  set_sample_rate_tag(request_, loc_conf_, *request_span_);
+  const auto *sample_rate =
+      set_sample_rate_tag(request_, loc_conf_, *request_span_);
+
+  // An override replaces the sampling decision, so make it once, before the
+  // decision can be propagated upstream, rather than whenever the tag is set.
+  apply_sample_rate_override(
+      sample_rate ? std::optional{sample_rate->rule_index} : std::nullopt,
+      *request_span_);
 }
 
 void RequestTracing::on_change_block(ngx_http_core_loc_conf_t *core_loc_conf,
@@ -318,8 +365,8 @@ void RequestTracing::on_exit_block(
     ngx_log_debug(NGX_LOG_DEBUG_HTTP, request_->connection->log, 0,
                   "finishing Datadog location span for %p in request %p",
                   loc_conf_, request_);
-    add_script_tags(main_conf_->tags, request_, *span_);
-    add_script_tags(loc_conf_->tags, request_, *span_);
+    add_script_tags(&main_conf_->tags, request_, *span_);
+    add_script_tags(loc_conf_->tags.get(), request_, *span_);
     add_status_tags(request_, *span_);
     add_upstream_name(request_, *span_);
 
@@ -333,8 +380,8 @@ void RequestTracing::on_exit_block(
     span_->set_resource_name(get_loc_resource_name(request_, loc_conf_));
     span_->set_end_time(std::move(finish_timestamp));
   } else {
-    add_script_tags(main_conf_->tags, request_, *request_span_);
-    add_script_tags(loc_conf_->tags, request_, *request_span_);
+    add_script_tags(&main_conf_->tags, request_, *request_span_);
+    add_script_tags(loc_conf_->tags.get(), request_, *request_span_);
   }
 
   // We care about sampling rules for the request span only, because it's the
@@ -14,6 +14,7 @@ using namespace std::string_view_literals;
 
 #include "config_internal.h"
 #include "string_util.h"
+#include "telemetry.h"
 
 namespace datadog::nginx::rum::internal {
 
@@ -282,6 +283,11 @@ char* datadog_rum_merge_loc_config(ngx_conf_t* cf,
                            parent->rum_enable == NGX_CONF_UNSET);
 
   ngx_conf_merge_value(child->rum_enable, parent->rum_enable, 0);
+  ngx_conf_merge_size_value(child->rum_file_scan_size,
+                            parent->rum_file_scan_size, 64 * 1024);
+  ngx_conf_merge_value(child->rum_offset_cache, parent->rum_offset_cache, 1);
+  ngx_conf_merge_value(child->rum_gzip, parent->rum_gzip, 0);
+  ngx_conf_merge_value(child->rum_debug_spans, parent->rum_debug_spans, 0);
 
   if (child->rum_snippet == nullptr) {
     child->rum_snippet = parent->rum_snippet;
@@ -303,6 +309,11 @@ char* datadog_rum_merge_loc_config(ngx_conf_t* cf,
     resolve_rum_enable_from_env(cf, child);
   }
 
+  if (child->rum_enable) {
+    child->rum_tags = telemetry::make_location_tags(
+        child->rum_application_id_tag, child->rum_remote_config_tag);
+  }
+
   return NGX_CONF_OK;
 }
 
@@ -4,9 +4,19 @@
 
 extern "C" {
 #include <ngx_core.h>
+#include <time.h>
+#define ZLIB_CONST
+#include <zlib.h>
 }
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include "common/headers.h"
 #include "datadog_conf.h"
@@ -25,8 +35,134 @@ bool is_html_content(ngx_str_t *content_type) {
   return content_type_sv.find("text/html") != content_type_sv.npos;
 }
 
+void report_injected(ngx_http_request_t *r, datadog_loc_conf_t *cfg) {
+  ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                "RUM SDK injected successfully injected");
+
+  datadog::telemetry::counter::increment(telemetry::injection_succeed,
+                                         cfg->rum_tags.location);
+}
+
+// Return whether the files of the location of `r` are read with `aio` or
+// `directio`. The file scan reads with blocking, unaligned reads, so such
+// files are left to `ngx_http_copy_filter_module`.
+bool reads_files_asynchronously(ngx_http_request_t *r) {
+  auto *clcf = static_cast<ngx_http_core_loc_conf_t *>(
+      ngx_http_get_module_loc_conf(r, ngx_http_core_module));
+  if (clcf->directio != NGX_OFF_T_LEN) {
+    return true;
+  }
+#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
+  if (clcf->aio != NGX_HTTP_AIO_OFF) {
+    return true;
+  }
+#endif
+  return false;
+}
+
+InjectionOffsetCache<> &offset_cache() {
+  static InjectionOffsetCache<> cache;
+  return cache;
+}
+
+// identifies the response for the offset cache: same location, URI, validator
+// and length. Responses without a validator or a length aren't cached
+std::optional<std::uint64_t> offset_cache_key(const ngx_http_request_t &r,
+                                              const datadog_loc_conf_t *cfg) {
+  if (r.headers_out.content_length_n < 0) {
+    return std::nullopt;
+  }
+
+  std::hash<std::string_view> hasher;
+  std::uint64_t hash;
+  if (auto *etag = r.headers_out.etag;
+      etag != nullptr && etag->hash != 0 && etag->value.len != 0) {
+    hash = hasher(to_string_view(etag->value));
+  } else if (r.headers_out.last_modified_time != -1) {
+    hash = static_cast<std::uint64_t>(r.headers_out.last_modified_time);
+  } else if (auto *last_modified = r.headers_out.last_modified;
+             last_modified != nullptr && last_modified->hash != 0 &&
+             last_modified->value.len != 0) {
+    hash = hasher(to_string_view(last_modified->value));
+  } else {
+    return std::nullopt;
+  }
+
+  hash = hash * 31 + hasher(to_string_view(r.uri));
+  hash = hash * 31 + hasher(to_string_view(r.args));
+  hash = hash * 31 + std::hash<const void *>{}(cfg);
+  return hash * 31 + static_cast<std::uint64_t>(r.headers_out.content_length_n);
+}
+
+// Adds the time until it is destroyed to a total.
+class Stopwatch {
+ public:
+  explicit Stopwatch(std::chrono::nanoseconds &total)
+      : total_{total}, start_{std::chrono::steady_clock::now()} {}
+  Stopwatch(const Stopwatch &) = delete;
+  Stopwatch &operator=(const Stopwatch &) = delete;
+  ~Stopwatch() { total_ += std::chrono::steady_clock::now() - start_; }
+
+ private:
+  std::chrono::nanoseconds &total_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+bool is_gzip(const ngx_str_t &content_encoding) {
+  return content_encoding.len == 4 &&
+         ngx_strncasecmp(content_encoding.data, (u_char *)"gzip", 4) == 0;
+}
+
+std::uint64_t thread_cpu_time_ns() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+    return 0;
+  }
+  return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
 }  // namespace
 
+struct InjectionHandler::GzipRecoder {
+  // size of the buffers for decompressed and compressed data
+  static constexpr size_t kChunkSize = 16 * 1024;
+
+  z_stream inflater{};
+  z_stream deflater{};
+  bool inflater_initialized = false;
+  bool deflater_initialized = false;
+  // the end of the gzip stream was reached; what follows is ignored
+  bool inflate_done = false;
+
+  std::array<u_char, kChunkSize> plain;
+  // compressed data waiting for the buffer to fill up
+  ngx_chain_t *pending = nullptr;
+  // the last buffer of compressed data sent
+  ngx_buf_t *last_out = nullptr;
+
+  std::uint64_t cpu_time_ns = 0;
+
+  bool init() {
+    static constexpr auto window_bits = 15 | 0x10 /* for gzip */;
+    inflater_initialized = inflateInit2(&inflater, window_bits) == Z_OK;
+    // the response is compressed once per request: favor speed, like the
+    // default `gzip_comp_level` of nginx
+    deflater_initialized =
+        deflateInit2(&deflater, Z_BEST_SPEED, Z_DEFLATED, window_bits,
+                     8 /* default memLevel */, Z_DEFAULT_STRATEGY) == Z_OK;
+    return inflater_initialized && deflater_initialized;
+  }
+
+  ~GzipRecoder() {
+    if (inflater_initialized) {
+      inflateEnd(&inflater);
+    }
+    if (deflater_initialized) {
+      deflateEnd(&deflater);
+    }
+  }
+};
+
 InjectionHandler::InjectionHandler()
     : output_padding_(false), injector_(nullptr) {}
 
@@ -64,11 +200,8 @@ ngx_int_t InjectionHandler::on_header_filter(
       ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
                     "RUM SDK injection skipped: resource may already have RUM "
                     "SDK injected.");
-      datadog::telemetry::counter::increment(
-          telemetry::injection_skipped,
-          telemetry::build_tags("reason:already_injected",
-                                cfg->rum_application_id_tag,
-                                cfg->rum_remote_config_tag));
+      datadog::telemetry::counter::increment(telemetry::injection_skipped,
+                                             cfg->rum_tags.already_injected);
 
       return next_header_filter(r);
     }
@@ -78,10 +211,8 @@ ngx_int_t InjectionHandler::on_header_filter(
     ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
                   "RUM SDK injection skipped: empty content");
 
-    datadog::telemetry::counter::increment(
-        telemetry::injection_skipped,
-        telemetry::build_tags("reason:no_content", cfg->rum_application_id_tag,
-                              cfg->rum_remote_config_tag));
+    datadog::telemetry::counter::increment(telemetry::injection_skipped,
+                                           cfg->rum_tags.no_content);
 
     return next_header_filter(r);
   }
@@ -90,31 +221,57 @@ ngx_int_t InjectionHandler::on_header_filter(
     ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
                   "RUM SDK injection skipped: not an HTML page");
 
-    datadog::telemetry::counter::increment(
-        telemetry::injection_skipped,
-        telemetry::build_tags("reason:invalid_content_type",
-                              cfg->rum_application_id_tag,
-                              cfg->rum_remote_config_tag));
+    datadog::telemetry::counter::increment(telemetry::injection_skipped,
+                                           cfg->rum_tags.invalid_content_type);
 
     return next_header_filter(r);
   }
 
   if (auto content_encoding = r->headers_out.content_encoding;
-      content_encoding != nullptr && content_encoding->value.len != 0) {
+      content_encoding != nullptr && content_encoding->value.len != 0 &&
+      !(cfg->rum_gzip && is_gzip(content_encoding->value))) {
     ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
                   "RUM SDK injection skipped: compressed html content");
 
-    datadog::telemetry::counter::increment(
-        telemetry::injection_skipped,
-        telemetry::build_tags("reason:compressed_html",
-                              cfg->rum_application_id_tag,
-                              cfg->rum_remote_config_tag));
+    datadog::telemetry::counter::increment(telemetry::injection_skipped,
+                                           cfg->rum_tags.compressed_html);
 
     return next_header_filter(r);
   }
 
-  state_ = state::searching;
-  injector_ = injector_create(cfg->rum_snippet);
+  Stopwatch stopwatch{filter_time_};
+
+  if (r->headers_out.content_encoding != nullptr &&
+      r->headers_out.content_encoding->value.len != 0) {
+    gzip_ = std::make_unique<GzipRecoder>();
+    if (!gzip_->init()) {
+      gzip_.reset();
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "RUM SDK injection failed: unable to initialize zlib");
+      return next_header_filter(r);
+    }
+
+    // the length of the response compressed again isn't known, and it isn't
+    // the same response
+    ngx_http_clear_content_length(r);
+    ngx_http_clear_accept_ranges(r);
+    ngx_http_weak_etag(r);
+  }
+
+  if (cfg->rum_offset_cache && gzip_ == nullptr) {
+    cache_key_ = offset_cache_key(*r, cfg);
+    if (cache_key_) {
+      if (auto *entry = offset_cache().find(*cache_key_); entry != nullptr) {
+        splice_ = *entry;
+        state_ = state::splicing;
+      }
+    }
+  }
+
+  if (state_ != state::splicing) {
+    state_ = state::searching;
+    injector_ = injector_create(cfg->rum_snippet);
+  }
 
   // In case `Transfer-Encoding: chunk` is enabled no need to update the
   // content length.
@@ -140,9 +297,15 @@ ngx_int_t InjectionHandler::on_header_filter(
   ngx_str_set(&h->value, "1");
 
   // If `filter_need_in_memory` is not set, the filter can be called on with a
-  // buffer a file. The following explicitly ask for the buffer to be in memory,
-  // thus after the file has been read by `ngx_http_copy_filter_module`.
-  r->filter_need_in_memory = 1;
+  // buffer a file. Only the beginning of such files is read to look for the
+  // injection point (see scan_file()), so that the rest can still be sent
+  // with sendfile. Otherwise, explicitly ask for the buffer to be in memory,
+  // thus after the file has been read by `ngx_http_copy_filter_module`, which
+  // honors `aio` and `directio`.
+  if (cfg->rum_file_scan_size == 0 || gzip_ != nullptr ||
+      reads_files_asynchronously(r)) {
+    r->filter_need_in_memory = 1;
+  }
 
   return NGX_OK;
 }
@@ -150,135 +313,744 @@ ngx_int_t InjectionHandler::on_header_filter(
 ngx_int_t InjectionHandler::on_body_filter(
     ngx_http_request_t *r, datadog_loc_conf_t *cfg, ngx_chain_t *in,
     ngx_http_output_body_filter_pt &next_body_filter) {
-  if (!cfg->rum_enable || in == nullptr || state_ != state::searching) {
+  if (!cfg->rum_enable) {
     return next_body_filter(r, in);
   }
 
-  ngx_chain_t *output_chain;
-  ngx_chain_t *previous_chain = nullptr;
+  if (gzip_ == nullptr && state_ != state::searching &&
+      state_ != state::abandoned && state_ != state::splicing) {
+    if (busy_ == nullptr) {
+      return next_body_filter(r, in);
+    }
+
+    Stopwatch stopwatch{filter_time_};
+
+    // buffers from before the injection point are still being sent; keep
+    // track of them to release the buffers they reference
+    ngx_chain_t *out = nullptr;
+    if (ngx_chain_add_copy(r->pool, &out, in) != NGX_OK) {
+      return NGX_ERROR;
+    }
+    return output(r, out, next_body_filter);
+  }
+
+  Stopwatch stopwatch{filter_time_};
+  ngx_chain_t *output_chain = nullptr;
   ngx_chain_t **current_chain = &output_chain;
 
   for (ngx_chain_t *cl = in; cl; cl = cl->next) {
-    uint32_t buffer_size = cl->buf->last - cl->buf->pos;
-    auto result = injector_write(
-        injector_, static_cast<uint8_t *>(cl->buf->pos), buffer_size);
+    ngx_buf_t &buf = *cl->buf;
+    if (gzip_ != nullptr) {
+      current_chain = recode(r, cfg, buf, current_chain);
+    } else if (state_ == state::splicing) {
+      current_chain = splice(r, cfg, buf, current_chain);
+    } else if (state_ == state::searching) {
+      if (!ngx_buf_in_memory(&buf) && buf.in_file) {
+        current_chain = scan_file(r, cfg, buf, current_chain);
+      } else {
+        current_chain = scan_memory(r, cfg, buf, current_chain);
+      }
+    } else if (state_ == state::abandoned && buf.last_buf && output_padding_) {
+      current_chain = pass(r->pool, buf, current_chain);
+      if (current_chain != nullptr) {
+        current_chain = pad(r, cfg, buf, current_chain);
+      }
+    } else {
+      current_chain = pass(r->pool, buf, current_chain);
+    }
 
-    ngx_chain_t *injected_cl =
-        inject(r->pool, cl, std::span(result.slices, result.slices_length));
+    if (current_chain == nullptr) {
+      state_ = state::error;
+      return NGX_ERROR;
+    }
+  }
 
-    previous_chain = cl;
-    *current_chain = injected_cl;
-    current_chain = &injected_cl->next;
+  return output(r, output_chain, next_body_filter);
+}
 
-    if (result.injected) {
-      state_ = state::injected;
-      ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
-                    "RUM SDK injected successfully injected");
+ngx_chain_t **InjectionHandler::scan_memory(ngx_http_request_t *r,
+                                            datadog_loc_conf_t *cfg,
+                                            ngx_buf_t &in, ngx_chain_t **out) {
+  uint32_t buffer_size = in.last - in.pos;
+  auto result =
+      injector_write(injector_, static_cast<uint8_t *>(in.pos), buffer_size);
+  std::span slices(result.slices, result.slices_length);
 
-      datadog::telemetry::counter::increment(
-          telemetry::injection_succeed,
-          telemetry::build_tags(cfg->rum_application_id_tag,
-                                cfg->rum_remote_config_tag));
+  bool const at_end = in.last_buf && output_padding_;
+  out = inject(r->pool, in, slices, out, result.injected || !at_end);
+  if (out == nullptr) {
+    return nullptr;
+  }
 
-      return output(r, output_chain, next_body_filter);
+  if (result.injected) {
+    state_ = state::injected;
+    report_injected(r, cfg);
+    if (cache_key_) {
+      remember_offset(cfg, in.pos, buffer_size, slices);
     }
+    return out;
   }
 
-  if (previous_chain->buf->last_buf && output_padding_) {
-    state_ = state::failed;
-    auto result = injector_end(injector_);
-    ngx_chain_t *injected_cl =
-        inject(r->pool, previous_chain,
-               std::span(result.slices, result.slices_length));
+  written_ += buffer_size;
+  for (const auto &slice : slices) {
+    returned_ += slice.length;
+  }
+
+  if (at_end) {
+    out = pad(r, cfg, in, out);
+  }
+  return out;
+}
+
+ngx_chain_t **InjectionHandler::scan_file(ngx_http_request_t *r,
+                                          datadog_loc_conf_t *cfg,
+                                          ngx_buf_t &in, ngx_chain_t **out) {
+  // read at least a few bytes, so that what the injector holds back at the
+  // limit comes from this buffer
+  static constexpr size_t kMinRead = 256;
+
+  auto const size = static_cast<size_t>(in.file_last - in.file_pos);
+  size_t const budget = cfg->rum_file_scan_size > file_scanned_
+                            ? cfg->rum_file_scan_size - file_scanned_
+                            : 0;
+  size_t const to_read = std::min(size, std::max(budget, kMinRead));
+
+  // pool memory: lives as long as the buffers referencing it
+  auto *head = static_cast<u_char *>(ngx_pnalloc(r->pool, to_read));
+  if (head == nullptr && to_read > 0) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "RUM SDK injection failed: insufficient memory available");
+    return nullptr;
+  }
+  ssize_t n = ngx_read_file(in.file, head, to_read, in.file_pos);
+  if (n != static_cast<ssize_t>(to_read)) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "RUM SDK injection failed: could not read \"%V\"",
+                  &in.file->name);
+    return nullptr;
+  }
+  file_scanned_ += to_read;
+
+  ngx_buf_t head_buf{};
+  head_buf.pos = head;
+  head_buf.last = head + to_read;
+  head_buf.memory = 1;
+
+  auto result = injector_write(injector_, head, to_read);
+  std::span slices(result.slices, result.slices_length);
+  out = inject(r->pool, head_buf, slices, out, false);
+  if (out == nullptr) {
+    return nullptr;
+  }
+
+  if (result.injected) {
+    state_ = state::injected;
+    report_injected(r, cfg);
+    if (cache_key_) {
+      remember_offset(cfg, head, to_read, slices);
+    }
+
+    return send_file_part(r->pool, in, in.file_pos + to_read, in.file_last,
+                          out, true);
+  }
+
+  written_ += to_read;
+  for (const auto &slice : slices) {
+    returned_ += slice.length;
+  }
+
+  bool const at_end = in.last_buf && output_padding_;
+  if (to_read == size) {
+    if (at_end) {
+      return pad(r, cfg, in, out);
+    }
+    return finish(r->pool, in, nullptr, out);
+  }
+
+  // Give up. The bytes the injector holds back are still in the file, so
+  // send them from there, and leave them out of the padding
+  size_t const held = written_ - returned_;
+  if (held > to_read) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "RUM SDK injection failed: %uz bytes held back by the "
+                  "injector are not in the file",
+                  held);
+    return nullptr;
+  }
+
+  state_ = state::abandoned;
+  padding_skip_ = held;
+  ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                "RUM SDK injection: no injection point found in the first "
+                "%uz bytes of the file",
+                file_scanned_);
+
+  out = send_file_part(r->pool, in,
+                       in.file_pos + static_cast<off_t>(to_read - held),
+                       in.file_last, out, !at_end);
+  if (out != nullptr && at_end) {
+    out = pad(r, cfg, in, out);
+  }
+  return out;
+}
+
+ngx_chain_t **InjectionHandler::splice(ngx_http_request_t *r,
+                                       datadog_loc_conf_t *cfg, ngx_buf_t &in,
+                                       ngx_chain_t **out) {
+  bool const in_file = !ngx_buf_in_memory(&in) && in.in_file;
+  auto const size = static_cast<std::uint64_t>(ngx_buf_size(&in));
+  std::uint64_t const start = written_;
+  std::uint64_t const end = start + size;
+  std::uint64_t const context_start = splice_.offset - splice_.context_len;
+
+  bool valid = end >= splice_.offset || !in.last_buf;
+  if (valid && end > context_start && start < splice_.offset) {
+    std::uint64_t const from = std::max(start, context_start);
+    std::uint64_t const to = std::min(end, splice_.offset);
+
+    const u_char *bytes;
+    std::array<u_char, InjectionOffsetCache<>::kMaxContext> file_bytes;
+    if (in_file) {
+      ssize_t n = ngx_read_file(in.file, file_bytes.data(), to - from,
+                                in.file_pos + static_cast<off_t>(from - start));
+      if (n != static_cast<ssize_t>(to - from)) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "RUM SDK injection failed: could not read \"%V\"",
+                      &in.file->name);
+        return nullptr;
+      }
+      bytes = file_bytes.data();
+    } else {
+      bytes = in.pos + (from - start);
+    }
+
+    valid = std::equal(bytes, bytes + (to - from),
+                       splice_.context.begin() + (from - context_start));
+  }
+
+  if (!valid) {
+    // the response changed: look for the injection point from here on
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "RUM SDK injection: cached injection point is stale");
+    offset_cache().evict(*cache_key_);
+    injector_ = injector_create(cfg->rum_snippet);
+    state_ = state::searching;
+    if (in_file) {
+      return scan_file(r, cfg, in, out);
+    }
+    return scan_memory(r, cfg, in, out);
+  }
+
+  written_ = end;
+  returned_ = end;
+  if (end < splice_.offset) {
+    return pass(r->pool, in, out);
+  }
+
+  state_ = state::injected;
+  report_injected(r, cfg);
+
+  auto const at = static_cast<off_t>(splice_.offset - start);
+  BytesSlice const snippet{
+      reinterpret_cast<const uint8_t *>(splice_.snippet->data()),
+      static_cast<uint32_t>(splice_.snippet->size())};
+  if (in_file) {
+    out = send_file_part(r->pool, in, in.file_pos, in.file_pos + at, out,
+                         false);
+    if (out != nullptr) {
+      out = inject(r->pool, in, std::span(&snippet, 1), out, false);
+    }
+    if (out == nullptr) {
+      return nullptr;
+    }
+    return send_file_part(r->pool, in, in.file_pos + at, in.file_last, out,
+                          true);
+  }
+
+  BytesSlice const slices[] = {
+      {in.pos, static_cast<uint32_t>(at)},
+      snippet,
+      {in.pos + at, static_cast<uint32_t>(size - at)},
+  };
+  return inject(r->pool, in, slices, out);
+}
+
+void InjectionHandler::remember_offset(datadog_loc_conf_t *cfg,
+                                       const u_char *data, size_t size,
+                                       std::span<const BytesSlice> slices) {
+  // The snippet comes in a slice of its own, not pointing into the data.
+  size_t const snippet_len = cfg->rum_snippet->length;
+  std::string output;
+  size_t at = 0;
+  int candidates = 0;
+  for (const auto &slice : slices) {
+    bool const in_data = slice.start >= data && slice.start < data + size;
+    if (!in_data && slice.length == snippet_len) {
+      at = output.size();
+      candidates++;
+    }
+    output.append(reinterpret_cast<const char *>(slice.start), slice.length);
+  }
+
+  if (candidates != 1 || at == 0) {
+    // ambiguous, or without preceding bytes to check
+    return;
+  }
+
+  // what follows the snippet is the end of the data
+  size_t const rest = output.size() - at - snippet_len;
+  if (rest > size ||
+      output.compare(at + snippet_len, rest,
+                     reinterpret_cast<const char *>(data + size - rest),
+                     rest) != 0) {
+    return;
+  }
+
+  std::string_view const sv{output};
+  offset_cache().store(*cache_key_, written_ + size - rest, sv.substr(0, at),
+                       cfg->rum_snippet, sv.substr(at, snippet_len));
+}
+
+ngx_chain_t **InjectionHandler::recode(ngx_http_request_t *r,
+                                       datadog_loc_conf_t *cfg, ngx_buf_t &in,
+                                       ngx_chain_t **out) {
+  std::uint64_t const cpu_start = thread_cpu_time_ns();
+  GzipRecoder &gzip = *gzip_;
+  z_stream &inflater = gzip.inflater;
+
+  if (!gzip.inflate_done && in.last > in.pos) {
+    inflater.next_in = in.pos;
+    inflater.avail_in = in.last - in.pos;
+    do {
+      inflater.next_out = gzip.plain.data();
+      inflater.avail_out = gzip.plain.size();
+      int rc = inflate(&inflater, Z_NO_FLUSH);
+      if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "RUM SDK injection failed: inflate() failed: %d", rc);
+        return nullptr;
+      }
 
-    *current_chain = injected_cl;
-    current_chain = &injected_cl->next;
+      out = recode_plain(r, cfg, gzip.plain.data(),
+                         gzip.plain.size() - inflater.avail_out, out);
+      if (out == nullptr) {
+        return nullptr;
+      }
+
+      if (rc == Z_STREAM_END) {
+        gzip.inflate_done = true;
+        break;
+      }
+      if (rc == Z_BUF_ERROR) {
+        // needs more input
+        break;
+      }
+    } while (inflater.avail_in > 0 || inflater.avail_out == 0);
+  }
+  // everything was copied to the zlib streams
+  in.pos = in.last;
+
+  if (in.last_buf && state_ == state::searching) {
+    // only send what the injector held back: without a content length, the
+    // snippet isn't added at the end
+    state_ = state::failed;
+    size_t held = written_ - returned_;
+    auto end_result = injector_end(injector_);
+    for (const auto &slice : std::span(end_result.slices,
+                                       end_result.slices_length)) {
+      size_t const n = std::min<size_t>(held, slice.length);
+      out = compress(r->pool, slice.start, n, Z_NO_FLUSH, out);
+      if (out == nullptr) {
+        return nullptr;
+      }
+      held -= n;
+    }
 
     ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
                   "RUM SDK injection failed: no injection point found");
 
-    datadog::telemetry::counter::increment(
-        telemetry::injection_failed,
-        telemetry::build_tags("reason:missing_header_tag",
-                              cfg->rum_application_id_tag,
-                              cfg->rum_remote_config_tag));
+    datadog::telemetry::counter::increment(telemetry::injection_failed,
+                                           cfg->rum_tags.missing_header_tag);
   }
 
-  return output(r, output_chain, next_body_filter);
+  if (in.last_buf || in.flush) {
+    gzip.last_out = nullptr;
+    out = compress(r->pool, nullptr, 0, in.last_buf ? Z_FINISH : Z_SYNC_FLUSH,
+                   out);
+    if (out == nullptr) {
+      return nullptr;
+    }
+    out = finish(r->pool, in, gzip.last_out, out);
+  }
+
+  gzip.cpu_time_ns += thread_cpu_time_ns() - cpu_start;
+  if (in.last_buf) {
+    datadog::telemetry::distribution::add(telemetry::gzip_recoding_time,
+                                          gzip.cpu_time_ns / 1000,
+                                          cfg->rum_tags.location);
+  }
+
+  return out;
 }
 
-ngx_int_t InjectionHandler::on_log_request(ngx_http_request_t *r) {
+ngx_chain_t **InjectionHandler::recode_plain(ngx_http_request_t *r,
+                                             datadog_loc_conf_t *cfg,
+                                             const u_char *data, size_t size,
+                                             ngx_chain_t **out) {
+  if (size == 0) {
+    return out;
+  }
+
+  if (state_ != state::searching) {
+    return compress(r->pool, data, size, Z_NO_FLUSH, out);
+  }
+
+  auto result = injector_write(injector_, data, size);
+  std::span slices(result.slices, result.slices_length);
+  for (const auto &slice : slices) {
+    out = compress(r->pool, slice.start, slice.length, Z_NO_FLUSH, out);
+    if (out == nullptr) {
+      return nullptr;
+    }
+  }
+
+  if (result.injected) {
+    state_ = state::injected;
+    report_injected(r, cfg);
+    return out;
+  }
+
+  written_ += size;
+  for (const auto &slice : slices) {
+    returned_ += slice.length;
+  }
+  return out;
+}
+
+ngx_chain_t **InjectionHandler::compress(ngx_pool_t *pool, const u_char *data,
+                                         size_t size, int flush,
+                                         ngx_chain_t **out) {
+  GzipRecoder &gzip = *gzip_;
+  z_stream &deflater = gzip.deflater;
+  deflater.next_in = data;
+  deflater.avail_in = size;
+
+  while (true) {
+    if (gzip.pending == nullptr) {
+      ngx_chain_t *cl = ngx_chain_get_free_buf(pool, &free_);
+      if (cl == nullptr) {
+        return nullptr;
+      }
+      ngx_buf_t *buf = cl->buf;
+      ngx_memzero(buf, sizeof(ngx_buf_t));
+      buf->tag = (ngx_buf_tag_t)&ngx_http_datadog_module;
+      buf->start = static_cast<u_char *>(ngx_palloc(pool, gzip.kChunkSize));
+      if (buf->start == nullptr) {
+        ngx_log_error(NGX_LOG_ERR, pool->log, 0,
+                      "RUM SDK injection failed: insufficient memory "
+                      "available");
+        return nullptr;
+      }
+      buf->end = buf->start + gzip.kChunkSize;
+      buf->pos = buf->start;
+      buf->last = buf->start;
+      // freed by output() once sent
+      buf->temporary = 1;
+      gzip.pending = cl;
+    }
+
+    ngx_buf_t *buf = gzip.pending->buf;
+    deflater.next_out = buf->last;
+    deflater.avail_out = buf->end - buf->last;
+    if (deflate(&deflater, flush) == Z_STREAM_ERROR) {
+      ngx_log_error(NGX_LOG_ERR, pool->log, 0,
+                    "RUM SDK injection failed: deflate() failed");
+      return nullptr;
+    }
+    buf->last = deflater.next_out;
+
+    bool const full = deflater.avail_out == 0;
+    if (!full && (flush == Z_NO_FLUSH || buf->last == buf->pos)) {
+      // the rest is in the pending buffer or still in zlib
+      return out;
+    }
+
+    gzip.pending->next = nullptr;
+    *out = gzip.pending;
+    out = &gzip.pending->next;
+    gzip.last_out = buf;
+    gzip.pending = nullptr;
+    if (!full) {
+      return out;
+    }
+  }
+}
+
+ngx_chain_t **InjectionHandler::pass(ngx_pool_t *pool, ngx_buf_t &in,
+                                     ngx_chain_t **out) {
+  if (!(in.last_buf && output_padding_ && state_ == state::abandoned)) {
+    ngx_chain_t *cl = ngx_alloc_chain_link(pool);
+    if (cl == nullptr) {
+      return nullptr;
+    }
+    cl->buf = &in;
+    cl->next = nullptr;
+    *out = cl;
+    return &cl->next;
+  }
+
+  // the padding goes after the data of the last buffer, but before the flag
+  if (!ngx_buf_in_memory(&in) && in.in_file) {
+    return send_file_part(pool, in, in.file_pos, in.file_last, out, false);
+  }
+  if (in.last == in.pos) {
+    return out;
+  }
+  BytesSlice const whole{in.pos, static_cast<uint32_t>(in.last - in.pos)};
+  return inject(pool, in, std::span(&whole, 1), out, false);
+}
+
+ngx_chain_t **InjectionHandler::pad(ngx_http_request_t *r,
+                                    datadog_loc_conf_t *cfg, ngx_buf_t &in,
+                                    ngx_chain_t **out) {
+  state_ = state::failed;
+  auto end_result = injector_end(injector_);
+  std::span slices(end_result.slices, end_result.slices_length);
+
+  // the bytes held back when abandoning were already sent from the file; they
+  // come first
+  std::vector<BytesSlice> rest;
+  if (padding_skip_ > 0) {
+    size_t skip = padding_skip_;
+    for (BytesSlice slice : slices) {
+      size_t const n = std::min<size_t>(skip, slice.length);
+      skip -= n;
+      if (n < slice.length) {
+        rest.push_back(
+            {slice.start + n, static_cast<uint32_t>(slice.length - n)});
+      }
+    }
+    slices = rest;
+  }
+
+  ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                "RUM SDK injection failed: no injection point found");
+
+  datadog::telemetry::counter::increment(telemetry::injection_failed,
+                                         cfg->rum_tags.missing_header_tag);
+
+  return inject(r->pool, in, slices, out);
+}
+
+ngx_int_t InjectionHandler::on_log_request(ngx_http_request_t *r,
+                                           datadog_loc_conf_t *cfg) {
   if (auto csp = common::search_header(r->headers_out.headers,
                                        "content-security-policy");
       csp != nullptr) {
-    datadog::telemetry::counter::increment(
-        telemetry::injection_failed,
-        telemetry::build_tags("status:seen", "kind:header"));
+    static const auto csp_tags =
+        telemetry::build_tags("status:seen", "kind:header");
+    datadog::telemetry::counter::increment(telemetry::injection_failed,
+                                           csp_tags);
+  }
+
+  if (state_ == state::init) {
+    return NGX_OK;
+  }
+
+  if (state_ == state::error) {
+    datadog::telemetry::counter::increment(telemetry::injection_failed,
+                                           cfg->rum_tags.internal_error);
   }
 
+  datadog::telemetry::distribution::add(
+      telemetry::injection_duration,
+      (filter_time_.count() - next_filter_time_.count()) / 1000,
+      cfg->rum_tags.location);
+
   return NGX_OK;
 }
 
-// NOTE(@dmehala): this function is not necessary for now, however,
-// it will when we will reuse buffer.
 ngx_int_t InjectionHandler::output(
     ngx_http_request_t *r, ngx_chain_t *out,
     ngx_http_output_body_filter_pt &next_body_filter) {
-  return next_body_filter(r, out);
+  ngx_int_t rc;
+  {
+    Stopwatch stopwatch{next_filter_time_};
+    rc = next_body_filter(r, out);
+  }
+
+  // Like ngx_chain_update_chains(), but also consumes the buffers ours were
+  // cut from once they have been sent, so that their owner can reuse them.
+  if (busy_ == nullptr) {
+    busy_ = out;
+  } else {
+    ngx_chain_t *cl = busy_;
+    while (cl->next) {
+      cl = cl->next;
+    }
+    cl->next = out;
+  }
+
+  while (busy_) {
+    ngx_chain_t *cl = busy_;
+    ngx_buf_t *b = cl->buf;
+    if (ngx_buf_size(b) != 0) {
+      break;
+    }
+
+    busy_ = cl->next;
+    if (b->tag != (ngx_buf_tag_t)&ngx_http_datadog_module) {
+      ngx_free_chain(r->pool, cl);
+      continue;
+    }
+
+    if (b->shadow) {
+      b->shadow->pos = b->shadow->last;
+      b->shadow->file_pos = b->shadow->file_last;
+    }
+    if (b->temporary) {
+      ngx_pfree(r->pool, b->start);
+    }
+    cl->next = free_;
+    free_ = cl;
+  }
+
+  return rc;
 }
 
-// NOTE(@dmehala): Ideally for v2 the buffer should be reused to avoid
-// unnecessary allocation.
-ngx_chain_t *InjectionHandler::inject(ngx_pool_t *pool, ngx_chain_t *in,
-                                      std::span<const BytesSlice> slices) {
+ngx_chain_t **InjectionHandler::inject(ngx_pool_t *pool, ngx_buf_t &in,
+                                       std::span<const BytesSlice> slices,
+                                       ngx_chain_t **out, bool last) {
   assert(pool != nullptr);
-  assert(in != nullptr);
-  if (slices.empty()) {
-    return in;
+  assert(out != nullptr);
+
+  bool const in_memory = ngx_buf_in_memory(&in);
+  auto in_buffer = [&in, in_memory](const BytesSlice &slice) {
+    return in_memory && slice.start >= in.pos &&
+           slice.start + slice.length <= in.last;
+  };
+
+  if (last && in_memory && slices.size() == 1 && slices[0].start == in.pos &&
+      slices[0].length == static_cast<size_t>(in.last - in.pos)) {
+    // the buffer is unchanged: pass it on as is
+    return pass(pool, in, out);
+  }
+
+  ngx_buf_t *buf = nullptr;
+  for (size_t i = 0; i < slices.size();) {
+    if (slices[i].length == 0) {
+      i++;
+      continue;
+    }
+
+    out = append_buf(pool, out, buf);
+    if (out == nullptr) {
+      return nullptr;
+    }
+    buf->memory = 1;
+
+    if (in_buffer(slices[i])) {
+      // reference the response data, merging adjacent slices
+      buf->pos = const_cast<u_char *>(slices[i].start);
+      buf->last = buf->pos + slices[i].length;
+      for (i++; i < slices.size() && slices[i].start == buf->last &&
+                in_buffer(slices[i]);
+           i++) {
+        buf->last += slices[i].length;
+      }
+      // so that the write filter doesn't hold on to them
+      buf->recycled = in.recycled;
+    } else {
+      // the snippet or data held back from previous buffers. How long the
+      // injector keeps them around is up to it, so copy them
+      size_t end = i;
+      size_t needed = 0;
+      for (; end < slices.size() && !in_buffer(slices[end]); end++) {
+        needed += slices[end].length;
+      }
+
+      buf->start = static_cast<u_char *>(ngx_pnalloc(pool, needed));
+      if (buf->start == nullptr) {
+        ngx_log_error(NGX_LOG_ERR, pool->log, 0,
+                      "RUM SDK injection failed: insufficient memory "
+                      "available");
+        return nullptr;
+      }
+      buf->end = buf->start + needed;
+      buf->pos = buf->start;
+      buf->last = buf->start;
+      for (; i < end; i++) {
+        buf->last = ngx_cpymem(buf->last, slices[i].start, slices[i].length);
+      }
+    }
+  }
+
+  if (!last) {
+    return out;
   }
+  return finish(pool, in, buf, out);
+}
 
-  size_t needed = 0;
-  for (uint32_t i = 0; i < slices.size(); ++i) {
-    needed += slices[i].length;
+ngx_chain_t **InjectionHandler::send_file_part(ngx_pool_t *pool,
+                                               ngx_buf_t &in, off_t from,
+                                               off_t to, ngx_chain_t **out,
+                                               bool last) {
+  ngx_buf_t *buf = nullptr;
+  if (from < to) {
+    out = append_buf(pool, out, buf);
+    if (out == nullptr) {
+      return nullptr;
+    }
+    buf->in_file = 1;
+    buf->file = in.file;
+    buf->file_pos = from;
+    buf->file_last = to;
   }
 
-  ngx_chain_t *cl = ngx_alloc_chain_link(pool);
+  if (!last) {
+    return out;
+  }
+  return finish(pool, in, buf, out);
+}
+
+ngx_chain_t **InjectionHandler::append_buf(ngx_pool_t *pool, ngx_chain_t **out,
+                                           ngx_buf_t *&buf) {
+  ngx_chain_t *cl = ngx_chain_get_free_buf(pool, &free_);
   if (cl == nullptr) {
-    // NOTE(@dmehala): This might explain why we couldn't inject the SDK.
-    // It should stop looking for an injection point and report the injection
-    // as failed.
     ngx_log_error(NGX_LOG_ERR, pool->log, 0,
                   "RUM SDK injection failed: insufficient memory available");
-    return in;
+    return nullptr;
   }
+  buf = cl->buf;
+  ngx_memzero(buf, sizeof(ngx_buf_t));
+  buf->tag = (ngx_buf_tag_t)&ngx_http_datadog_module;
+  *out = cl;
+  return &cl->next;
+}
 
-  ngx_buf_t *buf = (ngx_buf_t *)ngx_calloc_buf(pool);
+ngx_chain_t **InjectionHandler::finish(ngx_pool_t *pool, ngx_buf_t &in,
+                                       ngx_buf_t *buf, ngx_chain_t **out) {
+  if (buf == nullptr) {
+    if (!in.flush && !in.sync && !in.last_buf) {
+      // nothing to send for now
+      in.pos = in.last;
+      in.file_pos = in.file_last;
+      return out;
+    }
 
-  buf->tag = (ngx_buf_tag_t)&ngx_http_datadog_module;
-  buf->memory = 1;
-  buf->start = (u_char *)ngx_pnalloc(pool, needed);
-  buf->end = buf->start + needed;
-  buf->pos = buf->start;
-  buf->last = buf->pos;
-  buf->flush = in->buf->flush;
-  buf->sync = in->buf->sync;
-  buf->last_buf = in->buf->last_buf;
-  buf->last_in_chain = in->buf->last_in_chain;
-
-  for (uint32_t i = 0; i < slices.size(); ++i) {
-    buf->last = ngx_cpymem(buf->last, slices[i].start, slices[i].length);
-  }
-
-  cl->buf = buf;
-  cl->next = in->next;
-
-  // NOTE(@dmehala): When a buffer is marked as recycled, it MUST be consumed by
-  // the filter otherwise, it could not be reused. A consumed buffer has its
-  // `pos` move towards `last`.
-  if (in->buf->recycled) {
-    in->buf->pos = in->buf->last;
-  }
-  return cl;
+    // an empty buffer just for the flags
+    out = append_buf(pool, out, buf);
+    if (out == nullptr) {
+      return nullptr;
+    }
+  }
+
+  buf->flush = in.flush;
+  buf->sync = in.sync;
+  buf->last_buf = in.last_buf;
+  buf->last_in_chain = in.last_in_chain;
+  buf->shadow = &in;
+  return out;
 }
 
 }  // namespace rum
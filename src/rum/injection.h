@@ -6,9 +6,14 @@ extern "C" {
 
 #include <injectbrowsersdk.h>
 
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
 #include <span>
 
 #include "datadog_conf.h"
+#include "offset_cache.h"
 
 namespace datadog {
 namespace nginx {
@@ -27,7 +32,9 @@ class InjectionHandler final {
     searching,
     injected,
     error,
-    failed,  ///< no injection point found
+    failed,     ///< no injection point found
+    abandoned,  ///< scan limit reached; only the padding is left to add
+    splicing,   ///< injection point known from the offset cache
   } state_ = state::init;
 
   // A flag indicating whether padding should be added to the HTML responses.
@@ -37,6 +44,35 @@ class InjectionHandler final {
   // Browser SDK needs to be injected.
   Injector *injector_;
 
+  // Buffers created by this filter, free for reuse or still being sent. The
+  // buffers they were cut from are only consumed once they are sent.
+  ngx_chain_t *free_ = nullptr;
+  ngx_chain_t *busy_ = nullptr;
+
+  // Bytes read from file buffers to look for the injection point.
+  size_t file_scanned_ = 0;
+  // Bytes given to the injector, and returned by it, before the injection.
+  // The difference is what it holds back.
+  size_t written_ = 0;
+  size_t returned_ = 0;
+  // Bytes of the padding already sent from the file when abandoning.
+  size_t padding_skip_ = 0;
+
+  // Identifies the response in the offset cache, if it can be.
+  std::optional<std::uint64_t> cache_key_;
+  // Where to splice the snippet in, in the `splicing` state.
+  InjectionOffsetCache<>::Entry splice_{};
+
+  // For gzip responses: decompresses the response, and compresses it again
+  // with the snippet.
+  struct GzipRecoder;
+  std::unique_ptr<GzipRecoder> gzip_;
+
+  // Time spent in the header and body filters, and in the filters after them
+  // when called from the body filter.
+  std::chrono::nanoseconds filter_time_{};
+  std::chrono::nanoseconds next_filter_time_{};
+
  public:
   InjectionHandler();
   ~InjectionHandler();
@@ -69,11 +105,13 @@ class InjectionHandler final {
 
   // Handles the logging phase of an HTTP request.
   // @param r - HTTP request being processed.
+  // @param cfg - Location configuration of the module.
   // @return ngx_int_t - Status code indicating success or failure.
-  ngx_int_t on_log_request(ngx_http_request_t *r);
+  ngx_int_t on_log_request(ngx_http_request_t *r, datadog_loc_conf_t *cfg);
 
  private:
-  // Sends the output to the next body filter.
+  // Sends the output to the next body filter, then releases the buffers
+  // that were sent.
   // @param r - HTTP request being processed.
   // @param out - Chain of buffers containing the response to send.
   // @param next_body_filter - Reference to the next body filter in the NGINX
@@ -81,15 +119,78 @@ class InjectionHandler final {
   ngx_int_t output(ngx_http_request_t *r, ngx_chain_t *out,
                    ngx_http_output_body_filter_pt &next_body_filter);
 
-  // Injects the RUM Browser SDK into a chain of buffers at the appropriate
-  // location.
+  // Looks for the injection point in a buffer in memory.
+  ngx_chain_t **scan_memory(ngx_http_request_t *r, datadog_loc_conf_t *cfg,
+                            ngx_buf_t &in, ngx_chain_t **out);
+
+  // Looks for the injection point in the first bytes of a file buffer, up to
+  // the location's `datadog_rum_file_scan_size`; the rest of the file is sent
+  // as a file buffer.
+  ngx_chain_t **scan_file(ngx_http_request_t *r, datadog_loc_conf_t *cfg,
+                          ngx_buf_t &in, ngx_chain_t **out);
+
+  // Splices the snippet in at the offset found in the cache, once the bytes
+  // preceding it have been checked. Otherwise, falls back to looking for the
+  // injection point from this buffer on.
+  ngx_chain_t **splice(ngx_http_request_t *r, datadog_loc_conf_t *cfg,
+                       ngx_buf_t &in, ngx_chain_t **out);
+
+  // Records in the offset cache where the injector inserted the snippet.
+  // @param data, size - What was given to the injector in the last call.
+  // @param slices - What it returned.
+  void remember_offset(datadog_loc_conf_t *cfg, const u_char *data,
+                       size_t size, std::span<const BytesSlice> slices);
+
+  // Decompresses a buffer of a gzip response, injects into the result while
+  // looking for the injection point and compresses it again.
+  ngx_chain_t **recode(ngx_http_request_t *r, datadog_loc_conf_t *cfg,
+                       ngx_buf_t &in, ngx_chain_t **out);
+
+  // Looks for the injection point in decompressed data, if still needed, and
+  // compresses it with what the injector returns.
+  ngx_chain_t **recode_plain(ngx_http_request_t *r, datadog_loc_conf_t *cfg,
+                             const u_char *data, size_t size,
+                             ngx_chain_t **out);
+
+  // Compresses data, appending the compressed buffers as they are filled.
+  // With a `flush` other than Z_NO_FLUSH, the last one is appended too.
+  ngx_chain_t **compress(ngx_pool_t *pool, const u_char *data, size_t size,
+                         int flush, ngx_chain_t **out);
+
+  // Passes on a buffer once there is nothing more to look for.
+  ngx_chain_t **pass(ngx_pool_t *pool, ngx_buf_t &in, ngx_chain_t **out);
+
+  // Appends what the injector outputs at the end of the response when the
+  // content length was increased for the snippet.
+  ngx_chain_t **pad(ngx_http_request_t *r, datadog_loc_conf_t *cfg,
+                    ngx_buf_t &in, ngx_chain_t **out);
+
+  // Appends a buffer for the part of `in`'s file from `from` to `to`.
+  ngx_chain_t **send_file_part(ngx_pool_t *pool, ngx_buf_t &in, off_t from,
+                               off_t to, ngx_chain_t **out, bool last);
+
+  // Appends buffers for the slices returned by the injector for a buffer of
+  // the response. Slices of the buffer itself are referenced, not copied;
+  // the buffer is consumed once they are sent.
   // @param pool - Memory pool used for allocation.
-  // @param in - Incoming chain of buffers containing the response body.
-  // @param slices - Pointer to an array of `BytesSlice`.
-  // @param slices_length - Number of elements in the `slices` array.
-  // @return ngx_chain_t* - Chain of buffers with the injected data.
-  ngx_chain_t *inject(ngx_pool_t *pool, ngx_chain_t *in,
-                      std::span<const BytesSlice> slices);
+  // @param in - Buffer of the response body the slices were computed for.
+  // @param slices - Array of `BytesSlice`.
+  // @param out - Where to append the buffers.
+  // @param last - Whether these are the last slices for `in`, in which case
+  // its flags are carried over.
+  // @return ngx_chain_t** - The new end of the chain, or nullptr on error.
+  ngx_chain_t **inject(ngx_pool_t *pool, ngx_buf_t &in,
+                       std::span<const BytesSlice> slices, ngx_chain_t **out,
+                       bool last = true);
+
+  // Takes a free buffer of this filter and appends it to `out`.
+  ngx_chain_t **append_buf(ngx_pool_t *pool, ngx_chain_t **out,
+                           ngx_buf_t *&buf);
+
+  // Carries the flags of `in` over to `buf`, the last buffer created for it
+  // (if any), and has `in` consumed once `buf` is sent.
+  ngx_chain_t **finish(ngx_pool_t *pool, ngx_buf_t &in, ngx_buf_t *buf,
+                       ngx_chain_t **out);
 };
 
 }  // namespace rum
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace datadog {
+namespace nginx {
+namespace rum {
+
+// Remembers where the RUM SDK was injected into responses that can be
+// identified across requests (by location, URI, validator and length), so
+// that the snippet can be spliced in at the same offset without running the
+// injector over the response. A few bytes preceding the offset are kept to
+// check that the response is the same before relying on the entry.
+// Per worker process; not thread-safe.
+//
+// The table is direct-mapped: an entry can be evicted by another one hashing
+// to the same slot, which at worst results in another scan of the response.
+template <std::size_t Slots = 1024>
+class InjectionOffsetCache {
+  static_assert(Slots > 0 && (Slots & (Slots - 1)) == 0,
+                "Slots must be a power of 2");
+
+ public:
+  static constexpr std::size_t kMaxContext = 32;
+
+  struct Entry {
+    std::uint64_t key;
+    // offset in the original response at which the snippet was inserted
+    std::uint64_t offset;
+    // the bytes of the response right before the offset
+    std::array<unsigned char, kMaxContext> context;
+    std::uint8_t context_len;
+    // the bytes inserted; owned by the cache
+    const std::string *snippet;
+  };
+
+  const Entry *find(std::uint64_t key) const noexcept {
+    const Entry &entry = slots_[key & (Slots - 1)];
+    if (entry.snippet == nullptr || entry.key != key) {
+      return nullptr;
+    }
+    return &entry;
+  }
+
+  // `snippet_id` identifies the configured snippet whose output `snippet` is;
+  // a copy is kept once for all the entries sharing it. Only the last
+  // kMaxContext bytes of `context` are kept.
+  void store(std::uint64_t key, std::uint64_t offset, std::string_view context,
+             const void *snippet_id, std::string_view snippet) {
+    auto [it, inserted] = snippets_.try_emplace(snippet_id, snippet);
+    if (!inserted && it->second != snippet) {
+      // shouldn't happen; don't change the bytes entries point to
+      return;
+    }
+
+    context = context.substr(context.size() -
+                             std::min(context.size(), kMaxContext));
+
+    Entry &entry = slots_[key & (Slots - 1)];
+    entry.key = key;
+    entry.offset = offset;
+    std::copy(context.begin(), context.end(), entry.context.begin());
+    entry.context_len = static_cast<std::uint8_t>(context.size());
+    entry.snippet = &it->second;
+  }
+
+  void evict(std::uint64_t key) noexcept {
+    Entry &entry = slots_[key & (Slots - 1)];
+    if (entry.key == key) {
+      entry.snippet = nullptr;
+    }
+  }
+
+ private:
+  std::array<Entry, Slots> slots_{};
+  std::unordered_map<const void *, std::string> snippets_;
+};
+
+}  // namespace rum
+}  // namespace nginx
+}  // namespace datadog
@@ -26,6 +26,41 @@ const datadog::telemetry::Counter injection_failed = {"injection.failed", "rum",
 const datadog::telemetry::Counter content_security_policy = {
     "injection.content_security_policy", "rum", true};
 
+const datadog::telemetry::Distribution gzip_recoding_time = {
+    "injection.gzip.cpu_time", "rum", true};
+
+const datadog::telemetry::Distribution injection_duration = {
+    "injection.duration", "rum", true};
+
+const std::vector<std::string>& common_tags() {
+  static const std::vector<std::string> tags{
+      "integration_name:nginx",
+      "injector_version:0.1.0",
+      std::format("integration_version:{}",
+                  std::string_view(datadog_semver_nginx_mod)),
+  };
+  return tags;
+}
+
+LocationTags make_location_tags(const std::string& application_id_tag,
+                                const std::string& remote_config_tag) {
+  return {
+      .location = build_tags(application_id_tag, remote_config_tag),
+      .already_injected = build_tags("reason:already_injected",
+                                     application_id_tag, remote_config_tag),
+      .no_content = build_tags("reason:no_content", application_id_tag,
+                               remote_config_tag),
+      .invalid_content_type = build_tags("reason:invalid_content_type",
+                                         application_id_tag, remote_config_tag),
+      .compressed_html = build_tags("reason:compressed_html",
+                                    application_id_tag, remote_config_tag),
+      .missing_header_tag = build_tags("reason:missing_header_tag",
+                                       application_id_tag, remote_config_tag),
+      .internal_error = build_tags("reason:internal_error", application_id_tag,
+                                   remote_config_tag),
+  };
+}
+
 }  // namespace telemetry
 }  // namespace rum
 }  // namespace nginx
@@ -13,21 +13,45 @@ namespace nginx {
 namespace rum {
 namespace telemetry {
 
+// Tags added to those of every RUM metric.
+const std::vector<std::string>& common_tags();
+
 template <typename... T>
 auto build_tags(T&&... specific_tags) {
   std::vector<std::string> tags{std::forward<T>(specific_tags)...};
-  tags.emplace_back("integration_name:nginx");
-  tags.emplace_back("injector_version:0.1.0");
-  tags.emplace_back(std::format("integration_version:{}",
-                                std::string_view(datadog_semver_nginx_mod)));
-
+  const auto& common = common_tags();
+  tags.insert(tags.end(), common.begin(), common.end());
   return tags;
 }
 
+// Tags of the RUM metrics of a location. Built when merging the location
+// configuration rather than on each request.
+struct LocationTags {
+  // only the tags of the location; for injections that succeeded
+  std::vector<std::string> location;
+  // the reasons injection was skipped
+  std::vector<std::string> already_injected;
+  std::vector<std::string> no_content;
+  std::vector<std::string> invalid_content_type;
+  std::vector<std::string> compressed_html;
+  // the reasons injection failed
+  std::vector<std::string> missing_header_tag;
+  std::vector<std::string> internal_error;
+};
+
+LocationTags make_location_tags(const std::string& application_id_tag,
+                                const std::string& remote_config_tag);
+
 const extern datadog::telemetry::Counter injection_skipped;
 const extern datadog::telemetry::Counter injection_succeed;
 const extern datadog::telemetry::Counter injection_failed;
 const extern datadog::telemetry::Counter content_security_policy;
+// CPU time, in microseconds, spent decompressing and compressing again a gzip
+// response to inject into it
+const extern datadog::telemetry::Distribution gzip_recoding_time;
+// Time, in microseconds, spent by the RUM filters on a response, not counting
+// the filters after them
+const extern datadog::telemetry::Distribution injection_duration;
 
 }  // namespace telemetry
 }  // namespace rum
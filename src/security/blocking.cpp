@@ -7,6 +7,7 @@
 #include <sstream>
 #include <string_view>
 
+#include "compress.h"
 #include "util.h"
 
 extern "C" {
@@ -259,6 +260,62 @@ struct BlockResponse {
   }
 };
 
+#if (NGX_HTTP_GZIP)
+// Whether the Accept-Encoding header lists gzip without q=0. Unlike
+// ngx_http_gzip_ok(), this doesn't depend on the gzip module configuration
+bool accepts_gzip(const ngx_http_request_t &req) {
+  if (req.headers_in.accept_encoding == nullptr) {
+    return false;
+  }
+
+  auto is_space = [](char c) { return c == ' ' || c == '\t'; };
+  auto trim = [&](std::string_view sv) {
+    while (!sv.empty() && is_space(sv.front())) {
+      sv.remove_prefix(1);
+    }
+    while (!sv.empty() && is_space(sv.back())) {
+      sv.remove_suffix(1);
+    }
+    return sv;
+  };
+  auto equals_ci = [](std::string_view a, std::string_view b) {
+    return a.size() == b.size() &&
+           std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+             return datadog::nginx::to_lower(x) == y;
+           });
+  };
+
+  std::string_view rest =
+      datadog::nginx::to_string_view(req.headers_in.accept_encoding->value);
+  while (!rest.empty()) {
+    auto comma = rest.find(',');
+    std::string_view elem = rest.substr(0, comma);
+    rest = comma == std::string_view::npos ? ""sv : rest.substr(comma + 1);
+
+    auto semicolon = elem.find(';');
+    std::string_view coding = trim(elem.substr(0, semicolon));
+    if (!equals_ci(coding, "gzip"sv) && !equals_ci(coding, "x-gzip"sv)) {
+      continue;
+    }
+    if (semicolon == std::string_view::npos) {
+      return true;
+    }
+
+    std::string_view param = trim(elem.substr(semicolon + 1));
+    if (param.size() < 2 || datadog::nginx::to_lower(param[0]) != 'q' ||
+        param[1] != '=') {
+      return true;
+    }
+    // q=0, q=0.0, ... disallow gzip
+    std::string_view qvalue = trim(param.substr(2));
+    return qvalue.empty() || qvalue[0] != '0' ||
+           qvalue.find_first_not_of("0."sv) != std::string_view::npos;
+  }
+
+  return false;
+}
+#endif
+
 const std::string_view kDefaultTemplateHtml{
     "<!DOCTYPE html><html lang=\"en\"><head><meta charset=\"UTF-8\"><meta "
     "name=\"viewport\" "
@@ -309,15 +366,21 @@ void BlockingService::initialize(std::optional<std::string_view> templ_html,
 ngx_int_t BlockingService::block(BlockSpecification spec,
                                  ngx_http_request_t &req) {
   BlockResponse const resp = BlockResponse::resolve_content_type(spec, req);
-  ngx_str_t *templ{};
+  const PreparedBody *body{};
   if (resp.ct == BlockResponse::ContentType::HTML) {
-    templ = &templ_html_;
+    body = &html_body_;
   } else if (resp.ct == BlockResponse::ContentType::JSON) {
-    templ = &templ_json_;
+    body = &json_body_;
   } else {
     req.header_only = 1;
   }
 
+  bool gzipped = false;
+#if (NGX_HTTP_GZIP)
+  gzipped = body && !req.header_only && !body->gzipped.empty() &&
+            accepts_gzip(req);
+#endif
+
   if (ngx_http_discard_request_body(&req) != NGX_OK) {
     req.keepalive = 0;
   }
@@ -344,6 +407,16 @@ ngx_int_t BlockingService::block(BlockSpecification spec,
   if (!resp.location.empty()) {
     push_header(req, "Location"sv, resp.location);
   }
+#if (NGX_HTTP_GZIP)
+  if (body && !req.header_only) {
+    push_header(req, "Vary"sv, "Accept-Encoding"sv);
+  }
+  if (gzipped) {
+    // also keeps the gzip filter from compressing it again
+    req.headers_out.content_encoding =
+        push_header(req, "Content-Encoding"sv, "gzip"sv);
+  }
+#endif
   // Filters may change the response, invalidating this length
   //   if (templ) {
   //     req.headers_out.content_length_n = static_cast<off_t>(templ->len);
@@ -376,8 +449,9 @@ ngx_int_t BlockingService::block(BlockSpecification spec,
     return NGX_ERROR;
   }
 
-  b->pos = templ->data;
-  b->last = templ->data + templ->len;
+  ngx_str_t data = gzipped ? ngx_stringv(body->gzipped) : body->plain;
+  b->pos = data.data;
+  b->last = data.data + data.len;
   b->last_buf = 1;
   b->memory = 1;
 
@@ -394,17 +468,25 @@ BlockingService::BlockingService(
     std::optional<std::string_view> templ_html_path,
     std::optional<std::string_view> templ_json_path) {
   if (!templ_html_path) {
-    templ_html_ = ngx_stringv(kDefaultTemplateHtml);
+    html_body_.prepare(kDefaultTemplateHtml);
   } else {
     custom_templ_html_ = load_template(*templ_html_path);
-    templ_html_ = ngx_stringv(custom_templ_html_);
+    html_body_.prepare(custom_templ_html_);
   }
 
   if (!templ_json_path) {
-    templ_json_ = ngx_stringv(kDefaultTemplateJson);
+    json_body_.prepare(kDefaultTemplateJson);
   } else {
     custom_templ_json_ = load_template(*templ_json_path);
-    templ_json_ = ngx_stringv(custom_templ_json_);
+    json_body_.prepare(custom_templ_json_);
+  }
+}
+
+void BlockingService::PreparedBody::prepare(std::string_view templ) {
+  plain = ngx_stringv(templ);
+  auto compressed = compress(templ);
+  if (compressed && compressed->size() < templ.size()) {
+    gzipped = *compressed;
   }
 }
 
@@ -421,17 +503,18 @@ std::string BlockingService::load_template(std::string_view path) {
   return s.str();
 }
 
-void BlockingService::push_header(ngx_http_request_t &req,
-                                  std::string_view name,  // NOLINT
-                                  std::string_view value) {
+ngx_table_elt_t *BlockingService::push_header(ngx_http_request_t &req,
+                                              std::string_view name,  // NOLINT
+                                              std::string_view value) {
   ngx_table_elt_t *header =
       static_cast<ngx_table_elt_t *>(ngx_list_push(&req.headers_out.headers));
   if (!header) {
-    return;
+    return nullptr;
   }
   header->hash = 1;
   header->key = ngx_stringv(name);
   header->value = ngx_stringv(value);
+  return header;
 }
 
 }  // namespace datadog::nginx::security
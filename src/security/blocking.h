@@ -44,11 +44,21 @@ class BlockingService {
 
   static std::string load_template(std::string_view path);
 
-  static void push_header(ngx_http_request_t &req, std::string_view name,
-                          std::string_view value);
+  static ngx_table_elt_t *push_header(ngx_http_request_t &req,
+                                      std::string_view name,
+                                      std::string_view value);
 
-  ngx_str_t templ_html_{};
-  ngx_str_t templ_json_{};
+  // A response body, prepared on initialization. Requests reference it
+  // directly, without copying
+  struct PreparedBody {
+    ngx_str_t plain{};
+    std::string gzipped;  // empty if compression failed
+
+    void prepare(std::string_view templ);
+  };
+
+  PreparedBody html_body_;
+  PreparedBody json_body_;
   std::string custom_templ_html_;
   std::string custom_templ_json_;
 };
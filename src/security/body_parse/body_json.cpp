@@ -1,9 +1,13 @@
 #include "body_json.h"
 
 #include <rapidjson/error/en.h>
+#include <rapidjson/memorystream.h>
 #include <rapidjson/reader.h>
 
 #include <algorithm>
+#include <cstddef>
+#include <string_view>
+#include <vector>
 
 #include "../ddwaf_memres.h"
 #include "../ddwaf_obj.h"
@@ -91,200 +95,287 @@ class RapidNgxChainInputStream {
 };
 
 /* Rapidjson event handler for serializing into ddwaf_obj, allowing for
- * truncated input */
+ * truncated input.
+ *
+ * The children of the open containers are kept in a single stack, and each
+ * container gets an array of the exact size when it's closed, so nothing is
+ * reallocated. Data the WAF won't look at (see kWafMaxContainerSize and
+ * friends) is not stored, and the parsing is stopped as soon as the top-level
+ * container is full. */
 class ToDdwafObjHandler
     : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>,
                                           ToDdwafObjHandler> {
  public:
   ToDdwafObjHandler(ddwaf_obj &slot, dnsec::DdwafMemres &memres)
-      : pool_{memres}, memres_{memres}, bufs_{{&slot, 0, 1}} {}
+      : slot_{slot}, memres_{memres} {
+    // pseudo-container for the top-level value
+    levels_.push_back(Level{.start = 0, .parent = 0, .is_map = false});
+  }
+
+  // Strings without escapes are referenced in body instead of being copied.
+  // is must be reading body, which must outlive the WAF context
+  void reference_strings_in(std::string_view body,
+                            const rapidjson::MemoryStream &is) {
+    body_ = body;
+    body_is_ = &is;
+  }
+
+  bool stopped_at_limits() const noexcept { return stopped_at_limits_; }
 
   ddwaf_obj *finish(const ngx_http_request_t &req) {
-    if (bufs_.size() != 1) {
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, req.connection->log, 0,
-                    "json parsing finished prematurely");
-      while (bufs_.size() > 1) {
+    if (levels_.size() != 1) {
+      if (!stopped_at_limits_) {
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, req.connection->log, 0,
+                      "json parsing finished prematurely");
+      }
+      while (levels_.size() > 1) {
         pop_container();
       }
     }
 
-    if (bufs_.back().len == 0) {
-      // should not happen
-      return nullptr;
-    }
-
-    auto &buf = bufs_.back();
-    if (buf.len > 1) {
-      // should not happen
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, req.connection->log, 0,
-                    "json parsing finished with multiple top-level objects");
-    } else if (buf.len == 0) {
-      // should not happen
+    if (stack_.empty()) {
       ngx_log_debug(NGX_LOG_DEBUG_HTTP, req.connection->log, 0,
                     "json parsing finished without producing any object");
       return nullptr;
     }
 
-    return &buf.cur_obj();
+    // keeps the key of slot, if any
+    slot_.shallow_copy_val_from(stack_.front());
+    return &slot_;
   }
 
   bool Null() {
-    get_slot().make_null();
-    return true;
+    if (ddwaf_obj *slot = value_slot()) {
+      slot->make_null();
+    }
+    return !stopped_at_limits_;
   }
 
   bool Bool(bool b) {
-    get_slot().make_bool(b);
-    return true;
+    if (ddwaf_obj *slot = value_slot()) {
+      slot->make_bool(b);
+    }
+    return !stopped_at_limits_;
   }
 
-  bool Int(int i) {
-    get_slot().make_number(i);
-    return true;
-  }
+  bool Int(int i) { return Number(i); }
 
-  bool Uint(unsigned u) {
-    get_slot().make_number(u);
-    return true;
-  }
+  bool Uint(unsigned u) { return Number(u); }
 
-  bool Int64(int64_t i) {
-    get_slot().make_number(i);
-    return true;
-  }
+  bool Int64(int64_t i) { return Number(i); }
 
-  bool Uint64(uint64_t u) {
-    get_slot().make_number(u);
-    return true;
-  }
+  bool Uint64(uint64_t u) { return Number(u); }
 
-  bool Double(double d) {
-    get_slot().make_number(d);
-    return true;
-  }
+  bool Double(double d) { return Number(d); }
 
-  bool String(const char *str, rapidjson::SizeType length, bool copy) {
-    std::string_view sv{str, length};
-    get_slot().make_string(sv, memres_);
-    return true;
+  bool String(const char *str, rapidjson::SizeType length, bool /*copy*/) {
+    if (ddwaf_obj *slot = value_slot()) {
+      std::string_view sv = stable_string(str, length);
+      if (sv.data() == str) {
+        slot->make_string(sv.substr(0, dnsec::kWafMaxStringLength), memres_);
+      } else {
+        slot->make_string(sv.substr(0, dnsec::kWafMaxStringLength));
+      }
+    }
+    return !stopped_at_limits_;
   }
 
-  bool Key(const char *str, rapidjson::SizeType length, bool copy) {
-    std::string_view sv{str, length};
-    get_slot_for_key().set_key(sv, memres_);
+  bool Key(const char *str, rapidjson::SizeType length, bool /*copy*/) {
+    if (skip_depth_ > 0) {
+      return true;
+    }
 
+    Level &level = levels_.back();
+    assert(level.is_map && !level.key_last);
+    if (stack_.size() - level.start >= dnsec::kWafMaxContainerSize) {
+      // the value will be dropped too
+      stopped_at_limits_ = levels_.size() == 2;
+      return !stopped_at_limits_;
+    }
+
+    ddwaf_obj &entry = stack_.emplace_back();
+    std::string_view sv = stable_string(str, length);
+    if (sv.data() == str) {
+      entry.set_key(sv, memres_);
+    } else {
+      entry.set_key(sv);
+    }
+    level.key_last = true;
     return true;
   }
 
   bool StartObject() {
-    push_map();
-    return true;
+    start_container(true);
+    return !stopped_at_limits_;
   }
 
   bool EndObject(rapidjson::SizeType /*memberCount*/) {
-    pop_container();
+    end_container();
     return true;
   }
 
   bool StartArray() {
-    push_array();
-    return true;
+    start_container(false);
+    return !stopped_at_limits_;
   }
 
   bool EndArray(rapidjson::SizeType /*elementCount*/) {
-    pop_container();
+    end_container();
     return true;
   }
 
  private:
-  dnsec::DdwafObjArrPool<ddwaf_obj> pool_;
-  dnsec::DdwafMemres &memres_;
-  struct Buf {
-    ddwaf_obj *ptr;
-    std::size_t len;
-    std::size_t cap;
-    bool key_last;
-
-    auto cur_obj() -> ddwaf_obj & {
-      assert(len > 0);
-      return ptr[len - 1];
-    }
+  struct Level {
+    std::size_t start;   // index in stack_ of the first child
+    std::size_t parent;  // index in stack_ of the container itself
+    bool is_map;
+    bool key_last{false};
   };
-  std::vector<Buf> bufs_{{nullptr, 0, 0}};
 
-  ddwaf_obj &get_slot() { return do_get_slot(false); }
+  ddwaf_obj &slot_;
+  dnsec::DdwafMemres &memres_;
+  std::vector<ddwaf_obj> stack_;
+  std::vector<Level> levels_;
+  // number of nested containers being skipped
+  std::size_t skip_depth_{0};
+  bool stopped_at_limits_{false};
+  std::string_view body_;
+  const rapidjson::MemoryStream *body_is_{};
+
+  template <typename T>
+  bool Number(T value) {
+    if (ddwaf_obj *slot = value_slot()) {
+      slot->make_number(value);
+    }
+    return !stopped_at_limits_;
+  }
 
-  ddwaf_obj &get_slot_for_key() { return do_get_slot(true); }
+  // Returns the string as it appears in body_, if it has no escapes, so it can
+  // be referenced. Otherwise returns the parser's temporary copy
+  std::string_view stable_string(const char *str,
+                                 rapidjson::SizeType length) const {
+    if (!body_is_) {
+      return {str, length};
+    }
 
-  ddwaf_obj &do_get_slot(bool for_key) {
-    auto &buf = bufs_.back();
-    assert(!for_key || !buf.key_last);  // no two keys in succession
-    if (buf.key_last) {
-      auto &ret = buf.cur_obj();
-      buf.key_last = false;
-      return ret;
+    // the stream is past the closing quote. If the length of the string is
+    // the same as its raw form's, it has no escapes, because they're all longer
+    // than what they decode into. Any backslash in the last length raw chars
+    // would be from an escape, and if the escapes were all before those chars
+    // the decoded string would be longer than length
+    std::size_t end = body_is_->Tell();
+    if (end < std::size_t{length} + 2 || body_[end - 1] != '"') {
+      return {str, length};
     }
+    std::string_view raw = body_.substr(end - 1 - length, length);
+    if (body_[end - 2 - length] != '"' ||
+        raw.find('\\') != std::string_view::npos) {
+      return {str, length};
+    }
+    return raw;
+  }
 
-    if (for_key) {
-      buf.key_last = true;
+  // Returns the object to hold the next value, or nullptr if the WAF would
+  // not look at it
+  ddwaf_obj *value_slot() {
+    if (skip_depth_ > 0) {
+      return nullptr;
     }
 
-    if (buf.len < buf.cap) {
-      buf.len++;
-      return buf.ptr[buf.len - 1];
+    Level &level = levels_.back();
+    if (level.key_last) {
+      level.key_last = false;
+      return &stack_.back();
+    }
+    if (level.is_map) {
+      // dropped key
+      return nullptr;
     }
 
-    std::size_t new_cap = std::max(buf.cap * 2, 1UL);
-    buf.ptr = pool_.realloc(buf.ptr, buf.cap, new_cap);
+    std::size_t max_children =
+        levels_.size() == 1 ? 1 : dnsec::kWafMaxContainerSize;
+    if (stack_.size() - level.start >= max_children) {
+      stopped_at_limits_ = levels_.size() <= 2;
+      return nullptr;
+    }
 
-    buf.len++;
-    buf.cap = new_cap;
-    return buf.cur_obj();
+    return &stack_.emplace_back();
   }
 
-  void push_array() {
-    auto &slot = get_slot();
-    slot.type = DDWAF_OBJ_ARRAY;
-    bufs_.emplace_back(Buf{nullptr, 0, 0});
+  void start_container(bool is_map) {
+    ddwaf_obj *slot = value_slot();
+    if (!slot) {
+      skip_depth_++;
+      return;
+    }
+
+    if (is_map) {
+      slot->make_map(nullptr, 0);
+    } else {
+      slot->make_array(nullptr, 0);
+    }
+
+    // the top-level value is at depth 0; below the max depth, keep the
+    // container, but not its children
+    if (levels_.size() > dnsec::kWafMaxContainerDepth) {
+      skip_depth_++;
+      return;
+    }
+
+    auto parent = static_cast<std::size_t>(slot - stack_.data());
+    levels_.push_back(
+        Level{.start = stack_.size(), .parent = parent, .is_map = is_map});
   }
 
-  void push_map() {
-    auto &slot = get_slot();
-    slot.type = DDWAF_OBJ_MAP;
-    bufs_.emplace_back(Buf{nullptr, 0, 0});
+  void end_container() {
+    if (skip_depth_ > 0) {
+      skip_depth_--;
+      return;
+    }
+    pop_container();
   }
 
   void pop_container() {
-    Buf buf_arr = bufs_.back();
-    bufs_.pop_back();
-    auto &buf_cont = bufs_.back();
-    ddwaf_obj &slot = buf_cont.cur_obj();
-    slot.nbEntries = buf_arr.len;
-    slot.array = buf_arr.ptr;
+    Level level = levels_.back();
+    levels_.pop_back();
+
+    std::size_t count = stack_.size() - level.start;
+    if (level.is_map && level.key_last) {
+      // truncated input: key without value
+      count--;
+    }
+
+    ddwaf_obj *children = memres_.allocate_objects<ddwaf_obj>(count);
+    std::copy_n(stack_.begin() + static_cast<std::ptrdiff_t>(level.start),
+                count, children);
+    stack_.resize(level.start);
+
+    ddwaf_obj &container = stack_[level.parent];
+    container.array = children;
+    container.nbEntries = count;
   }
 };
 
 }  // namespace
 
-namespace datadog::nginx::security {
-
-bool parse_json(ddwaf_obj &slot, const ngx_http_request_t &req,
-                const ngx_chain_t &chain, size_t limit,
-                dnsec::DdwafMemres &memres) {
-  // be as permissive as possible
-  static constexpr unsigned parse_flags =
-      rapidjson::kParseStopWhenDoneFlag |
-      rapidjson::kParseEscapedApostropheFlag | rapidjson::kParseNanAndInfFlag |
-      rapidjson::kParseTrailingCommasFlag | rapidjson::kParseCommentsFlag |
-      rapidjson::kParseIterativeFlag;
-
-  ToDdwafObjHandler handler{slot, memres};
+namespace {
+// be as permissive as possible
+constexpr unsigned kParseFlags =
+    rapidjson::kParseStopWhenDoneFlag | rapidjson::kParseEscapedApostropheFlag |
+    rapidjson::kParseNanAndInfFlag | rapidjson::kParseTrailingCommasFlag |
+    rapidjson::kParseCommentsFlag | rapidjson::kParseIterativeFlag;
+
+template <typename InputStream>
+bool do_parse_json(ToDdwafObjHandler &handler, InputStream &is,
+                   const ngx_http_request_t &req, ddwaf_obj &slot) {
   rapidjson::Reader reader;
-  RapidNgxChainInputStream is{&chain, limit};
   rapidjson::ParseResult res =
-      reader.Parse<parse_flags, RapidNgxChainInputStream>(is, handler);
+      reader.Parse<kParseFlags, InputStream>(is, handler);
   ddwaf_obj *json_obj = handler.finish(req);
-  if (res.IsError()) {
+  if (handler.stopped_at_limits()) {
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, req.connection->log, 0,
+                  "json parsing stopped: the WAF would ignore the rest");
+  } else if (res.IsError()) {
     if (json_obj) {
       ngx_log_debug(NGX_LOG_DEBUG_HTTP, req.connection->log, 0,
                     "json parsing failed after producing some output: %s",
@@ -302,5 +393,34 @@ bool parse_json(ddwaf_obj &slot, const ngx_http_request_t &req,
   assert(json_obj == nullptr || json_obj == &slot);
   return json_obj != nullptr;
 }
+}  // namespace
+
+namespace datadog::nginx::security {
+
+bool parse_json(ddwaf_obj &slot, const ngx_http_request_t &req,
+                const ngx_chain_t &chain, size_t limit,
+                dnsec::DdwafMemres &memres) {
+  ToDdwafObjHandler handler{slot, memres};
+
+  const ngx_buf_t *buf = chain.buf;
+  if (buf && ngx_buf_in_memory(buf) &&
+      static_cast<std::size_t>(buf->last - buf->pos) >= limit) {
+    // contiguous, but may not outlive the WAF context: strings are copied
+    rapidjson::MemoryStream is{reinterpret_cast<const char *>(buf->pos),
+                               limit};
+    return do_parse_json(handler, is, req, slot);
+  }
+
+  RapidNgxChainInputStream is{&chain, limit};
+  return do_parse_json(handler, is, req, slot);
+}
+
+bool parse_json(ddwaf_obj &slot, const ngx_http_request_t &req,
+                std::string_view body, DdwafMemres &memres) {
+  ToDdwafObjHandler handler{slot, memres};
+  rapidjson::MemoryStream is{body.data(), body.size()};
+  handler.reference_strings_in(body, is);
+  return do_parse_json(handler, is, req, slot);
+}
 
 }  // namespace datadog::nginx::security
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <string_view>
+
 #include "../ddwaf_obj.h"
 
 extern "C" {
@@ -12,4 +14,8 @@ namespace datadog::nginx::security {
 bool parse_json(ddwaf_obj &slot, const ngx_http_request_t &req,
                 const ngx_chain_t &chain, size_t limit, DdwafMemres &memres);
 
+// body must outlive the WAF context: strings without escapes reference it
+bool parse_json(ddwaf_obj &slot, const ngx_http_request_t &req,
+                std::string_view body, DdwafMemres &memres);
+
 }  // namespace datadog::nginx::security
@@ -1,8 +1,10 @@
 #include "body_multipart.h"
 
+#include <algorithm>
+#include <functional>
 #include <map>
+#include <string>
 #include <string_view>
-#include <utility>
 
 #include "../ddwaf_memres.h"
 #include "../ddwaf_obj.h"
@@ -13,242 +15,281 @@ extern "C" {
 #include <ngx_core.h>
 }
 
+using namespace std::literals;
+
 namespace dnsec = datadog::nginx::security;
 
 namespace {
-enum class LineType { BOUNDARY, BOUNDARY_END, OTHER, END_OF_FILE };
+enum class LineType { BOUNDARY, BOUNDARY_END, END_OF_FILE };
 
-/*
- * Returns a lambda that reads data line by line.
- *
- * If the return is LineType::BOUNDARY or LineType::BOUNDARY_END, the boundary
- * was found in the begginning of the current line. It consumes the full line,
- * regardless of its size.
- *
- * If the return is LineType::END_OF_FILE, no data was read; we reached EOF.
- *
- * If the return is LineType::OTHER, the boundary is not found, and the line is
- * fully read (and possibly stored in the append string, if given), until
- * either LF or EOF is found.
- */
-auto bind_consume_line(dnsec::HttpContentType &ct) {
-  std::size_t beg_bound_size = 2 /* -- */ + ct.boundary.size();
-  auto bound_buf = std::make_unique<std::uint8_t[]>(beg_bound_size);
-
-  return [&ct, bound_buf = std::move(bound_buf), beg_bound_size](
-             dnsec::NgxChainInputStream &is, std::string *append) {
-    std::size_t read =
-        is.read_until(bound_buf.get(), bound_buf.get() + beg_bound_size, '\n');
-    if (read == 0) {
-      return LineType::END_OF_FILE;
-    }
-    if (bound_buf[read - 1] == '\n') {
-      // line too small; can't be boundary. The buffer is not long enough to
-      // include the LF in --boundary\n
-      if (append) {
-        std::copy_n(bound_buf.get(), read, std::back_inserter(*append));
-      }
-      return LineType::OTHER;
+void remove_final_crlf(std::string_view &content) {
+  // support also terminations with plain LF instead of CRLF
+  if (content.ends_with('\n')) {
+    content.remove_suffix(1);
+    if (content.ends_with('\r')) {
+      content.remove_suffix(1);
     }
+  }
+}
+}  // namespace
 
-    // the input may have been truncated (we don't buffer the whole request)
-    // so assume we saw a boundary if we see at least part of it
-    if (is.eof() && read < beg_bound_size) {
-      bool matched = true;
-      for (std::size_t i = 0; matched && i < read; i++) {
-        if (i < 2) {
-          matched = bound_buf[i] == '-';
-        } else {
-          matched = bound_buf[i] == ct.boundary[i - 2];
-        }
-      }
-
-      if (matched) {
-        return LineType::BOUNDARY_END;
-      }
-    }
+namespace datadog::nginx::security {
 
-    if (read == beg_bound_size && std::memcmp(bound_buf.get(), "--", 2) == 0 &&
-        std::memcmp(bound_buf.get() + 2, ct.boundary.data(),
-                    ct.boundary.size()) == 0) {
-      // we found the boundary. It doesn't matter if the line contains
-      // extra characters (see RFC 2046)
-      std::uint8_t ch{};
-      LineType res;
-      if (!is.eof() && (ch = is.read()) == '-' && !is.eof() &&
-          ((ch = is.read()) == '-')) {
-        res = LineType::BOUNDARY_END;
-      } else {
-        res = LineType::BOUNDARY;
+/*
+ * Finds the lines starting with the delimiter (--boundary) by searching the
+ * whole data for the delimiter, instead of looking at it line by line.
+ */
+class DelimiterScanner {
+ public:
+  explicit DelimiterScanner(const std::string &boundary)
+      : delim_{"--" + boundary},
+        searcher_{delim_.begin(), delim_.end()} {}
+
+  // the searcher references delim_
+  DelimiterScanner(const DelimiterScanner &) = delete;
+  DelimiterScanner &operator=(const DelimiterScanner &) = delete;
+
+  std::size_t delim_size() const noexcept { return delim_.size(); }
+
+  // Returns the start of the first line starting with the delimiter, looking
+  // only at the delimiters found at or after from, or npos
+  std::size_t find(std::string_view data, std::size_t from) const {
+    auto it = data.begin() + static_cast<std::ptrdiff_t>(from);
+    while (true) {
+      it = std::search(it, data.end(), searcher_);
+      if (it == data.end()) {
+        return std::string_view::npos;
       }
-
-      // discard the rest of the line
-      if (ch != '\n') {
-        while (!is.eof() && is.read() != '\n') {
-        }
+      if (it == data.begin() || *(it - 1) == '\n') {
+        return static_cast<std::size_t>(it - data.begin());
       }
-
-      return res;
-    } else {
-      // not a boundary
-      if (append) {
-        std::copy_n(bound_buf.get(), read, std::back_inserter(*append));
-        while (!is.eof()) {
-          std::uint8_t ch = is.read();
-          append->push_back(ch);
-          if (ch == '\n') {
-            break;
-          }
-        }
-      } else {
-        while (!is.eof() && is.read() != '\n') {
-        }
-      }
-      return LineType::OTHER;
+      ++it;
     }
-  };
-}
-
-struct Buf {
-  dnsec::ddwaf_obj *ptr;
-  std::size_t len;
-  std::size_t cap;
-
-  void extend(dnsec::DdwafObjArrPool<dnsec::ddwaf_obj> &pool) {
-    std::size_t new_cap = cap * 2;
-    if (new_cap == 0) {
-      new_cap = 1;
-    }
-    ptr = pool.realloc(ptr, cap, new_cap);
-    cap = new_cap;
   }
 
-  dnsec::ddwaf_obj &new_slot(dnsec::DdwafObjArrPool<dnsec::ddwaf_obj> &pool) {
-    if (len == cap) {
-      extend(pool);
+  /*
+   * Looks for the next line starting with the delimiter, at or after from.
+   *
+   * If the return is LineType::BOUNDARY or LineType::BOUNDARY_END, the
+   * delimiter was found in the beginning of a line. content is set to the
+   * data before that line, and data to what follows the line (the full line is
+   * consumed, regardless of its size).
+   *
+   * If the return is LineType::END_OF_FILE, no delimiter was found; content is
+   * set to all the data, and data is left empty.
+   */
+  LineType next(std::string_view &data, std::string_view &content,
+                std::size_t from = 0) const {
+    auto line_start = find(data, from);
+    if (line_start != std::string_view::npos) {
+      content = data.substr(0, line_start);
+      data.remove_prefix(line_start + delim_.size());
+
+      // It doesn't matter if the line contains extra characters (see RFC
+      // 2046)
+      LineType res = data.starts_with("--"sv) ? LineType::BOUNDARY_END
+                                              : LineType::BOUNDARY;
+      auto lf = data.find('\n');
+      data.remove_prefix(lf == std::string_view::npos ? data.size() : lf + 1);
+      return res;
     }
-    return ptr[len++];
-  }
-};
 
-void remove_final_crlf(std::string &content) {
-  // support also terminations with plain LF instead of CRLF
-  if (content.size() >= 1 && content.back() == '\n') {
-    content.pop_back();
-    if (content.size() >= 1 && content.back() == '\r') {
-      content.pop_back();
+    // the input may have been truncated (we don't buffer the whole request)
+    // so assume we saw a boundary if the last line is at least part of it
+    auto last_lf = data.rfind('\n');
+    std::size_t last_line_start =
+        last_lf == std::string_view::npos ? 0 : last_lf + 1;
+    std::string_view last_line = data.substr(last_line_start);
+    if (!last_line.empty() && last_line.size() < delim_.size() &&
+        std::string_view{delim_}.starts_with(last_line)) {
+      content = data.substr(0, last_line_start);
+      data = {};
+      return LineType::BOUNDARY_END;
     }
-  }
-}
-}  // namespace
 
-namespace datadog::nginx::security {
-
-bool parse_multipart(ddwaf_obj &slot, const ngx_http_request_t &req,
-                     HttpContentType &ct, const ngx_chain_t &chain,
-                     DdwafMemres &memres) {
-  if (ct.boundary.size() == 0) {
-    ngx_log_error(NGX_LOG_NOTICE, req.connection->log, 0,
-                  "multipart boundary is invalid: %s", ct.boundary.c_str());
-  } else {
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, req.connection->log, 0,
-                  "multipart boundary: %s", ct.boundary.c_str());
+    content = data;
+    data = {};
+    return LineType::END_OF_FILE;
   }
-  NgxChainInputStream stream{&chain};
 
-  auto consume_line = bind_consume_line(ct);
+ private:
+  std::string delim_;
+  std::boyer_moore_horspool_searcher<std::string::const_iterator> searcher_;
+};
 
-  // find first boundary, discarding everything before it
-  while (!stream.eof()) {
-    auto line_type = consume_line(stream, nullptr);
-    if (line_type == LineType::BOUNDARY) {
-      break;
-    } else if (line_type == LineType::BOUNDARY_END) {
-      ngx_log_error(NGX_LOG_NOTICE, req.connection->log, 0,
-                    "multipart: found end boundary before first boundary");
-      return false;
+bool MultipartBodyParser::delimiter_line_complete(
+    const DelimiterScanner &scanner, std::string_view body) {
+  std::string_view data = body.substr(pos_);
+  auto line_start = scanner.find(data, scan_ - pos_);
+  if (line_start == std::string_view::npos) {
+    // a delimiter starting before the last delim_size() - 1 bytes would have
+    // been found already
+    std::size_t d = scanner.delim_size();
+    if (body.size() >= d) {
+      scan_ = std::max(scan_, body.size() - d + 1);
     }
-  }
-
-  if (stream.eof()) {
-    ngx_log_error(NGX_LOG_NOTICE, req.connection->log, 0,
-                  "multipart: eof right after first boundary");
     return false;
   }
 
-  DdwafObjArrPool<ddwaf_obj> pool{memres};
-  std::map<std::string, Buf> data;
-
-start_part:
-  // headers after the previous boundary
-  std::optional<MimeContentDisposition> cd =
-      MimeContentDisposition::for_stream(stream);
-  if (!cd) {
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, req.connection->log, 0,
-                  "multipart: did not find Content-Disposition header");
-  }
-
-  // content
-  {
-    std::string content;
-    while (true) {
-      auto line_type = consume_line(stream, &content);
+  scan_ = pos_ + line_start;
+  // whether the line is a final boundary and what follows it are only known
+  // once the line ends and some data follows it
+  auto lf = data.find('\n', line_start + scanner.delim_size());
+  return lf != std::string_view::npos && lf + 1 < data.size();
+}
 
-      if (line_type == LineType::OTHER) {
-        continue;
+bool MultipartBodyParser::step(const DelimiterScanner &scanner,
+                               const ngx_http_request_t &req,
+                               std::string_view body, bool at_eof) {
+  std::string_view data = body.substr(pos_);
+  std::string_view content;
+
+  switch (state_) {
+    case State::PREAMBLE: {
+      // find first boundary, discarding everything before it
+      if (!at_eof && !delimiter_line_complete(scanner, body)) {
+        return false;
+      }
+      auto line_type = scanner.next(data, content, scan_ - pos_);
+      if (line_type == LineType::BOUNDARY_END) {
+        ngx_log_error(NGX_LOG_NOTICE, req.connection->log, 0,
+                      "multipart: found end boundary before first boundary");
+        failed_ = true;
+      } else if (data.empty()) {
+        ngx_log_error(NGX_LOG_NOTICE, req.connection->log, 0,
+                      line_type == LineType::BOUNDARY
+                          ? "multipart: eof right after first boundary"
+                          : "multipart: no boundary found");
+        failed_ = true;
       }
+      state_ = failed_ ? State::END : State::HEADERS;
+      break;
+    }
 
-      // o/wise finished content (boundary/boundary_end/eof)
+    case State::HEADERS: {
+      // headers after the previous boundary
+      std::optional<MimeContentDisposition> cd =
+          MimeContentDisposition::for_headers(data);
+      if (!at_eof && data.empty()) {
+        // the blank line ending the headers may not have been seen
+        return false;
+      }
+      if (!cd) {
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, req.connection->log, 0,
+                      "multipart: did not find Content-Disposition header");
+      }
+      cur_name_ = cd ? std::optional{std::move(cd->name)} : std::nullopt;
+      state_ = State::CONTENT;
+      break;
+    }
 
-      if (line_type == LineType::BOUNDARY ||
-          line_type == LineType::BOUNDARY_END) {
-        // the \r\n preceding the boundary is deemed part of the boundary
-        remove_final_crlf(content);
+    case State::CONTENT: {
+      // content, up to the next boundary (boundary/boundary_end/eof)
+      if (!at_eof && !delimiter_line_complete(scanner, body)) {
+        return false;
       }
+      auto line_type = scanner.next(data, content, scan_ - pos_);
+
+      // the \r\n preceding the boundary is deemed part of the boundary
+      remove_final_crlf(content);
 
       if (line_type == LineType::END_OF_FILE) {
         ngx_log_debug(NGX_LOG_DEBUG_HTTP, req.connection->log, 0,
                       "multipart: eof before end boundary");
         // we could have been followed by a boundary that was truncated,
         // so remove final CRLF, LF, or CR
-        remove_final_crlf(content);
-        if (content.size() >= 1 && content.back() == '\r') {
-          content.pop_back();
+        if (content.ends_with('\r')) {
+          content.remove_suffix(1);
         }
       }
 
-      if (cd) {
-        auto &buf = data[cd->name];
-        buf.new_slot(pool).make_string({content.data(), content.size()},
-                                       memres);
-      }
-
-      if (line_type == LineType::BOUNDARY && !stream.eof()) {
-        goto start_part;
+      if (cur_name_) {
+        parts_[*cur_name_].emplace_back(
+            static_cast<std::size_t>(content.data() - body.data()),
+            content.size());
       }
-
+      state_ = line_type == LineType::BOUNDARY && !data.empty()
+                   ? State::HEADERS
+                   : State::END;
       break;
     }
+
+    case State::END:
+      return false;
+  }
+
+  pos_ = scan_ = body.size() - data.size();
+  return true;
+}
+
+void MultipartBodyParser::feed(const ngx_http_request_t &req,
+                               std::string_view body) {
+  DelimiterScanner scanner{boundary_};
+  while (step(scanner, req, body, false)) {
   }
+}
 
-  if (data.empty()) {
+bool MultipartBodyParser::finish(ddwaf_obj &slot,
+                                 const ngx_http_request_t &req,
+                                 std::string_view body, DdwafMemres &memres) {
+  if (boundary_.size() == 0) {
+    ngx_log_error(NGX_LOG_NOTICE, req.connection->log, 0,
+                  "multipart boundary is invalid: %s", boundary_.c_str());
+  } else {
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, req.connection->log, 0,
+                  "multipart boundary: %s", boundary_.c_str());
+  }
+
+  DelimiterScanner scanner{boundary_};
+  while (step(scanner, req, body, true)) {
+  }
+
+  if (failed_ || parts_.empty()) {
     return false;
   }
 
-  auto &map = slot.make_map(data.size(), memres);
+  // body outlives the WAF context; no need to copy the contents
+  auto &map = slot.make_map(parts_.size(), memres);
   std::size_t i = 0;
-  for (auto &[key, buf] : data) {
+  for (auto &[key, contents] : parts_) {
     auto &map_slot = map.at_unchecked(i++);
     map_slot.set_key(key, memres);
-    if (buf.len == 1) {
+    if (contents.size() == 1) {
       // if only one element, put the string directly under that key
-      map_slot.shallow_copy_val_from(buf.ptr[0]);
+      auto [off, len] = contents.front();
+      map_slot.make_string(body.substr(off, len));
     } else {
-      map_slot.make_array(buf.ptr, buf.len);
+      auto &arr = map_slot.make_array(contents.size(), memres);
+      for (std::size_t j = 0; j < contents.size(); j++) {
+        auto [off, len] = contents[j];
+        arr.at_unchecked(j).make_string(body.substr(off, len));
+      }
     }
   }
 
   return true;
 }
 
+bool parse_multipart(ddwaf_obj &slot, const ngx_http_request_t &req,
+                     HttpContentType &ct, std::string_view body,
+                     DdwafMemres &memres) {
+  return MultipartBodyParser{ct.boundary}.finish(slot, req, body, memres);
+}
+
+bool parse_multipart(ddwaf_obj &slot, const ngx_http_request_t &req,
+                     HttpContentType &ct, const ngx_chain_t &chain,
+                     DdwafMemres &memres) {
+  // linearize the chain once, so that the whole body can be scanned at a time
+  std::size_t size = 0;
+  for (const ngx_chain_t *cl = &chain; cl; cl = cl->next) {
+    size += static_cast<std::size_t>(cl->buf->last - cl->buf->pos);
+  }
+
+  char *body = memres.allocate_string(size);
+  NgxChainInputStream stream{&chain};
+  stream.read(reinterpret_cast<std::uint8_t *>(body), size);
+
+  return parse_multipart(slot, req, ct, std::string_view{body, size}, memres);
+}
+
 }  // namespace datadog::nginx::security
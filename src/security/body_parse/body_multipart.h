@@ -1,5 +1,13 @@
 #pragma once
 
+#include <cstddef>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
 #include "../ddwaf_obj.h"
 #include "header.h"
 
@@ -10,6 +18,52 @@ extern "C" {
 
 namespace datadog::nginx::security {
 
+class DelimiterScanner;
+
+// Parses a multipart/form-data body as it is collected. feed() is called with
+// all the data collected so far, each time more arrives; it advances past the
+// boundaries and part headers that more data can't change anymore. finish()
+// is called once, with the whole data, and builds the WAF object.
+class MultipartBodyParser {
+ public:
+  explicit MultipartBodyParser(std::string boundary)
+      : boundary_{std::move(boundary)} {}
+
+  // The data passed to the previous calls must be a prefix of body, but it
+  // may have been moved since
+  void feed(const ngx_http_request_t &req, std::string_view body);
+
+  // body must outlive the WAF context: the parts' contents reference it
+  bool finish(ddwaf_obj &slot, const ngx_http_request_t &req,
+              std::string_view body, DdwafMemres &memres);
+
+ private:
+  enum class State { PREAMBLE, HEADERS, CONTENT, END };
+
+  // Unless at_eof, does nothing and returns false if more data could change
+  // the outcome of the step
+  bool step(const DelimiterScanner &scanner, const ngx_http_request_t &req,
+            std::string_view body, bool at_eof);
+  bool delimiter_line_complete(const DelimiterScanner &scanner,
+                               std::string_view body);
+
+  std::string boundary_;
+  State state_{State::PREAMBLE};
+  bool failed_{};
+  std::size_t pos_{};   // where the next step starts
+  std::size_t scan_{};  // no delimiter line starts in [pos_, scan_)
+  std::optional<std::string> cur_name_;  // of the part in CONTENT
+  // offsets and sizes of the contents in the body, which may move as it grows
+  std::map<std::string, std::vector<std::pair<std::size_t, std::size_t>>>
+      parts_;
+};
+
+// body must outlive the WAF context: the parts' contents reference it
+bool parse_multipart(ddwaf_obj &slot, const ngx_http_request_t &req,
+                     HttpContentType &ct, std::string_view body,
+                     DdwafMemres &memres);
+
+// copies the chain into memres first
 bool parse_multipart(ddwaf_obj &slot, const ngx_http_request_t &req,
                      HttpContentType &ct, const ngx_chain_t &chain,
                      DdwafMemres &memres);
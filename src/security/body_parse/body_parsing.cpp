@@ -4,6 +4,7 @@
 #include <ngx_string.h>
 
 #include <cstddef>
+#include <functional>
 #include <unordered_map>
 
 #include "../ddwaf_memres.h"
@@ -101,29 +102,91 @@ bool parse_plain(dnsec::ddwaf_obj &slot, const ngx_chain_t &chain,
   return true;
 }
 
+// For the response body, which is only submitted on the last WAF run and is
+// kept buffered until then, the data in an in-memory first buffer can be
+// referenced directly instead of being copied
+bool parse_plain_resp(dnsec::ddwaf_obj &slot, const ngx_chain_t &chain,
+                      std::size_t size, dnsec::DdwafMemres &memres) {
+  const ngx_buf_t *buf = chain.buf;
+  if (buf && ngx_buf_in_memory(buf) &&
+      static_cast<std::size_t>(buf->last - buf->pos) >= size) {
+    slot.make_string(
+        std::string_view{reinterpret_cast<char *>(buf->pos), size});
+    return true;
+  }
+
+  return parse_plain(slot, chain, size, memres);
+}
+
+bool parse_urlencoded(dnsec::ddwaf_obj &slot, std::string_view body,
+                      dnsec::DdwafMemres &memres) {
+  return dnsec::UrlencodedBodyParser{}.finish(slot, body, memres);
+}
+
 bool parse_urlencoded(dnsec::ddwaf_obj &slot, const ngx_chain_t &chain,
                       std::size_t size, dnsec::DdwafMemres &memres) {
   char *buf = linearize_chain(chain, size, memres);
+  return parse_urlencoded(slot, std::string_view{buf, size}, memres);
+}
+
+}  // namespace
 
-  dnsec::QueryStringIter it{
-      {buf, size}, memres, '&', dnsec::QueryStringIter::trim_mode::no_trim};
+namespace datadog::nginx::security {
+
+void UrlencodedBodyParser::split(std::string_view body, std::size_t end,
+                                 DdwafMemres &memres) {
+  // the pairs don't span the separators, so splitting the data in pieces
+  // ending with '&' gives the same pairs as splitting it at once
+  std::string_view seg = body.substr(pos_, end - pos_);
+  QueryStringIter it{seg, memres, '&', QueryStringIter::trim_mode::no_trim};
+
+  auto piece = [&](std::string_view sv) -> Piece {
+    std::less_equal<const char *> le;
+    if (le(seg.data(), sv.data()) &&
+        le(sv.data() + sv.size(), seg.data() + seg.size())) {
+      return {nullptr, static_cast<std::size_t>(sv.data() - body.data()),
+              sv.size()};
+    }
+    return {sv.data(), 0, sv.size()};
+  };
+  for (; !it.ended(); ++it) {
+    auto [key, value] = *it;
+    pairs_.emplace_back(piece(key), piece(value));
+  }
+  pos_ = end;
+}
+
+void UrlencodedBodyParser::feed(std::string_view body, DdwafMemres &memres) {
+  auto amp = body.substr(pos_).rfind('&');
+  if (amp != std::string_view::npos) {
+    split(body, pos_ + amp + 1, memres);
+  }
+}
+
+bool UrlencodedBodyParser::finish(ddwaf_obj &slot, std::string_view body,
+                                  DdwafMemres &memres) {
+  split(body, body.size(), memres);
+
+  auto view = [body](const Piece &p) {
+    return p.decoded ? std::string_view{p.decoded, p.len}
+                     : body.substr(p.off, p.len);
+  };
 
   // count key occurrences
   union count_or_ddobj {
     std::size_t count;
-    dnsec::ddwaf_obj *dobj;
+    ddwaf_obj *dobj;
   };
   std::unordered_map<std::string_view, count_or_ddobj> key_index;
-  for (; !it.ended(); ++it) {
-    std::string_view cur_key = it.cur_key();
-    key_index[cur_key].count++;
+  for (auto &&[key, value] : pairs_) {
+    key_index[view(key)].count++;
   }
 
   // allocate all ddwaf_obj, set keys
-  dnsec::ddwaf_map_obj slot_map = slot.make_map(key_index.size(), memres);
+  ddwaf_map_obj slot_map = slot.make_map(key_index.size(), memres);
   std::size_t i = 0;
   for (auto &&[key, count_or_arr] : key_index) {
-    dnsec::ddwaf_obj &cur = slot_map.at_unchecked(i++);
+    ddwaf_obj &cur = slot_map.at_unchecked(i++);
     cur.set_key(key);
     if (count_or_arr.count == 1) {
       cur.make_string(""sv);  // to be filled later
@@ -135,28 +198,63 @@ bool parse_urlencoded(dnsec::ddwaf_obj &slot, const ngx_chain_t &chain,
   }
 
   // set values
-  it.reset();
-  for (it.reset(); !it.ended(); ++it) {
-    auto [cur_key, cur_value] = *it;
-    dnsec::ddwaf_obj &cur = *key_index.at(cur_key).dobj;
+  for (auto &&[key, value] : pairs_) {
+    ddwaf_obj &cur = *key_index.at(view(key)).dobj;
     if (cur.is_string()) {
-      cur.make_string(cur_value);
+      cur.make_string(view(value));
     } else {
-      dnsec::ddwaf_arr_obj &cur_arr = static_cast<dnsec::ddwaf_arr_obj &>(cur);
-      cur_arr.at_unchecked(cur_arr.nbEntries++).make_string(cur_value);
+      ddwaf_arr_obj &cur_arr = static_cast<ddwaf_arr_obj &>(cur);
+      cur_arr.at_unchecked(cur_arr.nbEntries++).make_string(view(value));
     }
   }
 
   return true;
 }
 
-}  // namespace
+std::optional<IncrementalBodyParser> IncrementalBodyParser::for_request(
+    const ngx_http_request_t &req) {
+  if (is_req_multipart(req)) {
+    std::optional<HttpContentType> ct = HttpContentType::for_string(
+        to_string_view(req.headers_in.content_type->value));
+    if (!ct) {
+      // left for parse_body_req() to report
+      return std::nullopt;
+    }
+    return IncrementalBodyParser{MultipartBodyParser{std::move(ct->boundary)}};
+  }
 
-namespace datadog::nginx::security {
+  if (is_req_urlencoded(req)) {
+    return IncrementalBodyParser{UrlencodedBodyParser{}};
+  }
 
-bool parse_body_req(ddwaf_obj &slot, const ngx_http_request_t &req,
-                    const ngx_chain_t &chain, std::size_t size,
-                    DdwafMemres &memres) {
+  return std::nullopt;
+}
+
+void IncrementalBodyParser::feed(const ngx_http_request_t &req,
+                                 std::string_view body, DdwafMemres &memres) {
+  if (auto *mp = std::get_if<MultipartBodyParser>(&parser_)) {
+    mp->feed(req, body);
+  } else {
+    std::get<UrlencodedBodyParser>(parser_).feed(body, memres);
+  }
+}
+
+bool IncrementalBodyParser::finish(ddwaf_obj &slot,
+                                   const ngx_http_request_t &req,
+                                   std::string_view body,
+                                   DdwafMemres &memres) {
+  if (auto *mp = std::get_if<MultipartBodyParser>(&parser_)) {
+    return mp->finish(slot, req, body, memres);
+  }
+  return std::get<UrlencodedBodyParser>(parser_).finish(slot, body, memres);
+}
+
+namespace {
+// stable_data, if not null, has the size bytes of the chain contiguously and
+// outlives the WAF context, so it can be referenced instead of copied
+bool parse_body_req_impl(ddwaf_obj &slot, const ngx_http_request_t &req,
+                         const ngx_chain_t &chain, std::size_t size,
+                         const char *stable_data, DdwafMemres &memres) {
   if (req.headers_in.content_type == nullptr) {
     ngx_log_debug(NGX_LOG_DEBUG_HTTP, req.connection->log, 0,
                   "no content-type: won't parse request body");
@@ -165,7 +263,10 @@ bool parse_body_req(ddwaf_obj &slot, const ngx_http_request_t &req,
 
   if (is_req_json(req)) {
     // use rapidjson to parse:
-    bool success = parse_json(slot, req, chain, size, memres);
+    bool success = stable_data ? parse_json(slot, req,
+                                            std::string_view{stable_data, size},
+                                            memres)
+                               : parse_json(slot, req, chain, size, memres);
     if (success) {
       return true;
     }
@@ -178,14 +279,26 @@ bool parse_body_req(ddwaf_obj &slot, const ngx_http_request_t &req,
       return false;
     }
 
+    if (stable_data) {
+      return parse_multipart(slot, req, *ct,
+                             std::string_view{stable_data, size}, memres);
+    }
     return parse_multipart(slot, req, *ct, chain, memres);
   }
 
   if (is_req_text_plain(req)) {
+    if (stable_data) {
+      slot.make_string(std::string_view{stable_data, size});
+      return true;
+    }
     return parse_plain(slot, chain, size, memres);
   }
 
   if (is_req_urlencoded(req)) {
+    if (stable_data) {
+      return parse_urlencoded(slot, std::string_view{stable_data, size},
+                              memres);
+    }
     return parse_urlencoded(slot, chain, size, memres);
   }
 
@@ -194,6 +307,28 @@ bool parse_body_req(ddwaf_obj &slot, const ngx_http_request_t &req,
                 &req.headers_in.content_type->value);
   return false;
 }
+}  // namespace
+
+bool parse_body_req(ddwaf_obj &slot, const ngx_http_request_t &req,
+                    const ngx_chain_t &chain, std::size_t size,
+                    DdwafMemres &memres) {
+  return parse_body_req_impl(slot, req, chain, size, nullptr, memres);
+}
+
+bool parse_body_req(ddwaf_obj &slot, const ngx_http_request_t &req,
+                    std::string_view body, DdwafMemres &memres) {
+  // parse_body_req_impl() takes the data as a chain too
+  ngx_buf_t buf{};
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-const-cast)
+  buf.pos = reinterpret_cast<u_char *>(const_cast<char *>(body.data()));
+  buf.start = buf.pos;
+  buf.last = buf.end = buf.pos + body.size();
+  buf.memory = 1;
+  ngx_chain_t chain{&buf, nullptr};
+
+  return parse_body_req_impl(slot, req, chain, body.size(), body.data(),
+                             memres);
+}
 
 bool is_body_resp_parseable(const ngx_http_request_t &req) {
   return !req.header_only && (is_resp_json(req) || is_resp_text_plain(req));
@@ -205,11 +340,19 @@ bool parse_body_resp(ddwaf_obj &slot, const ngx_http_request_t &req,
                      const ngx_chain_t &chain, std::size_t size,
                      DdwafMemres &memres) {
   if (is_resp_json(req)) {
+    // see parse_plain_resp()
+    const ngx_buf_t *buf = chain.buf;
+    if (buf && ngx_buf_in_memory(buf) &&
+        static_cast<std::size_t>(buf->last - buf->pos) >= size) {
+      return parse_json(
+          slot, req,
+          std::string_view{reinterpret_cast<char *>(buf->pos), size}, memres);
+    }
     return parse_json(slot, req, chain, size, memres);
   }
 
   if (is_resp_text_plain(req)) {
-    return parse_plain(slot, chain, size, memres);
+    return parse_plain_resp(slot, chain, size, memres);
   }
 
   return false;
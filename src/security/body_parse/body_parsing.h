@@ -1,17 +1,77 @@
 #pragma once
 
+#include <cstddef>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
 extern "C" {
 #include <ngx_http.h>
 }
 
 #include "../ddwaf_obj.h"
+#include "body_multipart.h"
 
 namespace datadog::nginx::security {
 
+// Parses an application/x-www-form-urlencoded body as it is collected. feed()
+// splits the pairs up to the last '&' collected so far; finish() splits the
+// rest and builds the WAF object.
+class UrlencodedBodyParser {
+ public:
+  // The data passed to the previous calls must be a prefix of body, but it
+  // may have been moved since
+  void feed(std::string_view body, DdwafMemres &memres);
+
+  // body must outlive the WAF context: the keys and values may reference it
+  bool finish(ddwaf_obj &slot, std::string_view body, DdwafMemres &memres);
+
+ private:
+  // a key or a value: decoded into memres, or else at an offset in the body
+  struct Piece {
+    const char *decoded;
+    std::size_t off;
+    std::size_t len;
+  };
+
+  void split(std::string_view body, std::size_t end, DdwafMemres &memres);
+
+  std::size_t pos_{};  // where the pairs not split yet start
+  std::vector<std::pair<Piece, Piece>> pairs_;
+};
+
+// A request body parser for the content types that can be parsed while the
+// body is collected (multipart/form-data and urlencoded)
+class IncrementalBodyParser {
+ public:
+  // nullopt for the other content types
+  static std::optional<IncrementalBodyParser> for_request(
+      const ngx_http_request_t &req);
+
+  void feed(const ngx_http_request_t &req, std::string_view body,
+            DdwafMemres &memres);
+
+  bool finish(ddwaf_obj &slot, const ngx_http_request_t &req,
+              std::string_view body, DdwafMemres &memres);
+
+ private:
+  template <typename Parser>
+  explicit IncrementalBodyParser(Parser parser) : parser_{std::move(parser)} {}
+
+  std::variant<MultipartBodyParser, UrlencodedBodyParser> parser_;
+};
+
 bool parse_body_req(ddwaf_obj &slot, const ngx_http_request_t &req,
                     const ngx_chain_t &chain, std::size_t size,
                     DdwafMemres &memres);
 
+// For a request body that was collected contiguously. It must outlive the WAF
+// context, as it may be referenced rather than copied
+bool parse_body_req(ddwaf_obj &slot, const ngx_http_request_t &req,
+                    std::string_view body, DdwafMemres &memres);
+
 bool is_body_resp_parseable(const ngx_http_request_t &req);
 
 bool parse_body_resp(ddwaf_obj &slot, const ngx_http_request_t &req,
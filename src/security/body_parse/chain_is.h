@@ -67,23 +67,6 @@ class NgxChainInputStream {
     return read;
   }
 
-  /* Reads until end (not including it) or delim (including it), whichever comes
-   * first */
-  template <typename Iter>
-  std::size_t read_until(Iter begin, Iter end, std::uint8_t delim) {
-    // could be optimized
-    auto w = begin;
-    while (!eof() && w < end) {
-      auto ch = read();
-      *w++ = ch;
-      if (ch == delim) {
-        break;
-      }
-    }
-
-    return w - begin;
-  }
-
   bool eof() const {
     if (pos_ == end_) {
       return current_ == nullptr || current_->next == nullptr;
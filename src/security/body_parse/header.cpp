@@ -6,8 +6,6 @@
 #include <string_view>
 
 #include "../decode.h"
-#include "chain_is.h"
-#include "generator.h"
 
 using namespace std::literals;
 
@@ -135,6 +133,19 @@ std::optional<std::string> consume_9110_quoted_string(std::string_view &sv) {
 inline bool is_ext_ws(unsigned char ch) {  // not include \r or \n
   return ch == ' ' || ch == '\t' || ch == '\v' || ch == '\f';
 }
+
+// appends seg to out, dropping any CR
+void append_without_cr(std::string &out, std::string_view seg) {
+  while (!seg.empty()) {
+    auto cr = seg.find('\r');
+    out.append(seg.substr(0, cr));
+    if (cr == std::string_view::npos) {
+      break;
+    }
+    seg.remove_prefix(cr + 1);
+  }
+}
+
 /*
  * Line folding, this is described in RFC 5322:
  * FWS             =   ([*WSP CRLF] 1*WSP) / obs-FWS
@@ -146,91 +157,105 @@ inline bool is_ext_ws(unsigned char ch) {  // not include \r or \n
  * - allow line terminations with only \n (no \r)
  * - consider \v and \f as whitespace
  * - ignore invalid first lines starting with white spaces
+ * - drop CRs not followed by LF
  *
- * This coroutine returns characters for a single header "line", unfolded.
+ * Consumes a single header "line" from data and returns it unfolded, or an
+ * empty string_view at the end of the headers (or of the data). Lines are
+ * found with memchr. The result points into data unless the header had to be
+ * rewritten (it was folded or had CRs inside), in which case it points into
+ * scratch.
  */
-dnsec::Generator<std::uint8_t> unfold_next_header(
-    dnsec::NgxChainInputStream &is) {
-initial_line:
-  if (is.eof()) {
-    co_return;
-  }
-
-  auto ch = is.read();
-  if (is_ext_ws(ch)) {
+std::string_view unfold_next_header(std::string_view &data,
+                                    std::string &scratch) {
+  while (!data.empty() && is_ext_ws(data.front())) {
     // starts with space, but can't be a continuation. Ignore the whole line,
     // like PHP does. Note that we're not discarding possibly valid payload,
     // because the Content-disposition header is mandatory. In fact, even if
     // there were no headers, the sequence should be --<boundary>\r\n\r\n<data>
-    while (!is.eof() && (ch = is.read()) != '\n') {
-    }
-    goto initial_line;
-  } else if (ch == '\r') {
-    if (is.eof()) {
-      // unexpected end of input: \r nor followed by \n
-      co_return;
-    }
+    auto lf = data.find('\n');
+    data.remove_prefix(lf == std::string_view::npos ? data.size() : lf + 1);
+  }
+
+  if (data.empty()) {
+    return {};
+  }
 
-    ch = is.read();
-    if (ch == '\n') {
-      // end of the headers
-      co_return;
+  if (data.front() == '\r') {
+    data.remove_prefix(1);
+    if (data.empty() || data.front() == '\n') {
+      // end of the headers (or unexpected end of input: \r not followed by \n)
+      data.remove_prefix(data.empty() ? 0 : 1);
+      return {};
     }
-  } else if (ch == '\n') {
+  } else if (data.front() == '\n') {
     // allow \n without \r
-    co_return;
+    data.remove_prefix(1);
+    return {};
   }
 
+  std::string_view first_seg;
+  bool use_scratch = false;
   while (true) {
-    if (ch == '\r') {
-      if (is.eof()) {
-        // unexpected end of input: \r nor followed by \n
-        co_return;
+    auto lf = data.find('\n');
+    std::string_view seg = data.substr(0, lf);
+    data.remove_prefix(lf == std::string_view::npos ? data.size() : lf + 1);
+
+    if (!use_scratch) {
+      std::string_view trimmed = seg;
+      if (!trimmed.empty() && trimmed.back() == '\r') {
+        trimmed.remove_suffix(1);
       }
-
-      if (ch == '\n') {
-      crlf:
-        // found \r\n
-        if (is.eof()) {
-          co_return;
-        }
-
-        ch = *is;  // peek; do not consume has it may be part of the next header
-                   // or the end of the headers
-        if (is_ext_ws(ch)) {
-          // We're folding
-          // skip the current ws and then the rest of the ws
-          do {
-            is.read();
-          } while (!is.eof() && is_ext_ws(*is) /* peek */);
-
-          // at this point either eof, or we do ch = is.read() (returns non-ws)
-          // and restart the loop
-        } else {
-          // if CRLF is not followed by whitespace, then it's a new line and
-          // we're done. Do not consume the current char.
-          // This is the only normal finish, although we need to tolerate at the
-          // very least early eof due to limited buffering of the request body
-          co_return;
-        }
+      if (first_seg.data() == nullptr &&
+          trimmed.find('\r') == std::string_view::npos) {
+        first_seg = trimmed;
+      } else {
+        use_scratch = true;
+        scratch.clear();
+        append_without_cr(scratch, first_seg);
+        append_without_cr(scratch, seg);
       }
-    } else if (ch == '\n') {
-      // violation: allow \n without \r
-      goto crlf;
     } else {
-      co_yield ch;
+      append_without_cr(scratch, seg);
     }
 
-    if (is.eof()) {
+    // if CRLF is not followed by whitespace, then it's a new line and we're
+    // done. This is the only normal finish, although we need to tolerate at
+    // the very least early eof due to limited buffering of the request body
+    if (lf == std::string_view::npos || data.empty() ||
+        !is_ext_ws(data.front())) {
       break;
     }
-    ch = is.read();
+
+    // We're folding: skip the whitespace and continue with the next line
+    while (!data.empty() && is_ext_ws(data.front())) {
+      data.remove_prefix(1);
+    }
   }
 
-  // abnormal finish
-  co_return;
+  if (use_scratch) {
+    return scratch;
+  }
+  return first_seg;
 }
 
+// Reads an unfolded header character by character, for the Content-Disposition
+// parser
+class HeaderCursor {
+ public:
+  explicit HeaderCursor(std::string_view header) : rest_{header} {}
+
+  bool has_next() const noexcept { return !rest_.empty(); }
+  std::uint8_t peek() const noexcept { return rest_.front(); }
+  std::uint8_t next() noexcept {
+    std::uint8_t ch = rest_.front();
+    rest_.remove_prefix(1);
+    return ch;
+  }
+
+ private:
+  std::string_view rest_;
+};
+
 }  // namespace
 
 namespace datadog::nginx::security {
@@ -377,39 +402,40 @@ std::optional<HttpContentType> HttpContentType::for_string(
  */
 /*
  * This method consumes all the headers of a MIME part, looking for
- * Content-Disposition's name. It stops only on EOF or two consecutive CRLF
- * (relaxed to allow plain LF).
+ * Content-Disposition's name. It stops only on the end of data or two
+ * consecutive CRLF (relaxed to allow plain LF).
  */
-std::optional<MimeContentDisposition> MimeContentDisposition::for_stream(
-    NgxChainInputStream &is) {
+std::optional<MimeContentDisposition> MimeContentDisposition::for_headers(
+    std::string_view &data) {
   MimeContentDisposition cd{};
 
   // consumes data, up until the last matching character; case insensitive
-  auto try_match_token = [](auto &gen, std::string_view token) {
+  auto try_match_token = [](auto &cursor, std::string_view token) {
     assert(token == to_lc(token));
     std::size_t i;
-    for (i = 0; gen.has_next() && i < token.size(); i++) {
-      if (std::tolower(gen.peek()) != token[i]) {
+    for (i = 0; cursor.has_next() && i < token.size(); i++) {
+      if (std::tolower(cursor.peek()) != token[i]) {
         break;
       }
-      gen.next();
+      cursor.next();
     }
     return i == token.size();
   };
 
-  while (!is.eof()) {
-    Generator<std::uint8_t> gen = unfold_next_header(is);
-    if (!gen.has_next()) {
+  std::string scratch;  // for headers that need rewriting
+  while (!data.empty()) {
+    HeaderCursor cur{unfold_next_header(data, scratch)};
+    if (!cur.has_next()) {
       // end of headers
       break;
     }
 
     // no space allowed before :
     static constexpr auto header_name_lc = "content-disposition:"sv;
-    if (!try_match_token(gen, header_name_lc)) {
+    if (!try_match_token(cur, header_name_lc)) {
       // not the header we're looking for. Consume the rest of it and retry
-      while (gen.has_next()) {
-        gen.next();
+      while (cur.has_next()) {
+        cur.next();
       }
       continue;
     }
@@ -417,34 +443,34 @@ std::optional<MimeContentDisposition> MimeContentDisposition::for_stream(
     // found the header
     // skip ws after : (matches PHP behavior)
     std::uint8_t ch;
-    while (gen.has_next() && is_ext_ws(ch = gen.next())) {
+    while (cur.has_next() && is_ext_ws(ch = cur.next())) {
     }
 
-    if (!gen.has_next()) {
+    if (!cur.has_next()) {
       // no value after content-disposition:[ \t\v\f]*
       continue;
     }
 
   next_parameter:
     // skip until we find a ;, which is what we're interested in
-    while (gen.has_next() && gen.next() != ';') {
+    while (cur.has_next() && cur.next() != ';') {
     }
   next_parameter_after_semicolon:
     // skip ws
-    while (gen.has_next() && is_ext_ws(ch = gen.peek())) {
-      gen.next();
+    while (cur.has_next() && is_ext_ws(ch = cur.peek())) {
+      cur.next();
     }
-    if (!gen.has_next()) {
+    if (!cur.has_next()) {
       // no more parameters
       continue;
     }
 
     std::string header_name;
-    bool is_name = try_match_token(gen, "name=");
+    bool is_name = try_match_token(cur, "name=");
     if (!is_name) {
       // try to find = or ;
-      while (gen.has_next()) {
-        auto ch = gen.next();
+      while (cur.has_next()) {
+        auto ch = cur.next();
         if (ch == '=') {
           // break so we can process the value. We can't just advance
           // to the next ; because the next ; may be quoted
@@ -455,7 +481,7 @@ std::optional<MimeContentDisposition> MimeContentDisposition::for_stream(
       }
     }
 
-    if (!gen.has_next()) {
+    if (!cur.has_next()) {
       // no value after <parameter>=
       continue;
     }
@@ -474,9 +500,9 @@ std::optional<MimeContentDisposition> MimeContentDisposition::for_stream(
      * This encoding is not transmitted by the browsers in any header.
      */
     std::string value;
-    if (gen.peek() == '"') {
-      gen.next();  // skip "
-      while (gen.has_next() && (ch = gen.next()) != '"') {
+    if (cur.peek() == '"') {
+      cur.next();  // skip "
+      while (cur.has_next() && (ch = cur.next()) != '"') {
         value.push_back(ch);
       }
       if (ch != '"') {
@@ -499,10 +525,10 @@ std::optional<MimeContentDisposition> MimeContentDisposition::for_stream(
     } else {
       std::string value;
       // continue until we get a space, tab, ;, or end of input
-      while (gen.has_next() && (ch = gen.peek()) != ' ' && ch != '\t' &&
+      while (cur.has_next() && (ch = cur.peek()) != ' ' && ch != '\t' &&
              ch != ';') {
         value.push_back(ch);
-        gen.next();
+        cur.next();
       }
 
       if (!value.empty() && is_name) {
@@ -510,7 +536,7 @@ std::optional<MimeContentDisposition> MimeContentDisposition::for_stream(
       }
       goto next_parameter;
     }
-  }  // while (!is.eof())
+  }  // while (!data.empty())
 
   if (cd.name.empty()) {
     return std::nullopt;
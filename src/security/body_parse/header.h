@@ -4,8 +4,6 @@
 #include <string>
 #include <string_view>
 
-#include "chain_is.h"
-
 namespace datadog::nginx::security {
 
 struct HttpContentType {
@@ -21,8 +19,9 @@ struct HttpContentType {
 struct MimeContentDisposition {
   std::string name;
 
-  static std::optional<MimeContentDisposition> for_stream(
-      NgxChainInputStream &is);
+  // consumes the headers of a MIME part from the start of data
+  static std::optional<MimeContentDisposition> for_headers(
+      std::string_view &data);
 };
 
 }  // namespace datadog::nginx::security
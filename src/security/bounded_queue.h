@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+namespace datadog::nginx::security {
+
+// Fixed capacity lock-free queue, safe for any number of producers and
+// consumers (Dmitry Vyukov's bounded MPMC queue). Each cell carries a
+// sequence number telling whether it's ready to be written or read in the
+// current lap, so producers and consumers only contend on their own index.
+template <typename T>
+class BoundedQueue {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "T must be trivially copyable");
+
+ public:
+  // capacity is rounded up to a power of 2
+  explicit BoundedQueue(std::size_t capacity)
+      : mask_{round_up_pow2(capacity) - 1}, cells_{new Cell[mask_ + 1]} {
+    for (std::size_t i = 0; i <= mask_; i++) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  BoundedQueue(const BoundedQueue &) = delete;
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+  std::size_t capacity() const noexcept { return mask_ + 1; }
+
+  // returns false if the queue is full
+  bool try_push(T value) noexcept {
+    Cell *cell;
+    std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[pos & mask_];
+      std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<std::intptr_t>(seq) -
+                  static_cast<std::intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->value = value;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // returns false if the queue is empty (or the element at the head is still
+  // being written)
+  bool try_pop(T &value) noexcept {
+    Cell *cell;
+    std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[pos & mask_];
+      std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<std::intptr_t>(seq) -
+                  static_cast<std::intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+
+    value = cell->value;
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  static inline constexpr std::size_t kCacheLineSize = 64;
+
+  struct Cell {
+    std::atomic<std::size_t> sequence;
+    T value;
+  };
+
+  static std::size_t round_up_pow2(std::size_t value) noexcept {
+    std::size_t result = 2;
+    while (result < value) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  const std::size_t mask_;
+  const std::unique_ptr<Cell[]> cells_;
+  alignas(kCacheLineSize) std::atomic<std::size_t> enqueue_pos_{0};
+  alignas(kCacheLineSize) std::atomic<std::size_t> dequeue_pos_{0};
+};
+
+}  // namespace datadog::nginx::security
@@ -1,6 +1,10 @@
 #include "client_ip.h"
 
+#include <algorithm>
 #include <array>
+#include <cstring>
+#include <iterator>
+#include <new>
 #include <string_view>
 
 #include "util.h"
@@ -10,6 +14,7 @@ extern "C" {
 #include <ngx_config.h>
 #include <ngx_hash.h>
 #include <ngx_http_request.h>
+#include <ngx_http_v2.h>
 #include <ngx_list.h>
 }
 
@@ -30,40 +35,195 @@ struct IpAddr {
   bool is_ipv4() const { return af == AF_INET; }
   bool is_ipv6() const { return af == AF_INET6; }
 
-  std::optional<std::string> to_string() const {
-    char buf[INET6_ADDRSTRLEN];
+  bool operator==(const IpAddr &other) const {
+    if (af != other.af) {
+      return false;
+    }
+    if (af == AF_INET) {
+      return u.v4.s_addr == other.u.v4.s_addr;
+    }
+    return af == 0 || std::memcmp(&u.v6, &other.u.v6, sizeof(u.v6)) == 0;
+  }
+
+  // Returns the length written to buf, or 0 on failure
+  std::size_t format(char (&buf)[INET6_ADDRSTRLEN]) const {
     if (inet_ntop(af, reinterpret_cast<const char *>(&this->u), buf,
                   sizeof(buf)) == nullptr) {
+      return 0;
+    }
+    return std::strlen(buf);
+  }
+
+  std::optional<std::string> to_string() const {
+    char buf[INET6_ADDRSTRLEN];
+    std::size_t len = format(buf);
+    if (len == 0) {
       return std::nullopt;
     }
-    return {buf};
+    return {std::string{buf, len}};
   };
 
-  bool is_private() const {
-    if (af == AF_INET) {
-      return is_private_v4();
+  bool is_private() const;
+
+  static std::optional<IpAddr> from_string(std::string_view addr_sv,
+                                           int af_hint = AF_UNSPEC);
+};
+
+// Same as inet_pton(AF_INET, ...), without the need for a NUL-terminated
+// string: exactly 4 decimal octets, without leading zeros
+bool parse_ipv4(std::string_view sv, std::uint8_t (&out)[4]) {
+  std::uint8_t tmp[4]{};
+  std::size_t octets = 0;
+  unsigned cur = 0;
+  bool saw_digit = false;
+  for (char ch : sv) {
+    if (ch >= '0' && ch <= '9') {
+      if (saw_digit && cur == 0) {
+        return false;
+      }
+      cur = cur * 10U + static_cast<unsigned>(ch - '0');
+      if (cur > 255) {
+        return false;
+      }
+      if (!saw_digit) {
+        if (++octets > 4) {
+          return false;
+        }
+        saw_digit = true;
+      }
+      tmp[octets - 1] = static_cast<std::uint8_t>(cur);
+    } else if (ch == '.' && saw_digit) {
+      if (octets == 4) {
+        return false;
+      }
+      saw_digit = false;
+      cur = 0;
     } else {
-      return is_private_v6();
+      return false;
     }
   }
+  if (octets < 4) {
+    return false;
+  }
+  std::memcpy(out, tmp, sizeof(tmp));
+  return true;
+}
 
-  bool is_private_v4() const;
-  bool is_private_v6() const;
+int hex_digit_value(char ch) {
+  if (ch >= '0' && ch <= '9') {
+    return ch - '0';
+  }
+  if (ch >= 'a' && ch <= 'f') {
+    return ch - 'a' + 10;
+  }
+  if (ch >= 'A' && ch <= 'F') {
+    return ch - 'A' + 10;
+  }
+  return -1;
+}
 
-  static std::optional<IpAddr> from_string(std::string_view addr_sv,
-                                           int af_hint = AF_UNSPEC);
-};
+// Same as inet_pton(AF_INET6, ...), without the need for a NUL-terminated
+// string
+bool parse_ipv6(std::string_view sv, std::uint8_t (&out)[16]) {
+  std::uint8_t tmp[16]{};
+  std::size_t w = 0;  // write position in tmp
+  std::optional<std::size_t> colon_pos;
+  const char *src = sv.data();
+  const char *end = src + sv.size();
+
+  // a leading : must be part of ::
+  if (src == end) {
+    return false;
+  }
+  if (*src == ':') {
+    ++src;
+    if (src == end || *src != ':') {
+      return false;
+    }
+  }
+
+  const char *cur_tok = src;
+  std::size_t xdigits_seen = 0;
+  unsigned val = 0;
+  while (src < end) {
+    char ch = *src++;
+    int digit = hex_digit_value(ch);
+    if (digit >= 0) {
+      if (xdigits_seen == 4) {
+        return false;
+      }
+      val = (val << 4) | static_cast<unsigned>(digit);
+      ++xdigits_seen;
+      continue;
+    }
+    if (ch == ':') {
+      cur_tok = src;
+      if (xdigits_seen == 0) {
+        if (colon_pos) {
+          return false;
+        }
+        colon_pos = w;
+        continue;
+      }
+      if (src == end || w + 2 > sizeof(tmp)) {
+        return false;
+      }
+      tmp[w++] = static_cast<std::uint8_t>(val >> 8);
+      tmp[w++] = static_cast<std::uint8_t>(val);
+      xdigits_seen = 0;
+      val = 0;
+      continue;
+    }
+    if (ch == '.' && w + 4 <= sizeof(tmp)) {
+      // embedded IPv4 address, up to the end
+      std::uint8_t v4[4];
+      if (!parse_ipv4({cur_tok, static_cast<std::size_t>(end - cur_tok)},
+                      v4)) {
+        return false;
+      }
+      std::memcpy(tmp + w, v4, sizeof(v4));
+      w += sizeof(v4);
+      xdigits_seen = 0;
+      break;
+    }
+    return false;
+  }
+
+  if (xdigits_seen > 0) {
+    if (w + 2 > sizeof(tmp)) {
+      return false;
+    }
+    tmp[w++] = static_cast<std::uint8_t>(val >> 8);
+    tmp[w++] = static_cast<std::uint8_t>(val);
+  }
+
+  if (colon_pos) {
+    // :: can't expand to zero groups
+    if (w == sizeof(tmp)) {
+      return false;
+    }
+    std::size_t n = w - *colon_pos;
+    std::memmove(tmp + sizeof(tmp) - n, tmp + *colon_pos, n);
+    std::memset(tmp + *colon_pos, 0, sizeof(tmp) - n - *colon_pos);
+    w = sizeof(tmp);
+  }
+
+  if (w != sizeof(tmp)) {
+    return false;
+  }
+  std::memcpy(out, tmp, sizeof(tmp));
+  return true;
+}
 
 std::optional<IpAddr> IpAddr::from_string(std::string_view addr_sv,
                                           int af_hint) {
-  IpAddr out;
-  std::string input_nulterminated{addr_sv};
-  auto *addr_nult = input_nulterminated.c_str();
+  IpAddr out{};
 
   if (af_hint == AF_INET || af_hint == AF_UNSPEC) {
-    int ret = inet_pton(AF_INET, addr_nult, &out.u.v4);
-    if (ret == 1) {
+    std::uint8_t v4[4];
+    if (parse_ipv4(addr_sv, v4)) {
       out.af = AF_INET;
+      std::memcpy(&out.u.v4.s_addr, v4, sizeof(v4));
       return {out};
     }
 
@@ -74,8 +234,7 @@ std::optional<IpAddr> IpAddr::from_string(std::string_view addr_sv,
     }
   }
 
-  int ret = inet_pton(AF_INET6, addr_nult, &out.u.v6);
-  if (ret != 1) {
+  if (!parse_ipv6(addr_sv, out.u.v6.s6_addr)) {
     // neither valid ipv4 nor ipv6
     return std::nullopt;
   }
@@ -96,108 +255,70 @@ std::optional<IpAddr> IpAddr::from_string(std::string_view addr_sv,
   return {out};
 }
 
-inline constexpr auto ct_htonl(std::uint32_t n) {
-#if defined(__BIG_ENDIAN__) || \
-    (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
-  return n;
-#else
-  return __builtin_bswap32(n);
-#endif
-}
-inline constexpr auto ct_htonll(std::uint64_t n) {
-#if defined(__BIG_ENDIAN__) || \
-    (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
-  return n;
-#else
-  return __builtin_bswap64(n);
-#endif
-}
-
-bool IpAddr::is_private_v4() const {
-  static constexpr struct {
-    struct in_addr base;
-    struct in_addr mask;
-  } priv_ranges[] = {
-      {
-          .base = {ct_htonl(0x0A000000U)},  // 10.0.0.0
-          .mask = {ct_htonl(0xFF000000U)},  // 255.0.0.0
-      },
-      {
-          .base = {ct_htonl(0xAC100000U)},  // 172.16.0.0
-          .mask = {ct_htonl(0xFFF00000U)},  // 255.240.0.0
-      },
-      {
-          .base = {ct_htonl(0xC0A80000U)},  // 192.168.0.0
-          .mask = {ct_htonl(0xFFFF0000U)},  // 255.255.0.0
-      },
-      {
-          .base = {ct_htonl(0x7F000000U)},  // 127.0.0.0
-          .mask = {ct_htonl(0xFF000000U)},  // 255.0.0.0
-      },
-      {
-          .base = {ct_htonl(0xA9FE0000U)},  // 169.254.0.0
-          .mask = {ct_htonl(0xFFFF0000U)},  // 255.255.0.0
-      },
-      {
-          .base = {ct_htonl(0x64400000U)},  // 100.64.0.0
-          .mask = {ct_htonl(0xFFC00000U)},  // 255.192.0.0
-      },
-  };
+// An address range, as masks over the 128 bits of an IPv6 address in host
+// order. IPv4 addresses are looked up as IPv4-mapped IPv6 addresses
+struct AddrPrefix {
+  std::uint64_t hi;
+  std::uint64_t lo;
+  std::uint64_t mask_hi;
+  std::uint64_t mask_lo;
+
+  constexpr AddrPrefix(std::uint64_t hi, std::uint64_t lo, unsigned len)
+      : hi{hi},
+        lo{lo},
+        mask_hi{len == 0    ? 0
+                : len >= 64 ? ~0ULL
+                            : ~0ULL << (64 - len)},
+        mask_lo{len <= 64    ? 0
+                : len >= 128 ? ~0ULL
+                             : ~0ULL << (128 - len)} {}
+
+  static constexpr AddrPrefix v4(std::uint32_t addr, unsigned len) {
+    return {0, 0xFFFF00000000ULL | addr, 96 + len};
+  }
 
-  for (std::size_t i = 0; i < sizeof(priv_ranges) / sizeof(priv_ranges[0]);
-       i++) {
-    if ((u.v4.s_addr & priv_ranges[i].mask.s_addr) ==
-        priv_ranges[i].base.s_addr) {
-      return true;
-    }
+  constexpr bool contains(std::uint64_t addr_hi,
+                          std::uint64_t addr_lo) const noexcept {
+    return (addr_hi & mask_hi) == hi && (addr_lo & mask_lo) == lo;
   }
-  return false;
-}
+};
 
-bool IpAddr::is_private_v6() const {
-  static constexpr struct {
-    union {
-      struct in6_addr base;
-      uint64_t base_i[2];
-    };
-    union {
-      struct in6_addr mask;
-      uint64_t mask_i[2];
-    };
-  } priv_ranges[] = {
-      {
-          .base_i = {0, ct_htonll(1ULL)},                           // loopback
-          .mask_i = {0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL}  // /128
-      },
-      {
-          .base_i = {ct_htonll(0xFE80ULL << 48), 0},  // link-local
-          .mask_i = {ct_htonll(0xFFC0ULL << 48), 0}   // /10 mask
-      },
-      {
-          .base_i = {ct_htonll(0xFEC0ULL << 48), 0},  // site-local
-          .mask_i = {ct_htonll(0xFFC0ULL << 48), 0}   // /10 mask
-      },
-      {
-          .base_i = {ct_htonll(0xFDULL << 56), 0},  // unique local address
-          .mask_i = {ct_htonll(0xFFULL << 56), 0}   // /10 mask
-      },
-      {
-          .base_i = {ct_htonll(0xFCULL << 56), 0},
-          .mask_i = {ct_htonll(0xFEULL << 56), 0}  // /7
-      },
-  };
+inline constexpr AddrPrefix kPrivateRanges[] = {
+    AddrPrefix::v4(0x0A000000U, 8),   // 10.0.0.0/8
+    AddrPrefix::v4(0xAC100000U, 12),  // 172.16.0.0/12
+    AddrPrefix::v4(0xC0A80000U, 16),  // 192.168.0.0/16
+    AddrPrefix::v4(0x7F000000U, 8),   // 127.0.0.0/8
+    AddrPrefix::v4(0xA9FE0000U, 16),  // 169.254.0.0/16
+    AddrPrefix::v4(0x64400000U, 10),  // 100.64.0.0/10
+    {0, 1, 128},                      // ::1/128, loopback
+    {0xFE80ULL << 48, 0, 10},         // fe80::/10, link-local
+    {0xFEC0ULL << 48, 0, 10},         // fec0::/10, site-local
+    {0xFDULL << 56, 0, 8},            // fd00::/8, unique local address
+    {0xFCULL << 56, 0, 7},            // fc00::/7
+};
 
-  uint64_t addr_i[2];
-  std::memcpy(&addr_i[0], u.v6.s6_addr, sizeof(addr_i));
+std::uint64_t load_be64(const std::uint8_t *p) {
+  std::uint64_t res = 0;
+  for (int i = 0; i < 8; i++) {
+    res = (res << 8) | p[i];
+  }
+  return res;
+}
 
-  for (std::size_t i = 0; i < sizeof(priv_ranges) / sizeof(priv_ranges[0]);
-       i++) {
-    if ((addr_i[0] & priv_ranges[i].mask_i[0]) == priv_ranges[i].base_i[0] &&
-        (addr_i[1] & priv_ranges[i].mask_i[1]) == priv_ranges[i].base_i[1]) {
-      return true;
-    }
+bool IpAddr::is_private() const {
+  std::uint64_t hi;
+  std::uint64_t lo;
+  if (af == AF_INET) {
+    hi = 0;
+    lo = 0xFFFF00000000ULL | ntohl(u.v4.s_addr);
+  } else {
+    hi = load_be64(u.v6.s6_addr);
+    lo = load_be64(u.v6.s6_addr + 8);
   }
-  return false;
+
+  return std::any_of(
+      std::begin(kPrivateRanges), std::end(kPrivateRanges),
+      [hi, lo](const AddrPrefix &range) { return range.contains(hi, lo); });
 }
 
 struct ExtractResult {
@@ -214,15 +335,32 @@ struct ExtractResult {
   }
 };
 
-struct NgxTableEltNextT : ngx_table_elt_t {
-  NgxTableEltNextT(const ngx_table_elt_t &header) : ngx_table_elt_t{header} {}
-
-  std::unique_ptr<NgxTableEltNextT> next{};
+// The request headers with the name of first, in order. The headers after
+// first, if any, are found by scanning the header list again
+struct HeaderValues {
+  const ngx_table_elt_t *first;
+  const ngx_list_t *headers;  // null if first is the only one
+
+  // f returns true to stop the iteration
+  template <typename F>
+  void for_each(F &&f) const {
+    if (!headers) {
+      f(*first);
+      return;
+    }
+    std::string_view lc_key = dnsec::lc_key(*first);
+    for (const ngx_table_elt_t &header : dnsec::NgnixHeaderIterable{*headers}) {
+      if (header.hash == first->hash && dnsec::lc_key(header) == lc_key &&
+          f(header)) {
+        return;
+      }
+    }
+  }
 };
 
 struct HeaderProcessorDefinition {
  public:
-  using ExtractFunc = ExtractResult (*)(const NgxTableEltNextT &value,
+  using ExtractFunc = ExtractResult (*)(const HeaderValues &values,
                                         IpAddr &out);
 
   constexpr HeaderProcessorDefinition(std::string_view key,
@@ -236,9 +374,9 @@ struct HeaderProcessorDefinition {
   ExtractFunc parse_func;
 };
 // clang-format off
-ExtractResult parse_multiple_maybe_port(const NgxTableEltNextT& value, IpAddr &out);
+ExtractResult parse_multiple_maybe_port(const HeaderValues& values, IpAddr &out);
 ExtractResult parse_multiple_maybe_port_sv(std::string_view sv, IpAddr &out);
-ExtractResult parse_forwarded(const NgxTableEltNextT& value, IpAddr &out);
+ExtractResult parse_forwarded(const HeaderValues& values, IpAddr &out);
 ExtractResult parse_forwarded_sv(std::string_view sv, IpAddr &out);
 std::optional<IpAddr> parse_ip_address_maybe_port_pair(std::string_view sv);
 // clang-format on
@@ -259,9 +397,9 @@ static constexpr auto kPriorityHeaderArr =
         {"cf-connecting-ipv6"sv, parse_multiple_maybe_port},
     };
 
-std::optional<ngx_table_elt_t> get_request_header(const ngx_list_t &headers,
-                                                  std::string_view header_name,
-                                                  ngx_uint_t hash) {
+const ngx_table_elt_t *get_request_header(const ngx_list_t &headers,
+                                          std::string_view header_name,
+                                          ngx_uint_t hash) {
   dnsec::NgnixHeaderIterable it{headers};
   auto maybe_header =
       std::find_if(it.begin(), it.end(), [header_name, hash](auto &&header) {
@@ -269,76 +407,81 @@ std::optional<ngx_table_elt_t> get_request_header(const ngx_list_t &headers,
                dnsec::req_key_equals_ci(header, header_name);
       });
   if (maybe_header == it.end()) {
-    return std::nullopt;
+    return nullptr;
   }
 
-  return {*maybe_header};
+  return &*maybe_header;
 }
 
-using HeaderIndex =
-    std::unordered_map<std::string_view /*lc*/, NgxTableEltNextT>;
-
-void header_index_insert(HeaderIndex &index, const ngx_table_elt_t &header) {
-  auto lc_key = dnsec::lc_key(header);
-  auto it = index.find(lc_key);
-  if (it == index.end()) {
-    index.emplace(lc_key, header);
-  } else {
-    auto *cur = &it->second;
-    while (cur->next) {
-      cur = cur->next.get();
+// Entries are null for the headers that are not present
+using PriorityHeaders =
+    std::array<std::optional<HeaderValues>, kPriorityHeaderArr.size()>;
+
+// Finds the headers in kPriorityHeaderArr in a single pass, without allocating
+bool index_headers(const ngx_list_t &headers, PriorityHeaders &found) {
+  bool any = false;
+  auto add = [&](std::size_t i, const ngx_table_elt_t &header) {
+    any = true;
+    if (!found[i]) {
+      found[i] = HeaderValues{&header, nullptr};
+    } else {
+      found[i]->headers = &headers;
     }
-    cur->next = std::make_unique<NgxTableEltNextT>(header);
-  }
-}
+  };
 
-HeaderIndex index_headers(const ngx_list_t &headers) {
-  HeaderIndex index;
   dnsec::NgnixHeaderIterable it{headers};
   for (const ngx_table_elt_t &header : it) {
     switch (header.hash) {
-#define CASE(header_lc_name)                       \
-  case dnsec::ngx_hash_ce(header_lc_name):         \
-    if (dnsec::lc_key(header) == header_lc_name) { \
-      header_index_insert(index, header);          \
-    }                                              \
+#define CASE(i)                                                  \
+  case kPriorityHeaderArr[i].lc_key_hash:                        \
+    if (dnsec::lc_key(header) == kPriorityHeaderArr[i].lc_key) { \
+      add(i, header);                                            \
+    }                                                            \
     continue;
-      CASE("x-forwarded-for"sv)
-      CASE("x-real-ip"sv)
-      CASE("true-client-ip"sv)
-      CASE("x-client-ip"sv)
-      CASE("x-forwarded"sv)
-      CASE("forwarded"sv)
-      CASE("forwarded-for"sv)
-      CASE("x-cluster-client-ip"sv)
-      CASE("fastly-client-ip"sv)
-      CASE("cf-connecting-ip"sv)
-      CASE("cf-connecting-ipv6"sv)
+      CASE(0)
+      CASE(1)
+      CASE(2)
+      CASE(3)
+      CASE(4)
+      CASE(5)
+      CASE(6)
+      CASE(7)
+      CASE(8)
+      CASE(9)
+      CASE(10)
+#undef CASE
       default:
         continue;
     }
   }
+  static_assert(kPriorityHeaderArr.size() == 11);
 
-  return index;
+  return any;
 }
 
 using ExtractStringViewFunc = ExtractResult (*)(std::string_view value_sv,
                                                 IpAddr &);
 
 template <ExtractStringViewFunc f>
-ExtractResult parse_multiple(const NgxTableEltNextT &value, IpAddr &out) {
+ExtractResult parse_multiple(const HeaderValues &values, IpAddr &out) {
   IpAddr first_private{};
-  for (const NgxTableEltNextT *h = &value; h; h = h->next.get()) {
+  bool found_public = false;
+  values.for_each([&](const ngx_table_elt_t &h) {
     IpAddr out_cur_round;
-    std::string_view header_v{to_string_view(h->value)};
+    std::string_view header_v{to_string_view(h.value)};
     ExtractResult res = f(header_v, out_cur_round);
     if (res == ExtractResult::success_public()) {
       out = out_cur_round;
-      return res;
+      found_public = true;
     } else if (first_private.empty() &&
                res == ExtractResult::success_private()) {
       first_private = out_cur_round;
     }
+    return found_public;
+  });
+
+  if (found_public) {
+    return ExtractResult::success_public();
   }
 
   if (!first_private.empty()) {
@@ -349,9 +492,9 @@ ExtractResult parse_multiple(const NgxTableEltNextT &value, IpAddr &out) {
   return ExtractResult::failure();
 }
 
-ExtractResult parse_multiple_maybe_port(const NgxTableEltNextT &value,
+ExtractResult parse_multiple_maybe_port(const HeaderValues &values,
                                         IpAddr &out) {
-  return parse_multiple<parse_multiple_maybe_port_sv>(value, out);
+  return parse_multiple<parse_multiple_maybe_port_sv>(values, out);
 }
 
 ExtractResult parse_multiple_maybe_port_sv(std::string_view value_sv,
@@ -386,8 +529,8 @@ ExtractResult parse_multiple_maybe_port_sv(std::string_view value_sv,
   return ExtractResult::failure();
 }
 
-ExtractResult parse_forwarded(const NgxTableEltNextT &value, IpAddr &out) {
-  return parse_multiple<parse_forwarded_sv>(value, out);
+ExtractResult parse_forwarded(const HeaderValues &values, IpAddr &out) {
+  return parse_multiple<parse_forwarded_sv>(values, out);
 }
 
 ExtractResult parse_forwarded_sv(std::string_view value_sv, IpAddr &out) {
@@ -510,7 +653,7 @@ std::optional<IpAddr> parse_ip_address_maybe_port_pair(
     if (!pos_close) {
       return std::nullopt;
     }
-    std::string_view between_brackets = addr_sv.substr(1, pos_close);
+    std::string_view between_brackets = addr_sv.substr(1, pos_close - 1);
     return IpAddr::from_string(between_brackets, AF_INET6);
   }
 
@@ -523,6 +666,73 @@ std::optional<IpAddr> parse_ip_address_maybe_port_pair(
 
   return IpAddr::from_string(addr_sv);
 }
+
+// The textual form of the peer address of a connection
+struct RemoteAddrCache {
+  IpAddr addr;
+  std::size_t len;  // 0 if not set
+  char str[INET6_ADDRSTRLEN];
+};
+
+// identifies the cleanup holding the RemoteAddrCache; the memory belongs to
+// the connection pool
+void remote_addr_cache_cleanup(void * /*data*/) noexcept {}
+
+RemoteAddrCache *find_remote_addr_cache(const ngx_connection_t &conn) {
+  if (!conn.pool) {
+    return nullptr;
+  }
+  for (auto *cln = conn.pool->cleanup; cln; cln = cln->next) {
+    if (cln->handler == remote_addr_cache_cleanup) {
+      return static_cast<RemoteAddrCache *>(cln->data);
+    }
+  }
+  return nullptr;
+}
+
+RemoteAddrCache *create_remote_addr_cache(ngx_connection_t &conn) {
+  if (!conn.pool) {
+    return nullptr;
+  }
+  ngx_pool_cleanup_t *cln =
+      ngx_pool_cleanup_add(conn.pool, sizeof(RemoteAddrCache));
+  if (!cln) {
+    return nullptr;
+  }
+  cln->handler = remote_addr_cache_cleanup;
+  return new (cln->data) RemoteAddrCache{};
+}
+
+std::optional<std::string> remote_addr_string(
+    const ngx_http_request_t &request, const IpAddr &remote_addr) {
+  // Without usable forwarding headers, the result depends only on the peer
+  // address, which is the same for all the requests of a keepalive or HTTP/2
+  // connection. Keep it on the connection, together with the address it was
+  // computed for: modules like realip change the address per request. This
+  // runs on the event loop, so the connection pool can be used
+  ngx_connection_t *conn = request.connection;
+  if (request.stream) {
+    conn = request.stream->connection->connection;
+  }
+  RemoteAddrCache *cache = find_remote_addr_cache(*conn);
+  if (cache && cache->len > 0 && cache->addr == remote_addr) {
+    return {std::string{cache->str, cache->len}};
+  }
+
+  if (!cache) {
+    cache = create_remote_addr_cache(*conn);
+    if (!cache) {
+      return remote_addr.to_string();
+    }
+  }
+
+  cache->addr = remote_addr;
+  cache->len = remote_addr.format(cache->str);
+  if (cache->len == 0) {
+    return std::nullopt;
+  }
+  return {std::string{cache->str, cache->len}};
+}
 }  // namespace
 
 namespace datadog::nginx::security {
@@ -533,21 +743,22 @@ ClientIp::ClientIp(std::optional<HashedStringView> configured_header,
 
 std::optional<std::string> ClientIp::resolve() const {
   if (configured_header_) {
-    std::optional<ngx_table_elt_t> maybe_header =
+    const ngx_table_elt_t *header =
         get_request_header(request_.headers_in.headers, configured_header_->str,
                            configured_header_->hash);
 
-    if (!maybe_header) {
+    if (!header) {
       return std::nullopt;
     }
 
+    HeaderValues values{header, nullptr};
     IpAddr out;
-    ExtractResult res = parse_forwarded(*maybe_header, out);
+    ExtractResult res = parse_forwarded(values, out);
     if (res.success) {
       return out.to_string();
     }
 
-    res = parse_multiple_maybe_port(*maybe_header, out);
+    res = parse_multiple_maybe_port(values, out);
     if (res.success) {
       return out.to_string();
     }
@@ -556,24 +767,24 @@ std::optional<std::string> ClientIp::resolve() const {
   }
 
   // path without custom defined header starts here
-  HeaderIndex header_index = index_headers(request_.headers_in.headers);
+  PriorityHeaders headers{};
   IpAddr cur_private{};
-  for (std::size_t i = 0; i < kPriorityHeaderArr.size(); i++) {
-    const HeaderProcessorDefinition &def = kPriorityHeaderArr[i];
-    auto maybe_elem = header_index.find(def.lc_key);
-    if (maybe_elem == header_index.end()) {
-      continue;
-    }
-
-    const NgxTableEltNextT &header = maybe_elem->second;
-    IpAddr out;
-    ExtractResult res = def.parse_func(header, out);
-    if (res.success) {
-      if (!res.is_private) {
-        return out.to_string();
+  if (index_headers(request_.headers_in.headers, headers)) {
+    for (std::size_t i = 0; i < kPriorityHeaderArr.size(); i++) {
+      if (!headers[i]) {
+        continue;
       }
-      if (cur_private.empty()) {
-        cur_private = out;
+
+      const HeaderProcessorDefinition &def = kPriorityHeaderArr[i];
+      IpAddr out;
+      ExtractResult res = def.parse_func(*headers[i], out);
+      if (res.success) {
+        if (!res.is_private) {
+          return out.to_string();
+        }
+        if (cur_private.empty()) {
+          cur_private = out;
+        }
       }
     }
   }
@@ -590,12 +801,13 @@ std::optional<std::string> ClientIp::resolve() const {
   }
 
   if (!remote_addr.empty()) {
+    if (cur_private.empty()) {
+      return remote_addr_string(request_, remote_addr);
+    }
     if (!remote_addr.is_private()) {
       return remote_addr.to_string();
     }
-    if (cur_private.empty()) {
-      return remote_addr.to_string();
-    }  // else cur_private is preferred below
+    // else cur_private is preferred below
   }
 
   // no remote address
@@ -605,4 +817,5 @@ std::optional<std::string> ClientIp::resolve() const {
 
   return std::nullopt;
 }
+
 }  // namespace datadog::nginx::security
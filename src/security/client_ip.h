@@ -17,6 +17,8 @@ class ClientIp {
   ClientIp(std::optional<HashedStringView> configured_header,
            const ngx_http_request_t &request);
 
+  // Must be called on the event loop: without a configured header or a
+  // public forwarded address, the result is cached on the connection.
   std::optional<std::string> resolve() const;
 
  private:
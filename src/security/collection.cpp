@@ -2,6 +2,7 @@
 
 #include <ddwaf.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cctype>
 #include <cstring>
@@ -11,6 +12,7 @@
 #include "../string_util.h"
 #include "ddwaf_obj.h"
 #include "decode.h"
+#include "library.h"
 #include "security/body_parse/body_parsing.h"
 #include "util.h"
 
@@ -52,38 +54,71 @@ class ReqSerializer {
  public:
   explicit ReqSerializer(dnsec::DdwafMemres &memres) : memres_{memres} {}
 
+  // only the addresses known to the handle (consumed by some rule or
+  // processor) are serialized
   ddwaf_object *serialize(const ngx_http_request_t &request,
-                          const std::optional<std::string> &client_ip) {
+                          const std::optional<std::string> &client_ip,
+                          const dnsec::OwnedDdwafHandle &handle) {
+    const bool query = handle.is_known_address(kQuery);
+    const bool uri_raw = handle.is_known_address(kUriRaw);
+    const bool method = handle.is_known_address(kMethod);
+    const bool headers = handle.is_known_address(kHeadersNoCookies);
+    const bool cookies = handle.is_known_address(kCookies);
+    const bool ip = handle.is_known_address(kClientIp);
+
     dnsec::ddwaf_obj *root = memres_.allocate_objects<dnsec::ddwaf_obj>(1);
-    dnsec::ddwaf_map_obj &root_map = root->make_map(6, memres_);
+    auto nb_entries = static_cast<dnsec::ddwaf_obj::nb_entries_t>(
+        query + uri_raw + method + headers + cookies + ip);
+    dnsec::ddwaf_map_obj &root_map = root->make_map(nb_entries, memres_);
 
-    set_request_query(request, root_map.at_unchecked(0));
-    set_request_uri_raw(request, root_map.at_unchecked(1));
-    set_request_method(request, root_map.at_unchecked(2));
-    set_request_headers_nocookies(request, root_map.at_unchecked(3));
-    set_request_cookie(request, root_map.at_unchecked(4));
-    set_client_ip(client_ip, root_map.at_unchecked(5));
+    decltype(nb_entries) idx = 0;
+    if (query) {
+      set_request_query(request, root_map.at_unchecked(idx++));
+    }
+    if (uri_raw) {
+      set_request_uri_raw(request, root_map.at_unchecked(idx++));
+    }
+    if (method) {
+      set_request_method(request, root_map.at_unchecked(idx++));
+    }
+    if (headers) {
+      set_request_headers_nocookies(request, root_map.at_unchecked(idx++));
+    }
+    if (cookies) {
+      set_request_cookie(request, root_map.at_unchecked(idx++));
+    }
+    if (ip) {
+      set_client_ip(client_ip, root_map.at_unchecked(idx++));
+    }
 
     return root;
   }
 
   ddwaf_object *serialize_end(const ngx_http_request_t &request,
                               ngx_chain_t *body_chain, std::size_t body_size,
-                              bool extract_schema) {
+                              bool extract_schema,
+                              const dnsec::OwnedDdwafHandle &handle) {
+    // response data is otherwise only needed for schema extraction
+    auto needed = [&](std::string_view address) {
+      return handle.rules_use_address(address) ||
+             (extract_schema && handle.is_known_address(address));
+    };
+    const bool status = needed(kStatus);
+    const bool headers = needed(kRespHeadersNoCookies);
+    const bool has_body = body_chain && body_size > 0 && needed(kRespBody);
+
     dnsec::ddwaf_obj *root = memres_.allocate_objects<dnsec::ddwaf_obj>(1);
-    datadog::nginx::security::ddwaf_obj::nb_entries_t nb_entries = 2;
-    if (extract_schema) {
-      nb_entries++;
-    }
-    const bool has_body = body_chain && body_size > 0;
-    if (has_body) {
-      nb_entries++;
-    }
+    auto nb_entries = static_cast<dnsec::ddwaf_obj::nb_entries_t>(
+        status + headers + has_body + extract_schema);
     dnsec::ddwaf_map_obj &root_map = root->make_map(nb_entries, memres_);
 
     decltype(nb_entries) idx = 0;
-    set_response_status(request, root_map.at_unchecked(idx++));
-    set_response_headers_no_cookies(request, root_map.at_unchecked(idx++));
+    if (status) {
+      set_response_status(request, root_map.at_unchecked(idx++));
+    }
+    if (headers) {
+      set_response_headers_no_cookies(request, root_map.at_unchecked(idx++));
+    }
     if (has_body) {
       set_response_body(request, *body_chain, body_size,
                         root_map.at_unchecked(idx++));
@@ -247,8 +282,15 @@ class ReqSerializer {
         return dnsec::lc_key(header);
       }
 
-      // impl for response headers
+      // impl for response headers. lowcase_key can't be relied upon: modules
+      // adding response headers generally leave it uninitialized. But with
+      // HTTP/2 upstreams and many modules the key is already lowercase, in
+      // which case it can be referenced directly
       auto key = to_string_view(header.key);
+      if (std::none_of(key.begin(), key.end(),
+                       [](char c) { return c >= 'A' && c <= 'Z'; })) {
+        return key;
+      }
       auto it = lc_keys_.find(key);
       if (it != lc_keys_.end()) {
         return it->second;
@@ -340,7 +382,8 @@ class ReqSerializer {
       slot.make_null();
       return;
     }
-    slot.make_string(*cl_ip, memres_);  // copy
+    // backed by the context, which outlives the ddwaf context runs
+    slot.make_string(*cl_ip);
   }
 
   void set_response_status(const ngx_http_request_t &request,
@@ -408,17 +451,20 @@ namespace datadog::nginx::security {
 
 ddwaf_object *collect_request_data(const ngx_http_request_t &request,
                                    const std::optional<std::string> &client_ip,
+                                   const OwnedDdwafHandle &handle,
                                    DdwafMemres &memres) {
   ReqSerializer rs{memres};
-  return rs.serialize(request, client_ip);
+  return rs.serialize(request, client_ip, handle);
 }
 
 ddwaf_object *collect_response_data(const ngx_http_request_t &request,
                                     ngx_chain_t *body_chain,
                                     std::size_t body_size, bool extract_schema,
+                                    const OwnedDdwafHandle &handle,
                                     DdwafMemres &memres) {
   ReqSerializer rs{memres};
-  return rs.serialize_end(request, body_chain, body_size, extract_schema);
+  return rs.serialize_end(request, body_chain, body_size, extract_schema,
+                          handle);
 }
 }  // namespace datadog::nginx::security
 
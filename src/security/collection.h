@@ -5,6 +5,7 @@
 #include <optional>
 
 #include "ddwaf_memres.h"
+#include "library.h"
 
 extern "C" {
 #include <ngx_http.h>
@@ -14,9 +15,11 @@ namespace datadog::nginx::security {
 
 ddwaf_object *collect_request_data(const ngx_http_request_t &request,
                                    const std::optional<std::string> &client_ip,
+                                   const OwnedDdwafHandle &handle,
                                    DdwafMemres &memres);
 ddwaf_object *collect_response_data(const ngx_http_request_t &request,
                                     ngx_chain_t *body_chain,
                                     std::size_t body_size, bool extract_schema,
+                                    const OwnedDdwafHandle &handle,
                                     DdwafMemres &memres);
 }  // namespace datadog::nginx::security
@@ -1,52 +1,78 @@
+#pragma once
+
 #include <optional>
 #include <string>
+#include <string_view>
 
 extern "C" {
 #define ZLIB_CONST
 #include <zlib.h>
 }
 
-namespace {
-size_t estimate_compressed_size(size_t in_len) {
-  // Taken from PHP approach
-  // https://heap.space/xref/PHP-7.3/ext/zlib/php_zlib.h?r=8d3f8ca1#36
-  // NOLINTBEGIN(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-  return (((size_t)((double)in_len * (double)1.015)) + 10 + 8 + 4 + 1);
-  // NOLINTEND(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-}
-}  // namespace
-
 namespace datadog::nginx::security {
-inline std::optional<std::string> compress(const std::string_view &text) {
-  std::string ret_string;
-  z_stream strm = {};
 
-  if (text.length() == 0) {
-    return std::nullopt;
+// gzip compressor whose zlib state and output buffer survive between calls.
+// Initializing a deflate stream allocates ~256 KB and schemas are compressed
+// for most requests under attack, so each thread keeps one and resets it.
+class Compressor {
+ public:
+  Compressor() = default;
+  Compressor(const Compressor &) = delete;
+  Compressor &operator=(const Compressor &) = delete;
+  ~Compressor() {
+    if (initialized_) {
+      deflateEnd(&strm_);
+    }
   }
 
-  static constexpr auto window_bits = 15 | 0x10 /* for gzip */;
-  if (Z_OK == deflateInit2(&strm, -1, Z_DEFLATED, window_bits, MAX_MEM_LEVEL,
-                           Z_DEFAULT_STRATEGY)) {
-    auto size = estimate_compressed_size(text.length());
-    ret_string.resize(size);
+  // The result is valid until the next call on the same object
+  std::optional<std::string_view> compress(std::string_view text) {
+    if (text.empty()) {
+      return std::nullopt;
+    }
+
+    if (!initialized_) {
+      static constexpr auto window_bits = 15 | 0x10 /* for gzip */;
+      if (deflateInit2(&strm_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits,
+                       MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return std::nullopt;
+      }
+      initialized_ = true;
+    } else if (deflateReset(&strm_) != Z_OK) {
+      return std::nullopt;
+    }
+
+    // with Z_FINISH and this much space, deflate completes in one call
+    auto size = deflateBound(&strm_, text.length());
+    if (out_.size() < size) {
+      out_.resize(size);
+    }
 
     // NOLINTBEGIN(cppcoreguidelines-pro-type-reinterpret-cast)
-    strm.next_in = reinterpret_cast<const Bytef *>(text.data());
-    strm.next_out = reinterpret_cast<Bytef *>(ret_string.data());
+    strm_.next_in = reinterpret_cast<const Bytef *>(text.data());
+    strm_.next_out = reinterpret_cast<Bytef *>(out_.data());
     // NOLINTEND(cppcoreguidelines-pro-type-reinterpret-cast)
-    strm.avail_in = text.length();
-    strm.avail_out = size;
-
-    if (Z_STREAM_END == deflate(&strm, Z_FINISH)) {
-      deflateEnd(&strm);
-      /* size buffer down to actual length */
-      ret_string.resize(strm.total_out);
-      ret_string.shrink_to_fit();
-      return ret_string;
+    strm_.avail_in = text.length();
+    strm_.avail_out = out_.size();
+
+    if (deflate(&strm_, Z_FINISH) != Z_STREAM_END) {
+      return std::nullopt;
     }
-    deflateEnd(&strm);
+    return std::string_view{out_.data(), strm_.total_out};
   }
-  return std::nullopt;
+
+  static Compressor &for_this_thread() {
+    static thread_local Compressor compressor;
+    return compressor;
+  }
+
+ private:
+  z_stream strm_{};
+  bool initialized_{false};
+  std::string out_;
+};
+
+inline std::optional<std::string_view> compress(std::string_view text) {
+  return Compressor::for_this_thread().compress(text);
 }
 }  // namespace datadog::nginx::security
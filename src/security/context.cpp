@@ -3,6 +3,7 @@
 #include <atomic>
 #include <chrono>
 #include <climits>
+#include <functional>
 #include <optional>
 #include <stdexcept>
 #include <thread>
@@ -22,6 +23,7 @@
 #include "library.h"
 #include "stats.h"
 #include "util.h"
+#include "waf_executor.h"
 
 extern "C" {
 #include <ngx_buf.h>
@@ -85,6 +87,70 @@ constexpr ngx_int_t kTaskPostFailureMaskInitialWaf = 1;
 constexpr ngx_int_t kTaskPostFailureMaskReqBodyWaf = 2;
 constexpr ngx_int_t kTaskPostFailureMaskFinalWaf = 4;
 
+namespace {
+constexpr std::string_view kReqBodyAddress{"server.request.body"};
+constexpr std::string_view kRespBodyAddress{"server.response.body"};
+
+// identifies the endpoint for the purposes of API security sampling
+std::uint64_t api_security_endpoint_hash(const ngx_http_request_t &request) {
+  std::hash<std::string_view> hasher;
+  std::uint64_t hash = hasher(to_string_view(request.method_name));
+  hash = hash * 31 + hasher(to_string_view(request.uri));
+  return hash * 31 + static_cast<std::uint64_t>(request.headers_out.status);
+}
+
+// Upper bound on the size of the data submitted on the initial WAF run (URI,
+// including the query string, plus header names and values) for the run to be
+// done inline on the event loop.
+constexpr std::size_t kMaxInlineWafInputSize = 4 * 1024;
+
+// Exponentially weighted moving average (weight 1/8) of the duration of the
+// initial WAF runs in this worker, be they inline or on the thread pool.
+// Updates from several threads may race and lose a sample, which is harmless.
+class InitialWafRunCost {
+ public:
+  static std::uint64_t average_usec() noexcept {
+    return average_usec_.load(std::memory_order_relaxed);
+  }
+
+  static void record(std::chrono::steady_clock::duration duration) noexcept {
+    auto const sample = static_cast<std::int64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(duration)
+            .count());
+    auto const average = static_cast<std::int64_t>(average_usec());
+    average_usec_.store(
+        static_cast<std::uint64_t>(average + (sample - average) / 8),
+        std::memory_order_relaxed);
+  }
+
+ private:
+  static inline std::atomic<std::uint64_t> average_usec_{0};
+};
+
+std::size_t estimate_initial_waf_input_size(
+    const ngx_http_request_t &request) noexcept {
+  std::size_t size = request.unparsed_uri.len;
+  for (const ngx_list_part_t *part = &request.headers_in.headers.part;
+       part != nullptr && size <= kMaxInlineWafInputSize; part = part->next) {
+    const auto *headers = static_cast<const ngx_table_elt_t *>(part->elts);
+    for (ngx_uint_t i = 0; i < part->nelts; i++) {
+      size += headers[i].key.len + headers[i].value.len;
+    }
+  }
+  return size;
+}
+
+bool should_run_initial_waf_inline(const ngx_http_request_t &request) noexcept {
+  std::uint64_t const budget = Library::waf_inline_budget_usec();
+  if (budget == 0) {
+    return false;
+  }
+
+  return InitialWafRunCost::average_usec() <= budget &&
+         estimate_initial_waf_input_size(request) <= kMaxInlineWafInputSize;
+}
+}  // namespace
+
 Context::Context(std::shared_ptr<OwnedDdwafHandle> handle,
                  bool apm_tracing_enabled)
     : stage_{new std::atomic<stage>{}},
@@ -94,6 +160,7 @@ Context::Context(std::shared_ptr<OwnedDdwafHandle> handle,
   }
 
   waf_ctx_ = std::make_unique<DdwafContext>(handle);
+  waf_handle_ = std::move(handle);
 
   stage_->store(stage::START, std::memory_order_relaxed);
   Stats::context_started();
@@ -102,7 +169,7 @@ Context::Context(std::shared_ptr<OwnedDdwafHandle> handle,
 Context::~Context() { Stats::context_closed(); }
 
 std::unique_ptr<Context> Context::maybe_create(
-    std::optional<std::size_t> max_saved_output_data,
+    std::optional<std::size_t> max_saved_output_data, bool stream_response,
     bool apm_tracing_enabled) {
   std::shared_ptr<OwnedDdwafHandle> handle = Library::get_handle();
   if (!handle) {
@@ -113,6 +180,7 @@ std::unique_ptr<Context> Context::maybe_create(
   if (max_saved_output_data) {
     res->max_saved_output_data_ = *max_saved_output_data;
   }
+  res->stream_response_ = stream_response;
   return res;
 }
 
@@ -167,8 +235,7 @@ class PolTaskCtx {
       simulate_task_post_failure = true;
     }
 
-    if (simulate_task_post_failure ||
-        ngx_thread_task_post(pool, &get_task()) != NGX_OK) {
+    if (simulate_task_post_failure || !post_task(pool)) {
       ngx_log_error(NGX_LOG_ERR, req_log(), 0, "failed to post task %p",
                     &get_task());
 
@@ -205,6 +272,13 @@ class PolTaskCtx {
 
   ngx_log_t *req_log() const noexcept { return req_.connection->log; }
 
+  bool post_task(ngx_thread_pool_t *pool) noexcept {
+    if (WafExecutor::running()) {
+      return WafExecutor::post(get_task());
+    }
+    return ngx_thread_task_post(pool, &get_task()) == NGX_OK;
+  }
+
   static void handler(void *self, ngx_log_t *tp_log) noexcept {
     static_cast<Self *>(self)->handle(tp_log);
   }
@@ -321,6 +395,16 @@ class PolTaskCtx {
     }
 #endif
 
+    if constexpr (Self::kDetached) {
+      // the request was not suspended, so there is nothing to resume; the
+      // reference we hold is released by complete()
+      ngx_log_debug(NGX_LOG_DEBUG_HTTP, req_log(), 0,
+                    "calling complete on detached task %p", &get_task());
+      as_self().complete();
+      self_copy->~Self();
+      return;
+    }
+
     if (count > 1) {
       // ngx_del_event(connection->read, NGX_READ_EVENT, 0) may've been called
       // by ngx_http_block_reading
@@ -352,6 +436,11 @@ class PolTaskCtx {
   // define in subclasses
   void complete() noexcept = delete;
 
+  // subclasses whose tasks run without suspending the request set this to
+  // true; their complete() is then called even if the task holds the last
+  // reference to the request, and must release it
+  static inline constexpr bool kDetached = false;
+
   void replace_handlers() noexcept {
     req_.read_event_handler = ngx_http_block_reading;
     req_.write_event_handler = PolTaskCtx<Self>::empty_write_handler;
@@ -488,6 +577,17 @@ bool Context::do_on_request_start(ngx_http_request_t &request, dd::Span &span) {
     return false;
   }
 
+  // on the event loop: the resolution reads and caches data on the connection.
+  // Set before serialization: the WAF input references client_ip_'s storage
+  dnsec::ClientIp ip_resolver{dnsec::Library::custom_ip_header(), request};
+  client_ip_ = ip_resolver.resolve();
+
+  if (should_run_initial_waf_inline(request)) {
+    Stats::waf_run_inline();
+    return run_waf_start_inline(request, span);
+  }
+
+  Stats::waf_run_pooled();
   auto &task_ctx = Pol1stWafCtx::create(request, *this, span);
 
   if (std::move(task_ctx).submit(conf->waf_pool)) {
@@ -498,6 +598,39 @@ bool Context::do_on_request_start(ngx_http_request_t &request, dd::Span &span) {
   return false;
 }
 
+bool Context::run_waf_start_inline(ngx_http_request_t &request,
+                                   dd::Span &span) {
+  ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
+                "running initial waf inline (average run: %uLus)",
+                InitialWafRunCost::average_usec());
+
+  std::optional<BlockSpecification> block_spec = run_waf_start(request, span);
+  if (!block_spec) {
+    return false;
+  }
+
+  span.set_tag("appsec.blocked"sv, "true"sv);
+
+  auto *service = BlockingService::get_instance();
+  assert(service != nullptr);
+  ngx_int_t rc;
+  try {
+    rc = service->block(*block_spec, request);
+  } catch (const std::exception &e) {
+    ngx_log_error(NGX_LOG_ERR, request.connection->log, 0,
+                  "failed to block request: %s", e.what());
+    rc = NGX_ERROR;
+  }
+
+  ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
+                "inline initial waf run: sent blocking response; calling "
+                "ngx_http_finalize_request with %i",
+                rc);
+  ngx_http_finalize_request(&request, rc);
+  // the request may have been destroyed at this point
+  return true;
+}
+
 std::optional<BlockSpecification> Context::run_waf_start(
     ngx_http_request_t &req, dd::Span &span) {
   auto st = stage_->load(std::memory_order_acquire);
@@ -505,27 +638,30 @@ std::optional<BlockSpecification> Context::run_waf_start(
     return std::nullopt;
   }
 
+  auto const start = std::chrono::steady_clock::now();
+
   span.set_metric("_dd.appsec.enabled"sv, 1.0);
   span.set_tag("_dd.runtime_family", "cpp"sv);
   static const std::string_view libddwaf_version{ddwaf_get_version()};
   span.set_tag("_dd.appsec.waf.version", libddwaf_version);
 
-  dnsec::ClientIp ip_resolver{dnsec::Library::custom_ip_header(), req};
-  auto client_ip = ip_resolver.resolve();
-
-  ddwaf_object *data = collect_request_data(req, client_ip, memres_);
-
-  client_ip_ = std::move(client_ip);
+  // client_ip_ was resolved on the event loop (see do_on_request_start)
+  ddwaf_object *data =
+      collect_request_data(req, client_ip_, *waf_handle_, memres_);
 
   auto &&log = *req.connection->log;
   auto [_, block_spec] = waf_ctx_->run(log, *data);
 
   if (block_spec) {
+    // no more WAF runs: render the report here rather than at log phase
+    waf_ctx_->prepare_report();
     stage_->store(stage::AFTER_BEGIN_WAF_BLOCK, std::memory_order_release);
   } else {
     stage_->store(stage::AFTER_BEGIN_WAF, std::memory_order_release);
   }
 
+  InitialWafRunCost::record(std::chrono::steady_clock::now() - start);
+
   return block_spec;
 }
 
@@ -824,6 +960,68 @@ class PolFinalWafCtx : public PolTaskCtx<PolFinalWafCtx> {
   }
 };
 
+// Final WAF run with datadog_appsec_stream_response. The response is being
+// sent while the task runs, so the request is not suspended; the task only
+// holds a reference to it. Once the header has been sent, the only way to
+// block is to reset the connection (or the HTTP/2 stream)
+class PolStreamedFinalWafCtx : public PolTaskCtx<PolStreamedFinalWafCtx> {
+  using PolTaskCtx::PolTaskCtx;
+
+  static inline constexpr bool kDetached = true;
+
+  static ngx_int_t get_task_failure_flag() noexcept {
+    return kTaskPostFailureMaskFinalWaf;
+  }
+
+  std::optional<BlockSpecification> do_handle(ngx_log_t &tp_log) {
+    return ctx_.run_waf_end(req_, span_);
+  }
+
+  void complete() noexcept {
+    bool const ran = ran_on_thread_.load(std::memory_order_acquire);
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, req_log(), 0,
+                  "completion handler of streamed waf final task (ran: %s, "
+                  "blocked: %s)",
+                  ran ? "true" : "false", block_spec_ ? "true" : "false");
+
+    ctx_.waf_final_done(req_, false);
+
+    if (!ran || !block_spec_) {
+      // release our reference
+      ngx_http_finalize_request(&req_, NGX_DONE);
+      return;
+    }
+
+    span_.set_tag("appsec.blocked"sv, "true"sv);
+    ngx_log_error(NGX_LOG_INFO, req_log(), 0,
+                  "WAF requested blocking after the response was committed; "
+                  "resetting the connection");
+
+    ngx_connection_t *connection = req_.connection;
+    if (req_.http_version < NGX_HTTP_VERSION_20) {
+      // like reset_timedout_connection; for HTTP/2, terminating the request
+      // resets the stream instead
+      struct linger linger {};
+      linger.l_onoff = 1;
+      linger.l_linger = 0;
+      if (setsockopt(connection->fd, SOL_SOCKET, SO_LINGER, &linger,
+                     sizeof(linger)) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, req_log(), ngx_socket_errno,
+                      "setsockopt(SO_LINGER) failed");
+      }
+    }
+
+    ngx_http_finalize_request(&req_, NGX_ERROR);
+    // the termination may have been posted
+    ngx_http_run_posted_requests(connection);
+  }
+
+  void replace_handlers() noexcept {}
+  void restore_handlers() noexcept {}
+
+  friend PolTaskCtx;
+};
+
 ngx_int_t Context::do_request_body_filter(ngx_http_request_t &request,
                                           ngx_chain_t *in, dd::Span &span) {
   auto st = stage_->load(std::memory_order_acquire);
@@ -833,6 +1031,14 @@ ngx_int_t Context::do_request_body_filter(ngx_http_request_t &request,
                 in ? "with" : "without", filter_ctx_.out_total,
                 filter_ctx_.copied_total, static_cast<int>(st));
 
+  if (st == stage::AFTER_BEGIN_WAF &&
+      !waf_handle_->is_known_address(kReqBodyAddress)) {
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
+                  "no rule consumes the request body; not buffering it");
+    transition_to_stage(stage::AFTER_ON_REQ_WAF);
+    return ngx_http_next_request_body_filter(&request, in);
+  }
+
   if (st == stage::AFTER_BEGIN_WAF) {
     ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
                   "first filter call, req refcount=%d", request.main->count);
@@ -846,6 +1052,11 @@ ngx_int_t Context::do_request_body_filter(ngx_http_request_t &request,
     // are avoided by swapping the handlers before starting the WAF task.
     request.request_body->filter_need_buffering = true;
 
+    // copy the body into a single area as it arrives, so that it doesn't have
+    // to be linearized before parsing
+    reserve_contiguous_req_body(request);
+    req_body_parser_ = IncrementalBodyParser::for_request(request);
+
     if (in && in->buf->pos ==
                   request.header_in->pos - (in->buf->last - in->buf->pos)) {
       // preread call by ngx_http_read_client_request_body.
@@ -866,6 +1077,7 @@ ngx_int_t Context::do_request_body_filter(ngx_http_request_t &request,
     if (buffer_chain(filter_ctx_, RequestPool{request}, in, true) != NGX_OK) {
       return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
+    feed_req_body_parser(request);
 
     st = transition_to_stage(stage::COLLECTING_ON_REQ_DATA);
   } else if (st == stage::COLLECTING_ON_REQ_DATA) {
@@ -899,6 +1111,8 @@ ngx_int_t Context::do_request_body_filter(ngx_http_request_t &request,
       PolReqBodyWafCtx &task_ctx =
           PolReqBodyWafCtx::create(request, *this, span);
 
+      // the WAF thread reads the contiguous data; don't touch it anymore
+      filter_ctx_.stop_contiguous();
       transition_to_stage(stage::SUSPENDED_ON_REQ_WAF);
 
       auto *conf = static_cast<datadog_loc_conf_t *>(
@@ -918,6 +1132,7 @@ ngx_int_t Context::do_request_body_filter(ngx_http_request_t &request,
       if (buffer_chain(filter_ctx_, RequestPool{request}, in, true) != NGX_OK) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
       }
+      feed_req_body_parser(request);
     }
   } else if (st == stage::AFTER_ON_REQ_WAF ||
              st == stage::AFTER_ON_REQ_WAF_BLOCK) {
@@ -1008,11 +1223,22 @@ ngx_int_t Context::buffer_chain(FilterCtx &filter_ctx, RequestPool pool,
         size = buf->last - buf->pos;
 
         if (size > 0) {
-          new_buf = ngx_create_temp_buf(pool, size);
-          if (!new_buf) {
-            return NGX_ERROR;
+          u_char *copy = filter_ctx.append_contiguous(pool, buf->pos, size);
+          if (copy) {
+            new_buf = static_cast<ngx_buf_t *>(ngx_calloc_buf(pool));
+            if (!new_buf) {
+              return NGX_ERROR;
+            }
+            new_buf->temporary = 1;
+            new_buf->start = new_buf->pos = copy;
+            new_buf->end = new_buf->last = copy + size;
+          } else {
+            new_buf = ngx_create_temp_buf(pool, size);
+            if (!new_buf) {
+              return NGX_ERROR;
+            }
+            new_buf->last = ngx_copy(new_buf->pos, buf->pos, size);
           }
-          new_buf->last = ngx_copy(new_buf->pos, buf->pos, size);
           buf->pos = buf->last;  // consume
           filter_ctx.copied_total += size;
         } else {
@@ -1031,6 +1257,7 @@ ngx_int_t Context::buffer_chain(FilterCtx &filter_ctx, RequestPool pool,
         }
       } else {
         // file buffers (or mixed memory/file buffers)
+        filter_ctx.stop_contiguous();
         new_buf = static_cast<decltype(new_buf)>(ngx_calloc_buf(pool));
         if (!new_buf) {
           return NGX_ERROR;
@@ -1065,6 +1292,11 @@ ngx_int_t Context::buffer_chain(FilterCtx &filter_ctx, RequestPool pool,
       new_ch->buf = new_buf;
     } else {  // do not consume
       size = ngx_buf_size(buf);
+      if (buf->in_file) {
+        filter_ctx.stop_contiguous();
+      } else if (size > 0) {
+        filter_ctx.append_contiguous(pool, buf->pos, size);
+      }
       new_ch->buf = buf;
     }
     new_ch->next = nullptr;
@@ -1283,6 +1515,109 @@ void Context::FilterCtx::clear(RequestPool pool) noexcept {
   out_total = 0;
   copied_total = 0;
   // found_last retained
+  // the contiguous data may still be referenced by the WAF context
+  contiguous = nullptr;
+  contiguous_cap = 0;
+  contiguous_len = 0;
+  contiguous_max = 0;
+}
+
+bool Context::FilterCtx::grow_contiguous(RequestPool pool,
+                                         std::size_t needed) noexcept {
+  if (needed > contiguous_max) {
+    return false;
+  }
+
+  // double, starting from the size of the first chunk
+  std::size_t new_cap =
+      std::max(needed, std::min(contiguous_max, 2 * contiguous_cap));
+  auto *area = static_cast<u_char *>(ngx_palloc(pool, new_cap));
+  if (!area) {
+    return false;
+  }
+
+  u_char *old = contiguous;
+  if (old) {
+    ngx_memcpy(area, old, contiguous_len);
+    // the consumed buffers reference slices of the old area
+    for (ngx_chain_t *cl = out; cl; cl = cl->next) {
+      ngx_buf_t *buf = cl->buf;
+      if (buf->in_file || buf->start < old ||
+          buf->start >= old + contiguous_len) {
+        continue;
+      }
+      buf->start = area + (buf->start - old);
+      buf->pos = area + (buf->pos - old);
+      buf->last = area + (buf->last - old);
+      buf->end = area + (buf->end - old);
+    }
+    ngx_pfree(pool, old);
+  }
+
+  contiguous = area;
+  contiguous_cap = new_cap;
+  return true;
+}
+
+u_char *Context::FilterCtx::append_contiguous(RequestPool pool,
+                                              const u_char *data,
+                                              std::size_t size) noexcept {
+  if (contiguous_cap - contiguous_len < size &&
+      !grow_contiguous(pool, contiguous_len + size)) {
+    stop_contiguous();
+    return nullptr;
+  }
+
+  u_char *dest = contiguous + contiguous_len;
+  ngx_memcpy(dest, data, size);
+  contiguous_len += size;
+  return dest;
+}
+
+void Context::reserve_contiguous_req_body(
+    ngx_http_request_t &request) noexcept {
+  auto *clcf = static_cast<ngx_http_core_loc_conf_t *>(
+      ngx_http_get_module_loc_conf(&request, ngx_http_core_module));
+
+  // the WAF runs on all that was collected once kMaxFilterData is reached,
+  // which includes the whole chunk that reached it
+  std::size_t max = kMaxFilterData + clcf->client_body_buffer_size;
+  filter_ctx_.contiguous = nullptr;
+  filter_ctx_.contiguous_cap = 0;
+  filter_ctx_.contiguous_len = 0;
+
+  if (request.headers_in.content_length_n < 0) {
+    // chunked or HTTP/2 without Content-Length: grow as data arrives
+    filter_ctx_.contiguous_max = max;
+    return;
+  }
+
+  max = std::min(max,
+                 static_cast<std::size_t>(request.headers_in.content_length_n));
+  filter_ctx_.contiguous_max = max;
+  if (max > 0) {
+    // the size is known; don't let it grow
+    filter_ctx_.grow_contiguous(RequestPool{request}, max);
+  }
+}
+
+void Context::feed_req_body_parser(const ngx_http_request_t &request) {
+  if (!req_body_parser_) {
+    return;
+  }
+
+  if (!filter_ctx_.contiguous ||
+      filter_ctx_.contiguous_len != filter_ctx_.out_total) {
+    // not all the data is in the contiguous area; it will be parsed at once
+    req_body_parser_.reset();
+    return;
+  }
+
+  // the area may still move as it grows, so the parser keeps offsets only.
+  // The first WAF run is over, so memres_ is not in use by the WAF thread
+  std::string_view body{reinterpret_cast<char *>(filter_ctx_.contiguous),
+                        filter_ctx_.contiguous_len};
+  req_body_parser_->feed(request, body, memres_);
 }
 
 void Context::FilterCtx::replace_out(ngx_chain_t *new_out) noexcept {
@@ -1459,6 +1794,24 @@ ngx_int_t Context::do_header_filter(ngx_http_request_t &request,
     return ngx_http_next_header_filter(&request);
   }
 
+  // Decide on API security sampling before anything is buffered: response
+  // data is only needed if a schema is to be extracted or if some rule
+  // inspects it
+  extract_schema_ =
+      Library::api_security_should_sample(api_security_endpoint_hash(request));
+  if (!extract_schema_ && !waf_handle_->rules_use_response_addresses()) {
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
+                  "waf header filter: no rule uses response data and no "
+                  "schema to extract; skipping the final WAF run");
+    Stats::waf_end_skipped();
+    transition_to_stage(stage::AFTER_RUN_WAF_END);
+    return ngx_http_next_header_filter(&request);
+  }
+
+  if (stream_response_) {
+    return do_stream_header_filter(request, span);
+  }
+
   ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
                 "waf header filter: replacing send_chain handler "
                 "and invoking the next header filter");
@@ -1491,7 +1844,10 @@ ngx_int_t Context::do_header_filter(ngx_http_request_t &request,
   // If no body (or we're ignoring it), start the WAF
   // Afterwards, we transition to PENDING_WAF_END (or AFTER_RUN_WAF_END if we
   // were unable to submit the WAF task)
-  waf_send_resp_body_ = waf_send_resp_body_ && is_body_resp_parseable(request);
+  waf_send_resp_body_ =
+      waf_send_resp_body_ &&
+      (extract_schema_ || waf_handle_->rules_use_address(kRespBodyAddress)) &&
+      is_body_resp_parseable(request);
   if (!waf_send_resp_body_) {
     ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
                   "waf header filter: downstream filters returned NGX_OK; "
@@ -1538,6 +1894,10 @@ ngx_int_t Context::do_output_body_filter(ngx_http_request_t &request,
       chain::length(in), chain::size(in), chain::has_last(in),
       chain::has_special(in));
 
+  if (stream_response_) {
+    return do_stream_output_body_filter(request, in, span);
+  }
+
   if (header_only_ && !request.header_only) {
     ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
                   "waf output body filter: restoring to 1 the value of "
@@ -1679,15 +2039,128 @@ ngx_int_t Context::do_output_body_filter(ngx_http_request_t &request,
   }
 }
 
+ngx_int_t Context::do_stream_header_filter(ngx_http_request_t &request,
+                                           dd::Span &span) {
+  // decide before the downstream filters get to modify the headers
+  waf_send_resp_body_ =
+      waf_send_resp_body_ && !request.header_only &&
+      (extract_schema_ || waf_handle_->rules_use_address(kRespBodyAddress)) &&
+      is_body_resp_parseable(request);
+
+  ngx_int_t rc = ngx_http_next_header_filter(&request);
+  if (rc == NGX_ERROR || rc > NGX_OK) {
+    ngx_log_error(NGX_LOG_ERR, request.connection->log, 0,
+                  "waf header filter: downstream filters returned %i", rc);
+    transition_to_stage(stage::AFTER_RUN_WAF_END);
+    return rc;
+  }
+
+  if (waf_send_resp_body_) {
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
+                  "waf header filter: header sent; copying the start of the "
+                  "response body for the final WAF run");
+    transition_to_stage(stage::COLLECTING_ON_RESP_DATA);
+  } else {
+    submit_streamed_waf_end(request, span);
+  }
+
+  return rc;
+}
+
+ngx_int_t Context::do_stream_output_body_filter(ngx_http_request_t &request,
+                                                ngx_chain_t *const in,
+                                                dd::Span &span) {
+  auto st = stage_->load(std::memory_order_acquire);
+  if (st == stage::COLLECTING_ON_RESP_DATA &&
+      copy_streamed_resp_data(request, in)) {
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
+                  "waf output body filter: copied %uz bytes of response data; "
+                  "submitting final WAF run",
+                  out_filter_ctx_.out_total);
+    submit_streamed_waf_end(request, span);
+  }
+
+  return ngx_http_next_output_body_filter(&request, in);
+}
+
+bool Context::copy_streamed_resp_data(ngx_http_request_t &request,
+                                      ngx_chain_t const *in) {
+  if (!out_filter_ctx_.out) {
+    ngx_buf_t *buf = ngx_create_temp_buf(request.pool, kMaxFilterData);
+    ngx_chain_t *cl = ngx_alloc_chain_link(request.pool);
+    if (!buf || !cl) {
+      ngx_log_error(NGX_LOG_ERR, request.connection->log, 0,
+                    "failed to allocate buffer for response data; running "
+                    "the final WAF without the response body");
+      waf_send_resp_body_ = false;
+      return true;
+    }
+    buf->tag = reinterpret_cast<void *>(kBufferTag);
+    cl->buf = buf;
+    cl->next = nullptr;
+    out_filter_ctx_.out = cl;
+  }
+
+  ngx_buf_t &copy = *out_filter_ctx_.out->buf;
+  for (auto *cl = in; cl; cl = cl->next) {
+    ngx_buf_t const &buf = *cl->buf;
+    if (!ngx_buf_in_memory(&buf) && ngx_buf_size(&buf) > 0) {
+      // reading file buffers here would block the event loop; analyze what
+      // we have so far
+      return true;
+    }
+
+    if (ngx_buf_in_memory(&buf)) {
+      auto const len = std::min(static_cast<std::size_t>(buf.last - buf.pos),
+                                static_cast<std::size_t>(copy.end - copy.last));
+      copy.last = ngx_cpymem(copy.last, buf.pos, len);
+      out_filter_ctx_.out_total += len;
+    }
+
+    if (buf.last_buf || copy.last == copy.end) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void Context::submit_streamed_waf_end(ngx_http_request_t &request,
+                                      dd::Span &span) {
+  if (waf_send_resp_body_ && out_filter_ctx_.out_total == 0) {
+    waf_send_resp_body_ = false;
+  }
+
+  auto *conf = static_cast<datadog_loc_conf_t *>(
+      ngx_http_get_module_loc_conf(&request, ngx_http_datadog_module));
+  auto &task_ctx = PolStreamedFinalWafCtx::create(request, *this, span);
+  transition_to_stage(stage::PENDING_WAF_END);
+  if (!std::move(task_ctx).submit(conf->waf_pool)) {
+    ngx_log_error(NGX_LOG_NOTICE, request.connection->log, 0,
+                  "failed to post streamed waf end task");
+    transition_to_stage(stage::AFTER_RUN_WAF_END);
+  }
+}
+
 std::optional<BlockSpecification> Context::run_waf_req_post(
     ngx_http_request_t &request, dd::Span &span) {
   ddwaf_obj input;
   ddwaf_map_obj &input_map = input.make_map(1, memres_);
   ddwaf_obj &entry = input_map.at_unchecked(0);
-  entry.set_key("server.request.body"sv);
-
-  bool success = parse_body_req(entry, request, *filter_ctx_.out,
-                                filter_ctx_.out_total, memres_);
+  entry.set_key(kReqBodyAddress);
+
+  bool success;
+  if (filter_ctx_.contiguous &&
+      filter_ctx_.contiguous_len == filter_ctx_.out_total) {
+    std::string_view body{reinterpret_cast<char *>(filter_ctx_.contiguous),
+                          filter_ctx_.contiguous_len};
+    success = req_body_parser_
+                  ? req_body_parser_->finish(entry, request, body, memres_)
+                  : parse_body_req(entry, request, body, memres_);
+  } else {
+    success = parse_body_req(entry, request, *filter_ctx_.out,
+                             filter_ctx_.out_total, memres_);
+  }
 
   if (!success) {
     ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
@@ -1697,6 +2170,9 @@ std::optional<BlockSpecification> Context::run_waf_req_post(
 
   auto &&log = *request.connection->log;
   auto [_, block_spec] = waf_ctx_->run(log, input);
+  if (block_spec) {
+    waf_ctx_->prepare_report();
+  }
   return block_spec;
 }
 
@@ -1742,12 +2218,13 @@ std::optional<BlockSpecification> Context::run_waf_end(
     body_size = 0;
   }
 
-  bool extract_schema = Library::api_security_should_sample();
-  ddwaf_object *resp_data = collect_response_data(
-      request, body_chain, body_size, extract_schema, memres_);
+  ddwaf_object *resp_data =
+      collect_response_data(request, body_chain, body_size,
+                            extract_schema_, *waf_handle_, memres_);
 
   auto &&log = *request.connection->log;
   auto [_, block_spec] = waf_ctx_->run(log, *resp_data);
+  waf_ctx_->prepare_report();
 
   return block_spec;
 }
@@ -11,6 +11,7 @@
 
 #include "../dd.h"
 #include "blocking.h"
+#include "body_parse/body_parsing.h"
 #include "ddwaf_req.h"
 #include "library.h"
 #include "util.h"
@@ -58,7 +59,7 @@ class Context {
 
   // returns a new context or an empty unique_ptr if the waf is not active
   static std::unique_ptr<Context> maybe_create(
-      std::optional<std::size_t> max_saved_output_data,
+      std::optional<std::size_t> max_saved_output_data, bool stream_response,
       bool apm_tracing_enabled);
 
   ngx_int_t request_body_filter(ngx_http_request_t &request, ngx_chain_t *chain,
@@ -74,7 +75,8 @@ class Context {
   void on_main_log_request(ngx_http_request_t &request,
                            dd::Span &span) noexcept;
 
-  // runs on a separate thread; returns whether it blocked
+  // runs on a separate thread (or on the event loop for small requests, see
+  // run_waf_start_inline); returns whether it blocked
   std::optional<BlockSpecification> run_waf_start(ngx_http_request_t &request,
                                                   dd::Span &span);
 
@@ -92,11 +94,22 @@ class Context {
 
  private:
   bool do_on_request_start(ngx_http_request_t &request, dd::Span &span);
+  // returns whether the request was finalized with a blocking response
+  bool run_waf_start_inline(ngx_http_request_t &request, dd::Span &span);
   ngx_int_t do_request_body_filter(ngx_http_request_t &request,
                                    ngx_chain_t *chain, dd::Span &span);
   ngx_int_t do_header_filter(ngx_http_request_t &request, dd::Span &span);
   ngx_int_t do_output_body_filter(ngx_http_request_t &request,
                                   ngx_chain_t *chain, dd::Span &span);
+  // variants used with datadog_appsec_stream_response
+  ngx_int_t do_stream_header_filter(ngx_http_request_t &request,
+                                    dd::Span &span);
+  ngx_int_t do_stream_output_body_filter(ngx_http_request_t &request,
+                                         ngx_chain_t *chain, dd::Span &span);
+  // returns whether no more response data should be copied
+  bool copy_streamed_resp_data(ngx_http_request_t &request,
+                               ngx_chain_t const *in);
+  void submit_streamed_waf_end(ngx_http_request_t &request, dd::Span &span);
   void do_on_main_log_request(ngx_http_request_t &request, dd::Span &span);
 
   void report_matches(ngx_http_request_t &request, dd::Span &span);
@@ -149,6 +162,8 @@ class Context {
 
     Response Processing (from AFTER_BEGIN_WAF or AFTER_ON_REQ_WAF):
     (header filter)
+            │
+            ├─(no response addresses, schema not sampled)─► AFTER_RUN_WAF_END
             │                       ┌─────────────────────────┐
             ├─(needs resp body)───► │ COLLECTING_ON_RESP_DATA │
             │                       └─────────┬───────────────┘
@@ -166,6 +181,11 @@ class Context {
                 └───────────────────┘                 └──────────┬───────────┘
                          ▲                                       │
                          └── ( block response sent)──────────────┘
+
+    With datadog_appsec_stream_response, the same stages are used, but the
+    response is not held back in COLLECTING_ON_RESP_DATA (only a copy of its
+    start is taken) nor in PENDING_WAF_END, and the final WAF run goes
+    directly to AFTER_RUN_WAF_END, resetting the connection if it blocked.
   */
   // clang-format on
   enum class stage {
@@ -179,7 +199,8 @@ class Context {
     START,
 
     /* Set on on_request_start (NGX_HTTP_ACCESS_PHASE) in normal conditions.
-     * The request may be suspended for 1st WAF run after entering this stage.
+     * The request may be suspended for 1st WAF run after entering this stage,
+     * unless the run is cheap enough to be done inline on the event loop.
      * If submission fails, the stage will remain at this value (will not
      * transition to AFTER_BEGIN_WAF/AFTER_BEGIN_WAF_BLOCK).
      * Incoming transitions: START → ENTERED_ON_START. */
@@ -251,8 +272,11 @@ class Context {
      * to block.
      * Incoming transitions: PENDING_WAF_END → AFTER_RUN_WAF_END
      *                       WAF_END_BLOCK_COMMIT → AFTER_RUN_WAF_END
-     *                       AFTER_BEGIN_WAF → AFTER_RUN_WAF_END (rare)
-     *                       AFTER_ON_REQ_WAF → AFTER_RUN_WAF_END (rare) */
+     *                       AFTER_BEGIN_WAF → AFTER_RUN_WAF_END
+     *                       AFTER_ON_REQ_WAF → AFTER_RUN_WAF_END
+     * The last two happen on header filter errors or when the final WAF run
+     * is skipped (no rule uses response data and no schema is to be
+     * extracted) */
     AFTER_RUN_WAF_END,
 
     // possible final states:
@@ -328,6 +352,7 @@ class Context {
     return stage_->compare_exchange_strong(from, to, std::memory_order_acq_rel);
   }
 
+  std::shared_ptr<OwnedDdwafHandle> waf_handle_;
   std::unique_ptr<DdwafContext> waf_ctx_;
   DdwafMemres memres_;
   std::optional<std::string> client_ip_;
@@ -337,6 +362,10 @@ class Context {
   static inline constexpr std::size_t kDefaultMaxSavedOutputData = 256 * 1024;
 
   bool waf_send_resp_body_{true};
+  // see datadog_appsec_stream_response
+  bool stream_response_{false};
+  // API security sampling decision, taken in the header filter
+  bool extract_schema_{false};
   std::size_t max_saved_output_data_{kDefaultMaxSavedOutputData};
 
   bool apm_tracing_enabled_;
@@ -347,17 +376,38 @@ class Context {
     std::size_t out_total;
     std::size_t copied_total;
     bool found_last;
+    // Optional. If contiguous_max is set, consumed in-memory data is copied
+    // here instead of into separate buffers, so that the start of the body is
+    // available contiguously as soon as the last chunk arrives; contiguous_len
+    // is how much of it is. The area grows as data arrives, up to
+    // contiguous_max. Once some data doesn't fit, nothing more is appended.
+    u_char *contiguous;
+    std::size_t contiguous_cap;
+    std::size_t contiguous_len;
+    std::size_t contiguous_max;
 
     void clear(RequestPool pool) noexcept;
+    // makes room for at least `needed` bytes, moving the collected data
+    bool grow_contiguous(RequestPool pool, std::size_t needed) noexcept;
+    // returns where the data was copied, or nullptr if it didn't fit
+    u_char *append_contiguous(RequestPool pool, const u_char *data,
+                              std::size_t size) noexcept;
+    void stop_contiguous() noexcept {
+      contiguous_max = contiguous_cap = contiguous_len;
+    }
     void replace_out(ngx_chain_t *new_out) noexcept;
   };
   FilterCtx filter_ctx_{};         // for request body
   FilterCtx header_filter_ctx_{};  // for the header data
   FilterCtx out_filter_ctx_{};     // for response body
   bool header_only_{false};        // HEAD requests
+  // parses the contiguous request body as it arrives, for some content types
+  std::optional<IncrementalBodyParser> req_body_parser_;
 
   static ngx_int_t buffer_chain(FilterCtx &filter_ctx, RequestPool pool,
                                 ngx_chain_t const *in, bool consume) noexcept;
+  void reserve_contiguous_req_body(ngx_http_request_t &request) noexcept;
+  void feed_req_body_parser(const ngx_http_request_t &request);
 
   ngx_http_event_handler_pt prev_req_write_evt_handler_;
   static void drain_buffered_data_write_handler(ngx_http_request_t *r) noexcept;
@@ -16,6 +16,12 @@
 
 namespace datadog::nginx::security {
 
+// Limits the WAF is configured with. Data past them is not looked at, so
+// parsers can skip producing it
+inline constexpr std::size_t kWafMaxContainerSize = 256;
+inline constexpr std::size_t kWafMaxContainerDepth = 20;
+inline constexpr std::size_t kWafMaxStringLength = 4096;
+
 struct __attribute__((__may_alias__)) ddwaf_str_obj;
 struct __attribute__((__may_alias__)) ddwaf_arr_obj;
 struct __attribute__((__may_alias__)) ddwaf_map_obj;
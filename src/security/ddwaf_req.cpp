@@ -285,7 +285,8 @@ bool handle_schema(ngx_log_t &log, const ddwaf_obj &obj, Func &&f) {
     }
 
     // then we need to base-64 encode it
-    b64 = cppcodec::base64_rfc4648::encode(*compressed);
+    b64 = cppcodec::base64_rfc4648::encode(compressed->data(),
+                                           compressed->size());
     if (b64.size() > kMaxSchemaSize) {
       ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
                     "ddwaf_req: base-64 encoded attribute %V is too large",
@@ -414,8 +415,33 @@ bool DdwafContext::report_matches(
     return false;
   }
 
+  std::string rendered;
+  const std::string *report = &prepared_report_;
+  if (prepared_num_results_ != results_.size()) {
+    render_matches(rendered);
+    report = &rendered;
+  }
+  if (report->empty()) {
+    return false;
+  }
+
+  f(*report);
+
+  results_.clear();
+  prepared_report_.clear();
+  prepared_num_results_.reset();
+  return true;
+}
+
+void DdwafContext::prepare_report() {
+  prepared_report_.clear();
+  render_matches(prepared_report_);
+  prepared_num_results_ = results_.size();
+}
+
+void DdwafContext::render_matches(std::string &out) const {
   std::vector<ddwaf_arr_obj> events_arrs;
-  for (LibddwafOwnedMap &result : results_) {
+  for (const LibddwafOwnedMap &result : results_) {
     std::optional<ddwaf_arr_obj> maybe_events =
         result.get_opt<ddwaf_arr_obj>("events");
     if (!maybe_events) {
@@ -428,7 +454,7 @@ bool DdwafContext::report_matches(
   }
 
   if (events_arrs.empty()) {
-    return false;
+    return;
   }
 
   rapidjson::StringBuffer buffer;
@@ -447,11 +473,7 @@ bool DdwafContext::report_matches(
   w.EndObject(1);
   w.Flush();
 
-  std::string_view const json{buffer.GetString(), buffer.GetLength()};
-  f(json);
-
-  results_.clear();
-  return true;
+  out.assign(buffer.GetString(), buffer.GetLength());
 }
 
 }  // namespace datadog::nginx::security
@@ -3,6 +3,8 @@
 #include <ddwaf.h>
 
 #include <functional>
+#include <optional>
+#include <string>
 #include <vector>
 
 #include "blocking.h"
@@ -43,6 +45,11 @@ class DdwafContext {
   // _dd.appsec.json and returns true. O/wise returns false.
   bool report_matches(const std::function<void(std::string_view)>& f);
 
+  // Renders the contents for _dd.appsec.json ahead of report_matches(), which
+  // then only has to hand them over unless there were more WAF runs since.
+  // To be called after the last WAF run, on the thread that ran it
+  void prepare_report();
+
  private:
   struct DdwafContextFreeFunctor {
     void operator()(ddwaf_context ctx) { ddwaf_context_destroy(ctx); }
@@ -66,5 +73,12 @@ class DdwafContext {
   // string_views are backed by the results_ vector
   std::unordered_map<std::string_view, std::string> collected_tags_;
   std::unordered_map<std::string_view, double> collected_metrics_;
+  // set by prepare_report(): the rendered report and the size of results_
+  // at the time
+  std::string prepared_report_;
+  std::optional<std::size_t> prepared_num_results_;
+
+  // leaves out empty if there are no events
+  void render_matches(std::string& out) const;
 };
 }  // namespace datadog::nginx::security
@@ -1,70 +1,118 @@
 #include "decode.h"
 
-#include <charconv>
+#include <cctype>
 #include <cstring>
-#include <iterator>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace {
 
-inline unsigned char decode_plus(unsigned char c) {
-  if (c == '+') {
+int hex_value(unsigned char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+template <bool DecodePlus>
+char maybe_decode_plus(char c) {
+  if (DecodePlus && c == '+') {
     return ' ';
   }
   return c;
 }
 
+// Writes the decoded sv into out, which must have at least sv.size() bytes.
+// Invalid percent escapes are copied verbatim. Returns the decoded size
 template <bool DecodePlus>
-std::string decode_percent(std::string_view sv) {
-  // allocate the same size; this may be an overstimation
-  std::string result;
-  result.reserve(sv.size());
-  std::unique_ptr<unsigned char[]> buf{new unsigned char[sv.size()]};
-  enum class state { NORMAL, PERCENT, PERCENT1 } state = state::NORMAL;
-  const unsigned char *r = reinterpret_cast<const unsigned char *>(sv.data());
-  const unsigned char *end = r + sv.size();
-  auto w = std::back_inserter(result);
-  for (; r < end; r++) {
-    switch (state) {
-      case state::NORMAL:
-        if (*r == '%') {
-          state = state::PERCENT;
-        } else {
-          w = DecodePlus ? decode_plus(*r) : *r;
-        }
-        break;
-      case state::PERCENT:
-        if (std::isxdigit(*r)) {
-          state = state::PERCENT1;
-        } else {
-          w = '%';
-          w = decode_plus(*r);
-          state = state::NORMAL;
-        }
-        break;
-      case state::PERCENT1:
-        if (std::isxdigit(*r)) {
-          unsigned result{};
-          // can't fail
-          std::from_chars(reinterpret_cast<const char *>(r - 1),
-                          reinterpret_cast<const char *>(r + 1), result, 16);
-          w = static_cast<unsigned char>(result);
-        } else {
-          w = '%';
-          w = *(r - 1);
-          w = DecodePlus ? decode_plus(*r) : *r;
-        }
-        state = state::NORMAL;
+std::size_t decode_percent(std::string_view sv, char *out) {
+  const char *r = sv.data();
+  const char *end = r + sv.size();
+  char *w = out;
+  while (r < end) {
+    if constexpr (!DecodePlus) {
+      // copy everything up to the next escape at once
+      const auto *run_end =
+          static_cast<const char *>(std::memchr(r, '%', end - r));
+      if (!run_end) {
+        run_end = end;
+      }
+      std::memcpy(w, r, run_end - r);
+      w += run_end - r;
+      r = run_end;
+      if (r == end) {
         break;
+      }
+    }
+
+    char c = *r++;
+    if (c != '%') {
+      *w++ = maybe_decode_plus<DecodePlus>(c);
+      continue;
+    }
+
+    int hi = r < end ? hex_value(*r) : -1;
+    int lo = hi != -1 && r + 1 < end ? hex_value(r[1]) : -1;
+    if (lo != -1) {
+      *w++ = static_cast<char>((hi << 4) | lo);
+      r += 2;
+      continue;
+    }
+
+    // not a valid escape: keep the % and the (at most 2) chars after it, which
+    // are not taken as the start of another escape
+    *w++ = '%';
+    if (hi != -1) {
+      *w++ = *r++;
+    }
+    if (r < end) {
+      *w++ = maybe_decode_plus<DecodePlus>(*r++);
     }
   }
-  if (state == state::PERCENT) {
-    w = '%';
-  } else if (state == state::PERCENT1) {
-    w = '%';
-    w = *(sv.data() + sv.size() - 1);
+
+  return static_cast<std::size_t>(w - out);
+}
+
+// Calls f(pos) for every position of s with the separator, '=', '%' or '+', in
+// increasing order
+template <typename F>
+void for_each_special(std::string_view s, unsigned char separator, F &&f) {
+  const char *data = s.data();
+  std::size_t size = s.size();
+  std::size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128i sep_v = _mm_set1_epi8(static_cast<char>(separator));
+  const __m128i eq_v = _mm_set1_epi8('=');
+  const __m128i perc_v = _mm_set1_epi8('%');
+  const __m128i plus_v = _mm_set1_epi8('+');
+  for (; i + 16 <= size; i += 16) {
+    __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    __m128i matches = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, sep_v), _mm_cmpeq_epi8(chunk, eq_v)),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, perc_v),
+                     _mm_cmpeq_epi8(chunk, plus_v)));
+    auto mask = static_cast<unsigned>(_mm_movemask_epi8(matches));
+    while (mask != 0) {
+      f(i + static_cast<std::size_t>(__builtin_ctz(mask)));
+      mask &= mask - 1;
+    }
   }
+#endif
 
-  return result;
+  for (; i < size; i++) {
+    auto c = static_cast<unsigned char>(data[i]);
+    if (c == separator || c == '=' || c == '%' || c == '+') {
+      f(i);
+    }
+  }
 }
 
 }  // namespace
@@ -72,57 +120,78 @@ std::string decode_percent(std::string_view sv) {
 namespace datadog::nginx::security {
 
 std::string decode_urlencoded(std::string_view sv) {
-  return decode_percent<false>(sv);
+  std::string result(sv.size(), '\0');
+  result.resize(decode_percent<false>(sv, result.data()));
+  return result;
 }
 
-std::pair<std::string_view, std::string_view> QueryStringIter::operator*() {
-  std::string_view kv{rest()};
-
-  auto sep_pos = kv.find(separator);
-  if (sep_pos != std::string_view::npos) {
-    kv = kv.substr(0, sep_pos);
-  }
+QueryStringIter::QueryStringIter(std::string_view qs, DdwafMemres &memres,
+                                 unsigned char separator, trim_mode trim)
+    : memres_{memres}, trim_{trim} {
+  std::size_t start = 0;
+  std::size_t eq_pos = std::string_view::npos;
+  bool decode_key = false;
+  bool decode_value = false;
+
+  auto finish_param = [&](std::size_t end) {
+    if (eq_pos == std::string_view::npos) {
+      add_param(qs.substr(start, end - start), decode_key, ""sv, false);
+    } else {
+      add_param(qs.substr(start, eq_pos - start), decode_key,
+                qs.substr(eq_pos + 1, end - eq_pos - 1), decode_value);
+    }
+  };
+
+  for_each_special(qs, separator, [&](std::size_t pos) {
+    char c = qs[pos];
+    if (c == static_cast<char>(separator)) {
+      finish_param(pos);
+      start = pos + 1;
+      eq_pos = std::string_view::npos;
+      decode_key = decode_value = false;
+    } else if (c == '=') {
+      if (eq_pos == std::string_view::npos) {
+        eq_pos = pos;
+      }
+    } else if (eq_pos == std::string_view::npos) {  // % or +
+      decode_key = true;
+    } else {
+      decode_value = true;
+    }
+  });
 
-  auto eq_pos = kv.find('=');
-  if (eq_pos == std::string_view::npos) {
-    // no =
-    return {decode(kv), ""sv};
-  }
-  if (eq_pos == kv.size() - 1) {
-    // foo=, with nothing after
-    return {decode(kv.substr(0, eq_pos)), ""sv};
+  // no empty pair after a trailing separator
+  if (start < qs.size()) {
+    finish_param(qs.size());
   }
+}
 
-  return {decode(kv.substr(0, eq_pos)),
-          decode(kv.substr(eq_pos + 1, kv.size() - eq_pos - 1))};
+void QueryStringIter::add_param(std::string_view key, bool decode_key,
+                                std::string_view value, bool decode_value) {
+  params_.emplace_back(decode(key, decode_key), decode(value, decode_value));
 }
 
-std::string_view QueryStringIter::decode_no_trim(std::string_view sv) {
-  if (sv.empty()) {
-    return ""sv;
+std::string_view QueryStringIter::decode(std::string_view sv,
+                                         bool needs_decoding) {
+  std::string_view result = sv;
+  if (needs_decoding) {
+    char *p = memres_.allocate_string(sv.size() + 1);
+    std::size_t len = decode_percent<true>(sv, p);
+    p[len] = '\0';
+    result = std::string_view{p, len};
   }
 
-  auto perc_or_plus = sv.find_first_of("%+");
-  if (perc_or_plus == std::string_view::npos) {
-    return sv;
+  if (trim_ == trim_mode::do_trim) {
+    while (!result.empty() &&
+           std::isspace(static_cast<unsigned char>(result.front()))) {
+      result.remove_prefix(1);
+    }
+    while (!result.empty() &&
+           std::isspace(static_cast<unsigned char>(result.back()))) {
+      result.remove_suffix(1);
+    }
   }
-
-  std::string result{decode_percent<true>(sv)};
-  return intern_string(result);
+  return result;
 }
 
-std::string_view QueryStringIter::intern_string(std::string_view sv) {
-  auto interned = interned_strings.find(sv);
-  if (interned != interned_strings.end()) {
-    return *interned;
-  }
-
-  auto *p = memres.allocate_string(sv.length() + 1);
-  std::memcpy(p, sv.data(), sv.length());
-  p[sv.length()] = '\0';
-
-  std::string_view interned_res{p, sv.length()};
-  interned_strings.insert(p);
-  return interned_res;
-}
 }  // namespace datadog::nginx::security
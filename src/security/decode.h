@@ -2,8 +2,10 @@
 
 #include <cstdlib>
 #include <memory>
+#include <string>
 #include <string_view>
-#include <unordered_set>
+#include <utility>
+#include <vector>
 
 extern "C" {
 #include <ngx_core.h>
@@ -18,88 +20,54 @@ using namespace std::literals;
 
 std::string decode_urlencoded(std::string_view sv);
 
-struct QueryStringIter {
-  enum class trim_mode { no_trim, do_trim } trim;
-  std::string_view qs;
-  std::size_t pos{0};
-  DdwafMemres &memres;
-  std::unordered_set<std::string_view> interned_strings;
-  unsigned char separator;
+// Splits a query string (or a urlencoded body, or a cookie header) into
+// key/value pairs, on construction. The string is scanned only once, several
+// bytes at a time where possible, for the separator, '=', '%' and '+'. Keys
+// and values needing no decoding reference qs; the others are decoded into
+// memres. Either way, they live as long as qs and memres.
+class QueryStringIter {
+ public:
+  enum class trim_mode { no_trim, do_trim };
 
   QueryStringIter(std::string_view qs, DdwafMemres &memres,
-                  unsigned char separator, trim_mode trim)
-      : trim{trim}, qs{qs}, memres{memres}, separator{separator} {}
+                  unsigned char separator, trim_mode trim);
 
   QueryStringIter(const ngx_str_t &qs, DdwafMemres &memres,
                   unsigned char separator, trim_mode trim)
       : QueryStringIter{datadog::nginx::to_string_view(qs), memres, separator,
                         trim} {}
 
-  void reset() noexcept { pos = 0; }
+  void reset() noexcept { pos_ = 0; }
 
   bool operator!=(const QueryStringIter &other) const noexcept {
-    return pos != other.pos;
+    return pos_ != other.pos_;
   }
 
-  bool ended() const noexcept { return pos == qs.length(); }
+  bool ended() const noexcept { return pos_ == params_.size(); }
 
   // this may return empty keys and/or values, e.g. ?a=&=v&
-  std::pair<std::string_view, std::string_view> operator*();
-
-  std::string_view cur_key() {
-    std::string_view kv{rest()};
-
-    auto sep_pos = kv.find(separator);
-    if (sep_pos != std::string_view::npos) {
-      kv = kv.substr(0, sep_pos);
-    }
-
-    auto eq_pos = kv.find('=');
-    if (eq_pos == std::string_view::npos) {
-      // no =
-      return decode(kv);
-    }
-
-    return decode(kv.substr(0, eq_pos));
+  std::pair<std::string_view, std::string_view> operator*() const {
+    return params_[pos_];
   }
 
+  std::string_view cur_key() const { return params_[pos_].first; }
+
   bool is_delete() const { return false; }
 
   QueryStringIter &operator++() {
-    auto sep_pos = rest().find(separator);
-    if (sep_pos == std::string_view::npos) {
-      pos = qs.length();
-    } else {
-      pos += sep_pos + 1;
-    }
+    pos_++;
     return *this;
   }
 
  private:
-  std::string_view rest() const noexcept { return qs.substr(pos); }
-
-  std::string_view decode(std::string_view sv) {
-    if (trim == trim_mode::do_trim) {
-      return decode_trim(sv);
-    } else {
-      return decode_no_trim(sv);
-    }
-  }
-
-  std::string_view decode_no_trim(std::string_view sv);
-
-  std::string_view decode_trim(std::string_view sv) {
-    auto result = decode_no_trim(sv);
-    while (!result.empty() && std::isspace(result.front())) {
-      result.remove_prefix(1);
-    }
-    while (!result.empty() && std::isspace(result.back())) {
-      result.remove_suffix(1);
-    }
-    return result;
-  }
-
-  std::string_view intern_string(std::string_view sv);
+  void add_param(std::string_view key, bool decode_key, std::string_view value,
+                 bool decode_value);
+  std::string_view decode(std::string_view sv, bool needs_decoding);
+
+  DdwafMemres &memres_;
+  trim_mode trim_;
+  std::vector<std::pair<std::string_view, std::string_view>> params_;
+  std::size_t pos_{0};
 };
 
 struct qs_iter_agg {
@@ -166,6 +166,51 @@ constexpr directive kAppsecDirectives[] = {
         offsetof(datadog_main_conf_t, api_security_proxy_sample_rate),
         nullptr,
     },
+
+    {
+        "datadog_api_security_sample_delay",
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_sec_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(datadog_main_conf_t, api_security_sample_delay),
+        nullptr,
+    },
+
+    {
+        "datadog_appsec_waf_inline_budget",
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(datadog_main_conf_t, appsec_waf_inline_budget_usec),
+        nullptr,
+    },
+
+    {
+        "datadog_appsec_waf_threads",
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(datadog_main_conf_t, appsec_waf_threads),
+        nullptr,
+    },
+
+    {
+        "datadog_appsec_waf_thread_affinity",
+        NGX_HTTP_MAIN_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(datadog_main_conf_t, appsec_waf_thread_affinity),
+        nullptr,
+    },
+
+    {
+        "datadog_appsec_stream_response",
+        NGX_HTTP_MAIN_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(datadog_main_conf_t, appsec_stream_response),
+        nullptr,
+    },
 };
 PRAGMA_POP_IGNORE_INVALID_OFFSETOF
 #endif  // WITH_WAF
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace datadog::nginx::security {
+
+// Remembers which endpoints (as hashes of method, path and status) had their
+// schema extracted recently, so that further requests to them within the
+// sampling delay can be excluded from API security sampling without touching
+// the shared rate limiter. Per worker process; not thread-safe.
+//
+// The table is direct-mapped: an endpoint can be evicted by another one
+// hashing to the same slot, which at worst results in an extra sample.
+template <std::size_t Slots = 4096,
+          typename Clock = std::chrono::steady_clock>
+class EndpointSampleCache {
+  static_assert(Slots > 0 && (Slots & (Slots - 1)) == 0,
+                "Slots must be a power of 2");
+
+ public:
+  explicit EndpointSampleCache(typename Clock::duration delay)
+      : delay_{delay} {}
+
+  bool sampled_recently(std::uint64_t endpoint_hash) const noexcept {
+    const Slot &slot = slots_[endpoint_hash & (Slots - 1)];
+    return slot.used && slot.endpoint_hash == endpoint_hash &&
+           Clock::now() - slot.sampled_at < delay_;
+  }
+
+  void record_sample(std::uint64_t endpoint_hash) noexcept {
+    Slot &slot = slots_[endpoint_hash & (Slots - 1)];
+    slot.endpoint_hash = endpoint_hash;
+    slot.sampled_at = Clock::now();
+    slot.used = true;
+  }
+
+ private:
+  struct Slot {
+    std::uint64_t endpoint_hash;
+    typename Clock::time_point sampled_at;
+    bool used;
+  };
+
+  typename Clock::duration delay_;
+  std::array<Slot, Slots> slots_{};
+};
+
+}  // namespace datadog::nginx::security
@@ -1,5 +1,6 @@
 #include "library.h"
 
+#include <algorithm>
 #include <atomic>
 #include <charconv>
 #include <string>
@@ -15,7 +16,9 @@ extern "C" {
 #include <rapidjson/schema.h>
 
 #include <fstream>
+#include <map>
 #include <optional>
+#include <set>
 #include <stdexcept>
 #include <string_view>
 #include <utility>
@@ -24,6 +27,7 @@ extern "C" {
 #include "ddwaf_obj.h"
 #include "stats.h"
 #include "util.h"
+#include "waf_executor.h"
 
 extern "C" {
 #define INCBIN_SILENCE_BITCODE_WARNING
@@ -42,9 +46,9 @@ namespace {
 static constexpr ddwaf_config kBaseWafConfig{
     .limits =
         {
-            .max_container_size = 256,
-            .max_container_depth = 20,
-            .max_string_length = 4096,
+            .max_container_size = dnsec::kWafMaxContainerSize,
+            .max_container_depth = dnsec::kWafMaxContainerDepth,
+            .max_string_length = dnsec::kWafMaxStringLength,
         },
     .free_fn = nullptr,
 };
@@ -275,6 +279,56 @@ class OwnedDdwafBuilder
   operator bool() const { return resource != nullptr; }
 };
 
+void collect_response_addresses(const dnsec::ddwaf_obj &obj,
+                                std::set<std::string, std::less<>> &out) {
+  if (obj.is_map()) {
+    for (auto &&entry : dnsec::ddwaf_map_obj{obj}) {
+      if (entry.key() == "address"sv && entry.is_string()) {
+        std::string_view address = entry.string_val_unchecked();
+        if (address.starts_with("server.response."sv)) {
+          out.emplace(address);
+        }
+      } else {
+        collect_response_addresses(entry, out);
+      }
+    }
+  } else if (obj.is_array()) {
+    for (auto &&entry : dnsec::ddwaf_arr_obj{obj}) {
+      collect_response_addresses(entry, out);
+    }
+  }
+}
+
+// The server.response.* addresses that can affect rule evaluation in a
+// configuration: the inputs of rules and of processors whose output is
+// evaluated. Processors like schema extraction don't count; they only need
+// response data when the request is sampled for API security.
+std::set<std::string, std::less<>> rule_response_addresses(
+    const dnsec::ddwaf_map_obj &config) {
+  std::set<std::string, std::less<>> result;
+  for (auto key : {"rules"sv, "custom_rules"sv}) {
+    if (auto rules = config.get_opt(key)) {
+      collect_response_addresses(*rules, result);
+    }
+  }
+
+  auto processors = config.get_opt("processors"sv);
+  if (processors && processors->is_array()) {
+    for (auto &&processor : dnsec::ddwaf_arr_obj{*processors}) {
+      if (!processor.is_map()) {
+        continue;
+      }
+      auto evaluate = dnsec::ddwaf_map_obj{processor}.get_opt("evaluate"sv);
+      if (evaluate && evaluate->is_bool() && !evaluate->boolean) {
+        continue;
+      }
+      collect_response_addresses(processor, result);
+    }
+  }
+
+  return result;
+}
+
 class UpdateableWafInstance {
  public:
   using Diagnostics = dnsec::Library::Diagnostics;
@@ -304,6 +358,9 @@ class UpdateableWafInstance {
   std::mutex builder_mut_;
   OwnedDdwafBuilder builder_;
   dnsec::ddwaf_owned_map default_ruleset_;
+  // see rule_response_addresses(); by config path
+  std::map<std::string, std::set<std::string, std::less<>>, std::less<>>
+      rule_response_addresses_;
 
   std::shared_ptr<dnsec::OwnedDdwafHandle> cur_handle_;
 };
@@ -336,13 +393,24 @@ class UpdateableWafInstance {
   if (has_bundled_data() && path.find("/ASM_DD/"sv) != std::string_view::npos) {
     // need to remove bundled_data first
     builder_.remove_config(dnsec::Library::kBundledRuleset);
+    rule_response_addresses_.erase(
+        std::string{dnsec::Library::kBundledRuleset});
   }
 
-  return builder_.add_or_update_config(path, ruleset, diagnostics);
+  if (!builder_.add_or_update_config(path, ruleset, diagnostics)) {
+    return false;
+  }
+  rule_response_addresses_.insert_or_assign(std::string{path},
+                                            rule_response_addresses(ruleset));
+  return true;
 }
 
 [[nodiscard]] bool UpdateableWafInstance::remove_config(std::string_view path) {
   std::lock_guard guard{builder_mut_};
+  if (auto it = rule_response_addresses_.find(path);
+      it != rule_response_addresses_.end()) {
+    rule_response_addresses_.erase(it);
+  }
   return builder_.remove_config(path);
 }
 
@@ -355,6 +423,9 @@ class UpdateableWafInstance {
                                        default_ruleset_.get(), diags)) {
       return false;
     }
+    rule_response_addresses_.insert_or_assign(
+        std::string{dnsec::Library::kBundledRuleset},
+        rule_response_addresses(default_ruleset_.get()));
   }
 
   ddwaf_handle new_instance = builder_.build_instance();
@@ -362,8 +433,16 @@ class UpdateableWafInstance {
     return false;
   }
 
+  std::set<std::string_view> all_rule_resp_addresses;
+  for (auto &&[path, addresses] : rule_response_addresses_) {
+    all_rule_resp_addresses.insert(addresses.begin(), addresses.end());
+  }
+
   std::shared_ptr<dnsec::OwnedDdwafHandle> new_sp =
-      std::make_shared<dnsec::OwnedDdwafHandle>(new_instance);
+      std::make_shared<dnsec::OwnedDdwafHandle>(
+          new_instance, std::vector<std::string>{
+                            all_rule_resp_addresses.begin(),
+                            all_rule_resp_addresses.end()});
   std::atomic_store_explicit(&cur_handle_, new_sp, std::memory_order::release);
 
   return true;
@@ -448,6 +527,18 @@ class FinalizedConfigSettings {
     return api_security_proxy_sample_rate_;
   }
 
+  ngx_uint_t api_security_sample_delay_sec() const {
+    return api_security_sample_delay_sec_;
+  }
+
+  ngx_uint_t waf_inline_budget_usec() const { return waf_inline_budget_usec_; }
+
+  ngx_uint_t waf_threads() const { return waf_threads_; }
+
+  bool waf_thread_affinity() const { return waf_thread_affinity_; }
+
+  bool stream_response() const { return stream_response_; }
+
  private:
   // NOLINTNEXTLINE(readability-identifier-naming)
   using ev_t = std::vector<environment_variable_t>;
@@ -491,6 +582,11 @@ class FinalizedConfigSettings {
   std::optional<std::pair<std::string, uint16_t>> stats_host_port_;
   bool api_security_enabled_;
   ngx_uint_t api_security_proxy_sample_rate_;
+  ngx_uint_t api_security_sample_delay_sec_;
+  ngx_uint_t waf_inline_budget_usec_;
+  ngx_uint_t waf_threads_;
+  bool waf_thread_affinity_;
+  bool stream_response_;
 };
 
 FinalizedConfigSettings::FinalizedConfigSettings(
@@ -620,6 +716,32 @@ FinalizedConfigSettings::FinalizedConfigSettings(
     api_security_proxy_sample_rate_ = ngx_conf.api_security_proxy_sample_rate;
   }
 
+  // DD_API_SECURITY_SAMPLE_DELAY (default: 0, no per-endpoint delay)
+  if (ngx_conf.api_security_sample_delay == NGX_CONF_UNSET) {
+    api_security_sample_delay_sec_ =
+        get_env_unsigned(evs, "DD_API_SECURITY_SAMPLE_DELAY"sv).value_or(0);
+  } else {
+    api_security_sample_delay_sec_ = ngx_conf.api_security_sample_delay;
+  }
+
+  if (ngx_conf.appsec_waf_inline_budget_usec == NGX_CONF_UNSET ||
+      ngx_conf.appsec_waf_inline_budget_usec < 0) {
+    waf_inline_budget_usec_ = 0;
+  } else {
+    waf_inline_budget_usec_ = ngx_conf.appsec_waf_inline_budget_usec;
+  }
+
+  if (ngx_conf.appsec_waf_threads == NGX_CONF_UNSET ||
+      ngx_conf.appsec_waf_threads < 0) {
+    waf_threads_ = 0;
+  } else {
+    waf_threads_ = ngx_conf.appsec_waf_threads;
+  }
+
+  waf_thread_affinity_ = ngx_conf.appsec_waf_thread_affinity == 1;
+
+  stream_response_ = ngx_conf.appsec_stream_response == 1;
+
   // Validation: warn if DD_API_SECURITY_ENABLED is true but
   // DD_API_SECURITY_PROXY_SAMPLE_RATE is 0
   if (api_security_enabled_ && api_security_proxy_sample_rate_ == 0) {
@@ -701,12 +823,46 @@ std::string FinalizedConfigSettings::normalize_configured_header(
   return result;
 }
 
+OwnedDdwafHandle::OwnedDdwafHandle(
+    ddwaf_handle handle, std::vector<std::string> rule_response_addresses)
+    : FreeableResource{handle},
+      rule_response_addresses_{std::move(rule_response_addresses)} {
+  if (handle == nullptr) {
+    return;
+  }
+
+  std::uint32_t size = 0;
+  const char *const *addresses = ddwaf_known_addresses(handle, &size);
+  if (addresses == nullptr) {
+    return;
+  }
+
+  known_addresses_.reserve(size);
+  for (std::uint32_t i = 0; i < size; i++) {
+    known_addresses_.emplace_back(addresses[i]);
+  }
+}
+
+bool OwnedDdwafHandle::is_known_address(
+    std::string_view address) const noexcept {
+  return std::find(known_addresses_.begin(), known_addresses_.end(),
+                   address) != known_addresses_.end();
+}
+
+bool OwnedDdwafHandle::rules_use_address(
+    std::string_view address) const noexcept {
+  return std::find(rule_response_addresses_.begin(),
+                   rule_response_addresses_.end(),
+                   address) != rule_response_addresses_.end();
+}
+
 std::unique_ptr<UpdateableWafInstance> upd_waf_instance{
     new UpdateableWafInstance{}};
 std::atomic<bool> Library::active_{true};
 std::unique_ptr<FinalizedConfigSettings> Library::config_settings_;
 ngx_shm_zone_t *Library::api_security_shm_zone_ = nullptr;
 std::unique_ptr<SharedApiSecurityLimiter> Library::shared_api_security_limiter_;
+std::unique_ptr<ApiSecurityEndpointCache> Library::api_security_endpoint_cache_;
 
 std::optional<ddwaf_owned_map> Library::initialize_security_library(
     const datadog_main_conf_t &ngx_conf) {
@@ -761,6 +917,13 @@ std::optional<ddwaf_owned_map> Library::initialize_security_library(
     Stats::start(stats_host_port->first, stats_host_port->second);
   }
 
+  if (conf.waf_threads() > 0 &&
+      !WafExecutor::start(conf.waf_threads(), conf.waf_thread_affinity())) {
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "failed to start the WAF threads; the WAF thread pool "
+                  "will be used instead");
+  }
+
   BlockingService::initialize(conf.blocked_template_html(),
                               conf.blocked_template_json());
 
@@ -789,8 +952,14 @@ std::optional<ddwaf_owned_map> Library::initialize_security_library(
                       "Failed to get shared limiter from shared memory zone");
       }
     }
+
+    if (conf.api_security_sample_delay_sec() > 0) {
+      api_security_endpoint_cache_ = std::make_unique<ApiSecurityEndpointCache>(
+          std::chrono::seconds{conf.api_security_sample_delay_sec()});
+    }
   } else {
     shared_api_security_limiter_.reset(nullptr);
+    api_security_endpoint_cache_.reset(nullptr);
   }
 
   Library::set_active(conf.enable_status() ==
@@ -865,7 +1034,11 @@ bool Library::active() noexcept {
   Diagnostics diags{{}};
   bool res = upd_waf_instance->update(diags);
   if (res) {
-    ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0, "WAF configuration updated");
+    ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                  "WAF configuration updated (response addresses used: %s)",
+                  upd_waf_instance->cur_handle()->rules_use_response_addresses()
+                      ? "yes"
+                      : "no");
   } else {
     std::string diag_str = ddwaf_diagnostics_to_str(*diags);
     ngx_str_t str = ngx_stringv(diag_str);
@@ -900,16 +1073,41 @@ std::vector<std::string_view> Library::environment_variable_names() {
           "DD_APPSEC_OBFUSCATION_PARAMETER_KEY_REGEXP"sv,
           "DD_APPSEC_OBFUSCATION_PARAMETER_VALUE_REGEXP"sv,
           "DD_API_SECURITY_ENABLED"sv,
-          "DD_API_SECURITY_PROXY_SAMPLE_RATE"sv};
+          "DD_API_SECURITY_PROXY_SAMPLE_RATE"sv,
+          "DD_API_SECURITY_SAMPLE_DELAY"sv};
 }
 
 std::optional<std::size_t> Library::max_saved_output_data() {
   return config_settings_->get_max_saved_output_data();
 };
 
-bool Library::api_security_should_sample() noexcept {
-  return shared_api_security_limiter_ ? shared_api_security_limiter_->allow()
-                                      : false;
+bool Library::stream_response() {
+  return config_settings_->stream_response();
+}
+
+std::uint64_t Library::waf_inline_budget_usec() {
+  return static_cast<std::uint64_t>(config_settings_->waf_inline_budget_usec());
+}
+
+bool Library::api_security_should_sample(std::uint64_t endpoint_hash) noexcept {
+  if (!shared_api_security_limiter_) {
+    return false;
+  }
+
+  // cheap, worker-local check first; avoids contention on the shared limiter
+  if (api_security_endpoint_cache_ &&
+      api_security_endpoint_cache_->sampled_recently(endpoint_hash)) {
+    return false;
+  }
+
+  if (!shared_api_security_limiter_->allow()) {
+    return false;
+  }
+
+  if (api_security_endpoint_cache_) {
+    api_security_endpoint_cache_->record_sample(endpoint_hash);
+  }
+  return true;
 }
 
 ngx_int_t Library::initialize_api_security_shared_memory(ngx_conf_t *cf) {
@@ -4,10 +4,13 @@
 
 #include <atomic>
 #include <memory>
+#include <string>
 #include <string_view>
+#include <vector>
 
 #include "../datadog_conf.h"
 #include "ddwaf_obj.h"
+#include "endpoint_sample_cache.h"
 #include "shared_limiter.h"
 
 namespace datadog::nginx::security {
@@ -16,6 +19,7 @@ inline constexpr std::uint32_t kShLimRefreshesPerMin = 50;
 
 using SharedApiSecurityLimiter = SharedLimiter<kShLimRefreshesPerMin>;
 using ApiSecurityLimiterZone = SharedLimiterZoneManager<kShLimRefreshesPerMin>;
+using ApiSecurityEndpointCache = EndpointSampleCache<>;
 
 inline constexpr auto kConfigMaxDepth = 25;
 
@@ -59,7 +63,15 @@ class Library {
 
   static std::optional<std::size_t> max_saved_output_data();
 
-  static bool api_security_should_sample() noexcept;
+  // whether the response is sent while the final WAF run is in progress
+  static bool stream_response();
+
+  // 0 if the initial WAF run should always be done on the thread pool
+  static std::uint64_t waf_inline_budget_usec();
+
+  // endpoint_hash identifies the method, route and status of the request.
+  // Must be called from the event loop
+  static bool api_security_should_sample(std::uint64_t endpoint_hash) noexcept;
 
   static void start_stats(std::string_view host, uint16_t port);
   static void stop_stats();
@@ -70,6 +82,8 @@ class Library {
   static ngx_shm_zone_t *api_security_shm_zone_;                     // NOLINT
   static std::unique_ptr<SharedApiSecurityLimiter>
       shared_api_security_limiter_;  // NOLINT
+  static std::unique_ptr<ApiSecurityEndpointCache>
+      api_security_endpoint_cache_;  // NOLINT
 };
 
 struct DdwafHandleFreeFunctor {
@@ -82,7 +96,27 @@ struct DdwafHandleFreeFunctor {
 class OwnedDdwafHandle
     : public FreeableResource<ddwaf_handle, DdwafHandleFreeFunctor> {
  public:
-  using FreeableResource::FreeableResource;
+  // Also queries the addresses consumed by the rules and processors of
+  // handle. rule_response_addresses are the server.response.* addresses that
+  // can affect rule evaluation; this excludes inputs of processors that only
+  // produce span attributes, like schema extraction
+  OwnedDdwafHandle(ddwaf_handle handle,
+                   std::vector<std::string> rule_response_addresses);
+
+  bool is_known_address(std::string_view address) const noexcept;
+
+  // If no rule needs response data, there is no point in collecting it
+  // unless a schema is to be extracted
+  bool rules_use_response_addresses() const noexcept {
+    return !rule_response_addresses_.empty();
+  }
+
+  bool rules_use_address(std::string_view address) const noexcept;
+
+ private:
+  // backed by memory owned by the ddwaf handle
+  std::vector<std::string_view> known_addresses_;
+  std::vector<std::string> rule_response_addresses_;
 };
 
 }  // namespace datadog::nginx::security
@@ -309,6 +309,9 @@ void Stats::reporting_loop(std::unique_ptr<MetricSender> sender) {
     const auto tasks_completed = tasks_completed_.load();
     const auto tasks_submission_failed = tasks_submission_failed_.load();
     const auto tasks_destructed = tasks_destructed_.load();
+    const auto waf_runs_inline = waf_runs_inline_.load();
+    const auto waf_runs_pooled = waf_runs_pooled_.load();
+    const auto waf_ends_skipped = waf_ends_skipped_.load();
 
     sender->send_metric("appsec.contexts_started", 'c', contexts_started);
     sender->send_metric("appsec.contexts_closed", 'c', contexts_closed);
@@ -318,6 +321,9 @@ void Stats::reporting_loop(std::unique_ptr<MetricSender> sender) {
     sender->send_metric("appsec.tasks_submission_failed", 'c',
                         tasks_submission_failed);
     sender->send_metric("appsec.tasks_destructed", 'c', tasks_destructed);
+    sender->send_metric("appsec.waf_runs_inline", 'c', waf_runs_inline);
+    sender->send_metric("appsec.waf_runs_pooled", 'c', waf_runs_pooled);
+    sender->send_metric("appsec.waf_ends_skipped", 'c', waf_ends_skipped);
 
     report_memory_stats(pid, [&sender](std::string_view metric_name,
                                        char metric_type, auto val) {
@@ -52,6 +52,18 @@ class Stats {
     instance().tasks_destructed_.fetch_add(1, std::memory_order_relaxed);
   }
 
+  static void waf_run_inline() noexcept {
+    instance().waf_runs_inline_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void waf_run_pooled() noexcept {
+    instance().waf_runs_pooled_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void waf_end_skipped() noexcept {
+    instance().waf_ends_skipped_.fetch_add(1, std::memory_order_relaxed);
+  }
+
  private:
   Stats() = default;
   ~Stats();
@@ -78,6 +90,9 @@ class Stats {
   std::atomic<std::uint64_t> tasks_submission_failed_{0};
   std::atomic<std::uint64_t> tasks_completed_{0};
   std::atomic<std::uint64_t> tasks_destructed_{0};
+  std::atomic<std::uint64_t> waf_runs_inline_{0};
+  std::atomic<std::uint64_t> waf_runs_pooled_{0};
+  std::atomic<std::uint64_t> waf_ends_skipped_{0};
 };
 
 }  // namespace datadog::nginx::security
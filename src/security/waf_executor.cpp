@@ -0,0 +1,247 @@
+#include "waf_executor.h"
+
+#include <cerrno>
+#include <exception>
+
+extern "C" {
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+}
+
+namespace datadog::nginx::security {
+
+std::unique_ptr<WafExecutor> WafExecutor::instance_;
+
+WafExecutor::WafExecutor(int event_fd) : event_fd_{event_fd} {}
+
+WafExecutor::~WafExecutor() {
+  stopping_.store(true, std::memory_order_release);
+  submit_epoch_.fetch_add(1, std::memory_order_seq_cst);
+  submit_epoch_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+
+  if (event_conn_) {
+    ngx_close_connection(event_conn_);  // also closes event_fd_
+  } else if (event_fd_ != -1) {
+    ::close(event_fd_);
+  }
+}
+
+bool WafExecutor::start([[maybe_unused]] std::size_t num_threads,
+                        [[maybe_unused]] bool pin_threads) {
+#if defined(__linux__)
+  if (instance_) {
+    return true;
+  }
+
+  int event_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd == -1) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                  "WAF executor: eventfd() failed");
+    return false;
+  }
+
+  std::unique_ptr<WafExecutor> executor{new WafExecutor{event_fd}};
+
+  ngx_connection_t *conn = ngx_get_connection(event_fd, ngx_cycle->log);
+  if (!conn) {
+    return false;
+  }
+  executor->event_conn_ = conn;
+  conn->data = executor.get();
+  conn->read->handler = completion_event_handler;
+  conn->read->log = ngx_cycle->log;
+  if (ngx_add_event(conn->read, NGX_READ_EVENT, 0) != NGX_OK) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "WAF executor: failed to register the completion event");
+    return false;
+  }
+
+  if (!executor->start_threads(num_threads, pin_threads)) {
+    return false;
+  }
+
+  ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                "WAF executor started with %uz threads", num_threads);
+  instance_ = std::move(executor);
+  return true;
+#else
+  ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                "datadog_appsec_waf_threads is only supported on Linux");
+  return false;
+#endif
+}
+
+void WafExecutor::stop() noexcept { instance_.reset(); }
+
+bool WafExecutor::start_threads(std::size_t num_threads, bool pin_threads) {
+  // like nginx's thread pools, don't let the WAF threads handle signals; the
+  // event loop must be interrupted by them
+  sigset_t all_signals;
+  sigset_t prev_signals;
+  sigfillset(&all_signals);
+  if (pthread_sigmask(SIG_SETMASK, &all_signals, &prev_signals) != 0) {
+    return false;
+  }
+
+  try {
+    threads_.reserve(num_threads);
+    for (std::size_t i = 0; i < num_threads; i++) {
+      threads_.emplace_back([this] { thread_loop(); });
+    }
+  } catch (const std::exception &e) {
+    pthread_sigmask(SIG_SETMASK, &prev_signals, nullptr);
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "WAF executor: failed to start threads: %s", e.what());
+    return false;
+  }
+  pthread_sigmask(SIG_SETMASK, &prev_signals, nullptr);
+
+#if defined(__linux__)
+  if (pin_threads) {
+    // the worker process has already been bound according to
+    // worker_cpu_affinity; spread the WAF threads over the same CPUs
+    cpu_set_t worker_cpus;
+    CPU_ZERO(&worker_cpus);
+    if (sched_getaffinity(0, sizeof(worker_cpus), &worker_cpus) != 0) {
+      ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, ngx_errno,
+                    "WAF executor: sched_getaffinity() failed; not pinning "
+                    "threads");
+      return true;
+    }
+
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &worker_cpus)) {
+        cpus.push_back(cpu);
+      }
+    }
+    if (cpus.empty()) {
+      return true;
+    }
+
+    for (std::size_t i = 0; i < threads_.size(); i++) {
+      cpu_set_t thread_cpus;
+      CPU_ZERO(&thread_cpus);
+      CPU_SET(cpus[i % cpus.size()], &thread_cpus);
+      int err = pthread_setaffinity_np(threads_[i].native_handle(),
+                                       sizeof(thread_cpus), &thread_cpus);
+      if (err != 0) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, err,
+                      "WAF executor: pthread_setaffinity_np() failed");
+      }
+    }
+  }
+#endif
+
+  return true;
+}
+
+bool WafExecutor::post(ngx_thread_task_t &task) noexcept {
+  WafExecutor &executor = *instance_;
+
+  if (task.event.active) {
+    ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                  "WAF executor: task %p already active", &task);
+    return false;
+  }
+
+  if (executor.in_flight_ >= kMaxInFlight) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "WAF executor: %uz tasks in flight, queue is full",
+                  executor.in_flight_);
+    return false;
+  }
+
+  task.event.active = 1;
+  if (!executor.submitted_.try_push(&task)) {
+    task.event.active = 0;
+    return false;
+  }
+  executor.in_flight_++;
+
+  // pairs with the increment of idle_threads_ in thread_loop(): either we see
+  // the idle thread or it sees the new epoch and doesn't go to sleep
+  executor.submit_epoch_.fetch_add(1, std::memory_order_seq_cst);
+  if (executor.idle_threads_.load(std::memory_order_seq_cst) > 0) {
+    executor.submit_epoch_.notify_one();
+  }
+
+  return true;
+}
+
+void WafExecutor::thread_loop() noexcept {
+  while (true) {
+    std::uint32_t epoch = submit_epoch_.load(std::memory_order_seq_cst);
+
+    ngx_thread_task_t *task;
+    if (submitted_.try_pop(task)) {
+      task->handler(task->ctx, ngx_cycle->log);
+      while (!completed_.try_push(task)) {
+        // can't happen: there are never more than kMaxInFlight tasks
+        std::this_thread::yield();
+      }
+      signal_completion();
+      continue;
+    }
+
+    if (stopping_.load(std::memory_order_acquire)) {
+      return;
+    }
+
+    idle_threads_.fetch_add(1, std::memory_order_seq_cst);
+    submit_epoch_.wait(epoch, std::memory_order_seq_cst);
+    idle_threads_.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+void WafExecutor::signal_completion() noexcept {
+  // only the first completion after the event loop drained the queue writes
+  // to the eventfd; the others are picked up by the same drain
+  if (completion_signaled_.exchange(true, std::memory_order_acq_rel)) {
+    return;
+  }
+
+  std::uint64_t one = 1;
+  while (::write(event_fd_, &one, sizeof(one)) == -1 && errno == EINTR) {
+  }
+}
+
+void WafExecutor::completion_event_handler(ngx_event_t *evt) noexcept {
+  auto *conn = static_cast<ngx_connection_t *>(evt->data);
+  auto *executor = static_cast<WafExecutor *>(conn->data);
+
+  std::uint64_t count;
+  while (::read(executor->event_fd_, &count, sizeof(count)) == -1 &&
+         errno == EINTR) {
+  }
+
+  executor->drain_completions();
+}
+
+void WafExecutor::drain_completions() noexcept {
+  // reset before draining, so completions pushed after this point signal the
+  // eventfd again. Synchronizes with the exchange in signal_completion(), so
+  // the completions that didn't signal are visible below
+  completion_signaled_.exchange(false, std::memory_order_acq_rel);
+
+  ngx_thread_task_t *task;
+  while (completed_.try_pop(task)) {
+    in_flight_--;
+
+    // same as ngx_thread_pool_handler()
+    ngx_event_t *event = &task->event;
+    event->complete = 1;
+    event->active = 0;
+    event->handler(event);
+  }
+}
+
+}  // namespace datadog::nginx::security
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.h"
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_thread_pool.h>
+}
+
+namespace datadog::nginx::security {
+
+// Runs WAF tasks on threads owned by the worker process, as an alternative to
+// the nginx thread pool named by datadog_waf_thread_pool_name (see
+// datadog_appsec_waf_threads). It takes the same ngx_thread_task_t: the task
+// handler runs on a WAF thread and the event handler then runs on the event
+// loop, just like with ngx_thread_task_post().
+//
+// Submissions and completions go through lock-free queues. Idle WAF threads
+// sleep on a futex that is only signaled if there is some idle thread, and
+// completions are signaled through an eventfd that is written at most once
+// per batch of completions consumed by the event loop.
+class WafExecutor {
+ public:
+  // To be called on worker process initialization. Only supported on Linux
+  static bool start(std::size_t num_threads, bool pin_threads);
+  static void stop() noexcept;
+
+  static bool running() noexcept { return instance_ != nullptr; }
+
+  // To be called from the event loop. Returns false if too many tasks are in
+  // flight, in which case the caller still owns the task
+  static bool post(ngx_thread_task_t &task) noexcept;
+
+  WafExecutor(const WafExecutor &) = delete;
+  WafExecutor &operator=(const WafExecutor &) = delete;
+  ~WafExecutor();
+
+ private:
+  explicit WafExecutor(int event_fd);
+
+  bool start_threads(std::size_t num_threads, bool pin_threads);
+  void thread_loop() noexcept;
+  void signal_completion() noexcept;
+  void drain_completions() noexcept;
+  static void completion_event_handler(ngx_event_t *evt) noexcept;
+
+  // max tasks queued or running. The completion queue has the same capacity,
+  // so pushing into it never fails
+  static inline constexpr std::size_t kMaxInFlight = 16384;
+
+  static std::unique_ptr<WafExecutor> instance_;
+
+  BoundedQueue<ngx_thread_task_t *> submitted_{kMaxInFlight};
+  BoundedQueue<ngx_thread_task_t *> completed_{kMaxInFlight};
+  std::size_t in_flight_{0};  // only accessed from the event loop
+
+  std::atomic<std::uint32_t> submit_epoch_{0};
+  std::atomic<std::uint32_t> idle_threads_{0};
+  std::atomic<bool> completion_signaled_{false};
+  std::atomic<bool> stopping_{false};
+
+  int event_fd_;
+  ngx_connection_t *event_conn_{nullptr};
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace datadog::nginx::security
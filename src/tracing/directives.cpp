@@ -59,7 +59,11 @@ char *set_datadog_tag(ngx_conf_t *cf, ngx_command_t *command,
     return static_cast<char *>(NGX_CONF_ERROR);
   }
 
-  loc_conf->tags.insert_or_assign(to_string(values[1]), complex_value);
+  if (loc_conf->tags == nullptr) {
+    loc_conf->tags = std::make_shared<
+        std::unordered_map<std::string, ngx_http_complex_value_t *>>();
+  }
+  loc_conf->tags->insert_or_assign(to_string(values[1]), complex_value);
   return NGX_CONF_OK;
 }
 
@@ -200,6 +204,15 @@ char *set_datadog_sample_rate(ngx_conf_t *cf, ngx_command_t *command,
     return static_cast<char *>(NGX_CONF_ERROR);
   }
 
+  auto main_conf = static_cast<datadog_main_conf_t *>(
+      ngx_http_conf_get_module_main_conf(cf, ngx_http_datadog_module));
+
+  // The only way that `main_conf` could be `nullptr` is if there's no `http`
+  // block in the nginx configuration.  In that case, this function would never
+  // get called, because it's called only from configuration directives that
+  // live inside the `http` block.
+  assert(main_conf != nullptr);
+
   // Add to the location configuration a `datadog_sample_rate_condition_t`
   // object corresponding to this `sample_rate` directive. This will allow us
   // to evaluate the condition (script) when a request comes through this
@@ -209,6 +222,7 @@ char *set_datadog_sample_rate(ngx_conf_t *cf, ngx_command_t *command,
       .condition = condition_script,
       .directive = directive,
       .same_line_index = 0,  // see below
+      .rule_index = main_conf->sampling_rules.size(),
   };
   if (!rates.empty() && rates.back().directive == rate.directive) {
     // Two "sample_rate" directives on the same line. Scandal.
@@ -216,15 +230,6 @@ char *set_datadog_sample_rate(ngx_conf_t *cf, ngx_command_t *command,
   }
   rates.push_back(rate);  // we use `rate` again below
 
-  auto main_conf = static_cast<datadog_main_conf_t *>(
-      ngx_http_conf_get_module_main_conf(cf, ngx_http_datadog_module));
-
-  // The only way that `main_conf` could be `nullptr` is if there's no `http`
-  // block in the nginx configuration.  In that case, this function would never
-  // get called, because it's called only from configuration directives that
-  // live inside the `http` block.
-  assert(main_conf != nullptr);
-
   // Add a corresponding sampling rule to the main configuration.
   // This will end up in the tracer when it's instantiated in worker processes.
   sampling_rule_t rule;
@@ -236,6 +241,39 @@ char *set_datadog_sample_rate(ngx_conf_t *cf, ngx_command_t *command,
   return static_cast<char *>(NGX_CONF_OK);
 }
 
+char *set_datadog_sample_rate_overrides(ngx_conf_t *cf,
+                                        ngx_command_t *command,
+                                        void *conf) noexcept {
+  const auto main_conf = static_cast<datadog_main_conf_t *>(conf);
+  if (main_conf->sample_rate_overrides_file) {
+    return const_cast<char *>("is duplicate");
+  }
+
+  auto values = static_cast<ngx_str_t *>(cf->args->elts);
+  // values[0] is the command name, "datadog_sample_rate_overrides".
+  //
+  //     datadog_sample_rate_overrides <file> [<interval>];
+  ngx_str_t path = values[1];
+  if (ngx_conf_full_name(cf->cycle, &path, 1) != NGX_OK) {
+    return static_cast<char *>(NGX_CONF_ERROR);
+  }
+
+  if (cf->args->nelts == 3) {
+    const time_t interval = ngx_parse_time(&values[2], 1);
+    if (interval == static_cast<time_t>(NGX_ERROR) || interval == 0) {
+      ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                         "Invalid argument \"%V\" to %V directive.  Expected "
+                         "a positive time interval, e.g. \"10s\".",
+                         &values[2], &command->name);
+      return static_cast<char *>(NGX_CONF_ERROR);
+    }
+    main_conf->sample_rate_overrides_interval = std::chrono::seconds{interval};
+  }
+
+  main_conf->sample_rate_overrides_file = to_string(path);
+  return static_cast<char *>(NGX_CONF_OK);
+}
+
 char *set_datadog_propagation_styles(ngx_conf_t *cf, ngx_command_t *command,
                                      void *conf) noexcept {
   const auto main_conf = static_cast<datadog_main_conf_t *>(conf);
@@ -43,6 +43,10 @@ char *set_datadog_baggage_tags(ngx_conf_t *cf, ngx_command_t *command,
 char *set_datadog_sample_rate(ngx_conf_t *cf, ngx_command_t *command,
                               void *conf) noexcept;
 
+char *set_datadog_sample_rate_overrides(ngx_conf_t *cf,
+                                        ngx_command_t *command,
+                                        void *conf) noexcept;
+
 char *set_datadog_propagation_styles(ngx_conf_t *cf, ngx_command_t *command,
                                      void *conf) noexcept;
 
@@ -138,6 +142,15 @@ constexpr datadog::nginx::directive tracing_directives[] = {
         nullptr,
     },
 
+    {
+        "datadog_sample_rate_overrides",
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE12,
+        set_datadog_sample_rate_overrides,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        0,
+        nullptr,
+    },
+
     {
         "datadog_propagation_styles",
         NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
@@ -0,0 +1,228 @@
+#include "tracing/sample_rate_overrides.h"
+
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "datadog_conf.h"
+#include "ngx_event_scheduler.h"
+#include "ngx_http_datadog_module.h"
+#include "string_util.h"
+
+extern "C" {
+#include <ngx_process_cycle.h>
+}
+
+namespace datadog::nginx {
+namespace {
+
+constexpr std::string_view zone_name = "datadog_sample_rate_overrides";
+
+// `shm_zone->data` of the zone: what the zone is sized for, and where the
+// state is once the zone is initialized.
+struct ZoneContext {
+  std::size_t num_rules;
+  void *state;
+};
+
+ngx_int_t init_zone(ngx_shm_zone_t *shm_zone, void *data) noexcept {
+  auto *ctx = static_cast<ZoneContext *>(shm_zone->data);
+  const auto *old_ctx = static_cast<ZoneContext *>(data);
+
+  if (old_ctx != nullptr) {
+    // The zone has the same size, so the same number of directives. They
+    // might not be the same ones: drop the overrides until they're published
+    // again for this configuration.
+    ctx->state = old_ctx->state;
+  } else {
+    auto *pool = reinterpret_cast<ngx_slab_pool_t *>(shm_zone->shm.addr);
+    ctx->state =
+        ngx_slab_alloc(pool, SampleRateOverrides::state_size(ctx->num_rules));
+    if (ctx->state == nullptr) {
+      ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                    "Failed to allocate shared memory for sample rate "
+                    "overrides");
+      return NGX_ERROR;
+    }
+  }
+
+  SampleRateOverrides::initialize(ctx->state, ctx->num_rules);
+  return NGX_OK;
+}
+
+std::optional<SampleRateOverrides> overrides;
+std::optional<TraceRateLimiter> limiter;
+std::unique_ptr<NgxEventScheduler> scheduler;
+
+// Watches a `datadog_sample_rate_overrides` file and publishes its contents
+// whenever it changes.
+class OverridesFileWatcher {
+ public:
+  OverridesFileWatcher(const datadog_main_conf_t &main_conf,
+                       SampleRateOverrides shared)
+      : path_{*main_conf.sample_rate_overrides_file}, shared_{shared} {
+    const auto &rules = main_conf.sampling_rules;
+    for (std::size_t i = 0; i < rules.size(); ++i) {
+      // the only tag is the directive's "nginx.sample_rate_source"
+      for (const auto &[name, source] : rules[i].rule.tags) {
+        rule_indices_.emplace(source, i);
+      }
+    }
+  }
+
+  void poll(ngx_log_t *log) {
+    ngx_file_info_t info;
+    if (ngx_file_info(path_.c_str(), &info) == NGX_FILE_ERROR) {
+      if (loaded_) {
+        ngx_log_error(NGX_LOG_NOTICE, log, ngx_errno,
+                      "Sample rate overrides file \"%s\" is gone, "
+                      "dropping the overrides",
+                      path_.c_str());
+        shared_.publish({});
+        loaded_ = false;
+      }
+      mtime_ = -1;
+      return;
+    }
+
+    if (ngx_file_mtime(&info) == mtime_ && ngx_file_size(&info) == size_) {
+      return;
+    }
+    mtime_ = ngx_file_mtime(&info);
+    size_ = ngx_file_size(&info);
+
+    std::ifstream file{path_};
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    if (!file) {
+      ngx_log_error(NGX_LOG_ERR, log, 0,
+                    "Failed to read sample rate overrides file \"%s\"",
+                    path_.c_str());
+      return;
+    }
+
+    SampleRateOverridesFile parsed;
+    try {
+      parsed = parse_sample_rate_overrides(contents.str());
+    } catch (const std::invalid_argument &e) {
+      ngx_log_error(NGX_LOG_ERR, log, 0,
+                    "Invalid sample rate overrides file \"%s\", keeping the "
+                    "previous overrides: %s",
+                    path_.c_str(), e.what());
+      return;
+    }
+
+    std::vector<std::optional<double>> rates(shared_.num_rules() + 1);
+    for (const auto &[source, rate] : parsed.rates) {
+      const auto found = rule_indices_.find(source);
+      if (found == rule_indices_.end()) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "Sample rate overrides file \"%s\": no "
+                      "datadog_sample_rate directive at %s",
+                      path_.c_str(), source.c_str());
+        continue;
+      }
+      rates[found->second] = rate;
+    }
+    rates.back() = parsed.default_rate;
+
+    shared_.publish(rates);
+    loaded_ = true;
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "Loaded %uz sample rate overrides from \"%s\"",
+                  parsed.rates.size() + (parsed.default_rate ? 1 : 0),
+                  path_.c_str());
+  }
+
+ private:
+  std::string path_;
+  SampleRateOverrides shared_;
+  std::unordered_map<std::string, std::size_t> rule_indices_;
+  time_t mtime_ = -1;
+  off_t size_ = -1;
+  bool loaded_ = false;
+};
+
+}  // namespace
+
+ngx_int_t add_sample_rate_overrides_zone(ngx_conf_t *cf,
+                                         datadog_main_conf_t &main_conf) {
+  auto *ctx = static_cast<ZoneContext *>(
+      ngx_pcalloc(cf->pool, sizeof(ZoneContext)));
+  if (ctx == nullptr) {
+    return NGX_ERROR;
+  }
+  ctx->num_rules = main_conf.sampling_rules.size();
+
+  // The size depends on the number of directives, so that a zone is only
+  // reused across reloads for as many of them.
+  ngx_str_t name = to_ngx_str(zone_name);
+  const std::size_t size =
+      8 * ngx_pagesize + SampleRateOverrides::state_size(ctx->num_rules);
+  ngx_shm_zone_t *shm_zone =
+      ngx_shared_memory_add(cf, &name, size, &ngx_http_datadog_module);
+  if (shm_zone == nullptr) {
+    ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                  "Failed to create shared memory zone for sample rate "
+                  "overrides");
+    return NGX_ERROR;
+  }
+
+  shm_zone->init = init_zone;
+  shm_zone->data = ctx;
+  main_conf.sample_rate_overrides_zone = shm_zone;
+  return NGX_OK;
+}
+
+void start_sample_rate_overrides(ngx_cycle_t *cycle,
+                                 const datadog_main_conf_t &main_conf,
+                                 double max_per_second) {
+  overrides.reset();
+  ngx_shm_zone_t *shm_zone = main_conf.sample_rate_overrides_zone;
+  if (shm_zone == nullptr) {
+    return;
+  }
+
+  overrides.emplace(static_cast<ZoneContext *>(shm_zone->data)->state);
+  limiter.emplace(max_per_second);
+
+  // One worker is enough to keep the shared overrides up to date.
+  if (ngx_worker != 0) {
+    return;
+  }
+
+  auto watcher = std::make_shared<OverridesFileWatcher>(main_conf, *overrides);
+  watcher->poll(cycle->log);
+
+  scheduler = std::make_unique<NgxEventScheduler>();
+  scheduler->schedule_recurring_event(
+      main_conf.sample_rate_overrides_interval,
+      [watcher]() {
+        try {
+          watcher->poll(ngx_cycle->log);
+        } catch (const std::exception &e) {
+          ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                        "Failed to load sample rate overrides: %s", e.what());
+        }
+      });
+}
+
+void stop_sample_rate_overrides() noexcept {
+  scheduler.reset();
+  overrides.reset();
+  limiter.reset();
+}
+
+const SampleRateOverrides *sample_rate_overrides() noexcept {
+  return overrides ? &*overrides : nullptr;
+}
+
+TraceRateLimiter &sample_rate_overrides_limiter() noexcept {
+  return *limiter;
+}
+
+}  // namespace datadog::nginx
@@ -0,0 +1,275 @@
+#pragma once
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+}
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace datadog::nginx {
+
+struct datadog_main_conf_t;
+
+// Sample rates that take the place of those of `datadog_sample_rate`
+// directives, and of the rate of traces to which none applies, without a
+// reload. They live in memory shared by all the worker processes: one slot per
+// directive, in the order in which the directives were read, and one for the
+// traces to which none applies. Each slot is read and written atomically.
+class SampleRateOverrides {
+  using Slot = std::atomic<std::uint32_t>;
+
+  static_assert(Slot::is_always_lock_free, "Slot must be lock-free");
+
+  struct Header {
+    std::uint64_t num_rules;
+  };
+
+  static constexpr std::uint32_t kUnset =
+      std::numeric_limits<std::uint32_t>::max();
+
+ public:
+  // Rates are stored in millionths.
+  static constexpr std::uint32_t kPrecision = 1000000;
+
+  static constexpr std::size_t state_size(std::size_t num_rules) {
+    return sizeof(Header) + (num_rules + 1) * sizeof(Slot);
+  }
+
+  // Set up, in `memory`, the state for `num_rules` directives, without any
+  // overrides. `memory` must be suitably aligned and at least
+  // `state_size(num_rules)` bytes.
+  static SampleRateOverrides initialize(void *memory,
+                                        std::size_t num_rules) noexcept {
+    auto *header = new (memory) Header{num_rules};
+    auto *slots = reinterpret_cast<Slot *>(header + 1);
+    for (std::size_t i = 0; i <= num_rules; ++i) {
+      new (&slots[i]) Slot{kUnset};
+    }
+    return SampleRateOverrides{memory};
+  }
+
+  // `state` must have been set up by `initialize`.
+  explicit SampleRateOverrides(void *state) noexcept
+      : header_{static_cast<Header *>(state)},
+        slots_{reinterpret_cast<Slot *>(header_ + 1)} {}
+
+  std::size_t num_rules() const noexcept { return header_->num_rules; }
+
+  // Return the overridden rate, in millionths, of the directive at
+  // `rule_index`, or of the traces to which no directive applies if
+  // `rule_index` is null.
+  std::optional<std::uint32_t> rate(
+      std::optional<std::size_t> rule_index) const noexcept {
+    const std::size_t slot = rule_index.value_or(num_rules());
+    if (slot > num_rules()) {
+      return std::nullopt;
+    }
+    const std::uint32_t value = slots_[slot].load(std::memory_order_relaxed);
+    if (value == kUnset) {
+      return std::nullopt;
+    }
+    return value;
+  }
+
+  // Replace all the overrides. `rates` has an element for each directive
+  // followed by one for the traces to which no directive applies; null
+  // elements, or missing ones, are not overridden.
+  void publish(const std::vector<std::optional<double>> &rates) noexcept {
+    for (std::size_t i = 0; i <= num_rules(); ++i) {
+      std::uint32_t value = kUnset;
+      if (i < rates.size() && rates[i]) {
+        value = static_cast<std::uint32_t>(std::lround(*rates[i] * kPrecision));
+      }
+      slots_[i].store(value, std::memory_order_relaxed);
+    }
+  }
+
+  // Return whether to keep the trace whose ID (its lower 64 bits) is
+  // `trace_id` when sampling at `rate` millionths. The decision depends only on
+  // the ID, like that of the tracer's sampler, so that all the services and
+  // workers sampling a trace at the same rate agree.
+  static bool keep(std::uint64_t trace_id, std::uint32_t rate) noexcept {
+    if (rate >= kPrecision) {
+      return true;
+    }
+    const auto threshold = static_cast<std::uint64_t>(
+        static_cast<double>(rate) / kPrecision *
+        static_cast<double>(std::numeric_limits<std::uint64_t>::max()));
+    return trace_id * 1111111111111111111ULL < threshold;
+  }
+
+ private:
+  Header *header_;
+  Slot *slots_;
+};
+
+// Limits the number of traces kept per second, like the tracer's rate limiter
+// limits the traces kept by its sampling rules. Not thread-safe: there is one
+// per worker process, as there is one tracer per worker process.
+class TraceRateLimiter {
+ public:
+  explicit TraceRateLimiter(double max_per_second) noexcept
+      : max_per_second_{max_per_second},
+        capacity_{std::max(max_per_second, 1.0)},
+        tokens_{capacity_} {}
+
+  // Return whether one more trace can be kept at `now_ms`, in milliseconds
+  // from any fixed point, which must not go backwards.
+  bool allow(std::uint64_t now_ms) noexcept {
+    if (now_ms > last_ms_) {
+      const auto elapsed = static_cast<double>(now_ms - last_ms_);
+      tokens_ = std::min(capacity_, tokens_ + elapsed * max_per_second_ / 1000);
+    }
+    last_ms_ = now_ms;
+
+    const std::uint64_t second = now_ms / 1000;
+    if (second != second_) {
+      const bool consecutive = second == second_ + 1;
+      previous_allowed_ = consecutive ? allowed_ : 0;
+      previous_requested_ = consecutive ? requested_ : 0;
+      allowed_ = requested_ = 0;
+      second_ = second;
+    }
+
+    ++requested_;
+    if (tokens_ < 1) {
+      return false;
+    }
+    tokens_ -= 1;
+    ++allowed_;
+    return true;
+  }
+
+  // Return the proportion of the traces that were allowed, over the current
+  // and the previous second, for the "_dd.limit_psr" metric.
+  double effective_rate() const noexcept {
+    const std::uint64_t requested = requested_ + previous_requested_;
+    if (requested == 0) {
+      return 1.0;
+    }
+    return static_cast<double>(allowed_ + previous_allowed_) /
+           static_cast<double>(requested);
+  }
+
+ private:
+  double max_per_second_;
+  double capacity_;
+  double tokens_;
+  std::uint64_t last_ms_ = 0;
+  std::uint64_t second_ = 0;
+  std::uint64_t allowed_ = 0;
+  std::uint64_t requested_ = 0;
+  std::uint64_t previous_allowed_ = 0;
+  std::uint64_t previous_requested_ = 0;
+};
+
+// The contents of a `datadog_sample_rate_overrides` file.
+struct SampleRateOverridesFile {
+  // rates by the "nginx.sample_rate_source" tag of their directive
+  std::unordered_map<std::string, double> rates;
+  // rate of the traces to which no directive applies ("*")
+  std::optional<double> default_rate;
+};
+
+// Parse `text`, which has one "<source> <rate>" entry per line. <source> is
+// the value of the "nginx.sample_rate_source" tag of a `datadog_sample_rate`
+// directive, e.g. "/etc/nginx/nginx.conf:23#1", or "*" for the traces to
+// which no directive applies, and <rate> is between 0.0 and 1.0. Blank lines
+// and lines starting with "#" are ignored. Throw `std::invalid_argument` if
+// a line is invalid.
+inline SampleRateOverridesFile parse_sample_rate_overrides(
+    std::string_view text) {
+  static constexpr std::string_view whitespace = " \t\r";
+  const auto trim = [](std::string_view s) {
+    const auto begin = s.find_first_not_of(whitespace);
+    if (begin == std::string_view::npos) {
+      return std::string_view{};
+    }
+    return s.substr(begin, s.find_last_not_of(whitespace) - begin + 1);
+  };
+
+  SampleRateOverridesFile result;
+  std::size_t line_number = 0;
+  while (!text.empty()) {
+    ++line_number;
+    const auto end = text.find('\n');
+    const std::string_view line = trim(text.substr(0, end));
+    text = end == std::string_view::npos ? std::string_view{}
+                                         : text.substr(end + 1);
+    if (line.empty() || line.front() == '#') {
+      continue;
+    }
+
+    const auto error = [&](std::string_view what) {
+      return std::invalid_argument("line " + std::to_string(line_number) +
+                                   ": " + std::string{what});
+    };
+
+    const auto split = line.find_last_of(whitespace);
+    if (split == std::string_view::npos) {
+      throw error("expected \"<source> <rate>\"");
+    }
+    const std::string source{trim(line.substr(0, split))};
+    const std::string rate_str{line.substr(split + 1)};
+
+    double rate;
+    try {
+      std::size_t end_index;
+      rate = std::stod(rate_str, &end_index);
+      if (end_index != rate_str.size()) {
+        throw std::invalid_argument("");
+      }
+    } catch (const std::exception &) {
+      throw error("\"" + rate_str + "\" is not a number");
+    }
+    if (!(rate >= 0.0 && rate <= 1.0)) {
+      throw error("\"" + rate_str + "\" is not between 0.0 and 1.0");
+    }
+
+    if (source == "*") {
+      result.default_rate = rate;
+    } else {
+      result.rates.insert_or_assign(source, rate);
+    }
+  }
+
+  return result;
+}
+
+// Add the shared memory zone for the sample rate overrides of the specified
+// `main_conf`, which must have a `sample_rate_overrides_file`.
+ngx_int_t add_sample_rate_overrides_zone(ngx_conf_t *cf,
+                                         datadog_main_conf_t &main_conf);
+
+// In a worker process, attach to the sample rate overrides, if configured,
+// and, in the first worker, start watching the file to publish its contents.
+// The traces kept because of an override are limited to `max_per_second`.
+void start_sample_rate_overrides(ngx_cycle_t *cycle,
+                                 const datadog_main_conf_t &main_conf,
+                                 double max_per_second);
+
+// Stop watching the file, if this worker was.
+void stop_sample_rate_overrides() noexcept;
+
+// Return the sample rate overrides of this worker process, or null if not
+// configured.
+const SampleRateOverrides *sample_rate_overrides() noexcept;
+
+// Return the limiter of the traces kept because of an override in this worker
+// process. Only valid if `sample_rate_overrides()` isn't null.
+TraceRateLimiter &sample_rate_overrides_limiter() noexcept;
+
+}  // namespace datadog::nginx
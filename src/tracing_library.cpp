@@ -48,7 +48,7 @@ inline constexpr std::string_view integration_name_from_flavor(
   std::abort();
 }
 
-dd::Expected<dd::Tracer> TracingLibrary::make_tracer(
+dd::Expected<dd::FinalizedTracerConfig> TracingLibrary::make_tracer_config(
     const datadog_main_conf_t &nginx_conf, std::shared_ptr<dd::Logger> logger) {
   dd::TracerConfig config;
   config.logger = std::move(logger);
@@ -139,34 +139,24 @@ dd::Expected<dd::Tracer> TracingLibrary::make_tracer(
     // To avoid reporting traces, set the sampling rate to `0` for this
     // endpoint. This is done after `finalize_config` because it can
     // environment variables override the programmatic configuration.
-    final_config->trace_sampler.rules.emplace_back(
-        datadog::tracing::TraceSamplerRule{
-            .rate = datadog::tracing::Rate::zero(),
-            .matcher =
-                datadog::tracing::SpanMatcher{
-                    .service = "*",
-                    .name = "*",
-                    .resource = "GET /is-dynamic-lb-initialized",
-                    .tags = {}},
-            .mechanism = datadog::tracing::SamplingMechanism::RULE});
-
-    // TODO(@dmehala): Disable tracing if `stub_status on;`.
-    final_config->trace_sampler.rules.emplace_back(
-        datadog::tracing::TraceSamplerRule{
-            .rate = datadog::tracing::Rate::zero(),
-            .matcher =
-                datadog::tracing::SpanMatcher{.service = "*",
-                                              .name = "*",
-                                              .resource = "GET /nginx_status",
-                                              .tags = {}},
-            .mechanism = datadog::tracing::SamplingMechanism::RULE});
-  }
-
-  if (!final_config) {
-    return final_config.error();
+    // The probe locations are usually not traced in the first place (see
+    // `probe_uris`); the rules cover requests that are, e.g. after a
+    // redirect.
+    for (const std::string_view uri : probe_uris()) {
+      final_config->trace_sampler.rules.emplace_back(
+          datadog::tracing::TraceSamplerRule{
+              .rate = datadog::tracing::Rate::zero(),
+              .matcher =
+                  datadog::tracing::SpanMatcher{
+                      .service = "*",
+                      .name = "*",
+                      .resource = "GET " + std::string{uri},
+                      .tags = {}},
+              .mechanism = datadog::tracing::SamplingMechanism::RULE});
+    }
   }
 
-  return dd::Tracer(*final_config);
+  return final_config;
 }
 
 std::string_view TracingLibrary::environment_variable_name_prefix() {
@@ -246,6 +236,17 @@ std::vector<std::string_view> TracingLibrary::environment_variable_names() {
       std::end(dd::environment::variable_names)};
 }
 
+std::span<const std::string_view> TracingLibrary::probe_uris() {
+  if constexpr (kNginx_flavor == nginx::flavor::ingress_nginx) {
+    // ingress-nginx serves `stub_status` at "/nginx_status".
+    static constexpr std::string_view uris[] = {"/is-dynamic-lb-initialized",
+                                                "/nginx_status"};
+    return uris;
+  } else {
+    return {};
+  }
+}
+
 std::string_view TracingLibrary::default_request_operation_name_pattern() {
   return "nginx.request";
 }
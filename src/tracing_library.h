@@ -15,6 +15,7 @@
 #include <datadog/tracer.h>
 
 #include <memory>
+#include <span>
 #include <string>
 #include <string_view>
 #include <unordered_map>
@@ -36,10 +37,10 @@ struct NginxVariableFamily {
 };
 
 struct TracingLibrary {
-  // Return a `Tracer` created with the specified `configuration`. If
-  // `configuration` is empty, use a default configuration.  If an error
+  // Return the configuration of a `Tracer` for the specified `configuration`.
+  // If `configuration` is empty, use a default configuration.  If an error
   // occurs, return a `dd::Error`.
-  static dd::Expected<dd::Tracer> make_tracer(
+  static dd::Expected<dd::FinalizedTracerConfig> make_tracer_config(
       const datadog_main_conf_t& conf, std::shared_ptr<dd::Logger> logger);
 
   // Return the common prefix of all variable names that map to nginx worker
@@ -127,6 +128,14 @@ struct TracingLibrary {
   // that they will refer to string literals).
   static std::vector<std::string> default_baggage_span_tags();
 
+  // Return the URIs of the health check and status endpoints that this nginx
+  // flavor's controller polls, e.g. "/is-dynamic-lb-initialized" for
+  // ingress-nginx. Locations named after them are not traced unless
+  // `datadog_tracing` is set in the location itself, and `GET` requests for
+  // them are not sampled. The storage to which the returned values refer is
+  // static.
+  static std::span<const std::string_view> probe_uris();
+
   // Return the default setting for whether tracing is enabled in nginx.
   static bool tracing_on_by_default();
 
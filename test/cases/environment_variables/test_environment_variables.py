@@ -77,3 +77,21 @@ class TestEnvironmentVariables(case.TestCase):
                 else:
                     self.assertEqual(value, worker_env[variable_name],
                                      error_context)
+
+    def test_environment_variables_looked_up_by_name(self):
+        nginx_conf = (Path(__file__).parent / 'conf' /
+                      'nginx.conf').read_text()
+        extra_env = {'DD_AGENT_HOST': 'agent', 'NOT_ALLOWED': 'foobar'}
+        with self.orch.custom_nginx(nginx_conf, extra_env):
+            status, _, body = with_staggered_retries(
+                lambda: self.orch.send_nginx_http_request('/ssi', 8080),
+                retry_interval_seconds=0.25,
+                max_attempts=200)
+            self.assertEqual(status, 200)
+            worker_env = parse_body(body)
+            self.assertEqual(
+                worker_env, {
+                    'DD_AGENT_HOST': 'agent',
+                    'DD_VERSION': 'overridden',
+                    'NOT_ALLOWED': '-'
+                })
@@ -149,3 +149,36 @@ TEST_CASE("ClientIp fallback: only private IP in header", "[client_ip]") {
   REQUIRE(result.has_value());
   REQUIRE(result.value() == "10.0.0.5");  // Header is used
 }
+
+TEST_CASE("ClientIp: bracketed IPv6 address with port", "[client_ip]") {
+  StubRequest stub("192.168.1.100");
+  stub.add_header("x-forwarded-for", "[2001:db8::1]:8080, 10.0.0.5");
+
+  dnsec::ClientIp client_ip(std::nullopt, stub.request);
+  auto result = client_ip.resolve();
+
+  REQUIRE(result.has_value());
+  REQUIRE(result.value() == "2001:db8::1");
+}
+
+TEST_CASE("ClientIp: remote_addr is kept across requests of a connection",
+          "[client_ip]") {
+  StubRequest stub("2001:db8::2", true);
+  stub.connection.pool = &stub.pool;
+
+  auto result = dnsec::ClientIp(std::nullopt, stub.request).resolve();
+  REQUIRE(result.has_value());
+  REQUIRE(result.value() == "2001:db8::2");
+  REQUIRE(stub.pool.cleanup != nullptr);
+
+  result = dnsec::ClientIp(std::nullopt, stub.request).resolve();
+  REQUIRE(result.has_value());
+  REQUIRE(result.value() == "2001:db8::2");
+
+  // e.g. the realip module changed the address
+  auto* sin6 = reinterpret_cast<sockaddr_in6*>(stub.address.sockaddr_ptr);
+  inet_pton(AF_INET6, "2001:db8::3", &sin6->sin6_addr);
+  result = dnsec::ClientIp(std::nullopt, stub.request).resolve();
+  REQUIRE(result.has_value());
+  REQUIRE(result.value() == "2001:db8::3");
+}
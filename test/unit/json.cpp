@@ -84,3 +84,108 @@ TEST_CASE("pool object recycling", "[json]") {
   CHECK(inner_arr.is_array());
   CHECK(inner_arr.size_unchecked() == 2);
 }
+
+namespace {
+std::optional<ddwaf_obj> parse_contiguous(std::string_view body,
+                                          dnsec::DdwafMemres &memres) {
+  static ngx_log_t log{};
+  static ngx_connection_t empty_conn{.log = &log};
+  static ngx_table_elt_t content_type = {
+      .value = dnsec::ngx_stringv("application/json"sv)};
+  static ngx_http_request_t req{.connection = &empty_conn,
+                                .headers_in = {.content_type = &content_type}};
+  ddwaf_obj slot;
+
+  if (!dnsec::parse_body_req(slot, req, body, memres)) {
+    return std::nullopt;
+  }
+  return {slot};
+}
+
+bool points_into(std::string_view sv, std::string_view body) {
+  return sv.data() >= body.data() && sv.data() < body.data() + body.size();
+}
+}  // namespace
+
+TEST_CASE("strings of a contiguous body", "[json]") {
+  std::string_view body = R"({"key": "plain", "esc\"aped": "a\nb"})";
+  dnsec::DdwafMemres memres;
+  auto slot = parse_contiguous(body, memres);
+  REQUIRE((slot && slot->is_map()));
+
+  auto map = dnsec::ddwaf_map_obj{*slot};
+  REQUIRE(map.size() == 2);
+  auto first = map.at_unchecked(0);
+  CHECK(first.key() == "key");
+  CHECK(first.string_val_unchecked() == "plain");
+  // referenced, not copied
+  CHECK(points_into(first.key(), body));
+  CHECK(points_into(first.string_val_unchecked(), body));
+
+  auto second = map.at_unchecked(1);
+  CHECK(second.key() == "esc\"aped");
+  CHECK(second.string_val_unchecked() == "a\nb");
+  CHECK_FALSE(points_into(second.key(), body));
+  CHECK_FALSE(points_into(second.string_val_unchecked(), body));
+}
+
+TEST_CASE("data past the WAF limits is dropped", "[json]") {
+  dnsec::DdwafMemres memres;
+
+  SECTION("container size") {
+    std::string body = "[[";
+    for (std::size_t i = 0; i < dnsec::kWafMaxContainerSize + 10; i++) {
+      body += "1,";
+    }
+    body += "2], 3]";
+
+    auto slot = parse_contiguous(body, memres);
+    REQUIRE((slot && slot->is_array()));
+    auto arr = dnsec::ddwaf_arr_obj{*slot};
+    REQUIRE(arr.size() == 2);
+    CHECK(arr.at_unchecked(0).size_unchecked() == dnsec::kWafMaxContainerSize);
+    CHECK(arr.at_unchecked(1).numeric_val<int>() == 3);
+  }
+
+  SECTION("parsing stops once the top-level container is full") {
+    std::string body = "{";
+    for (std::size_t i = 0; i < dnsec::kWafMaxContainerSize + 1; i++) {
+      body += "\"k" + std::to_string(i) + "\": 1,";
+    }
+    body += "this is not json";
+
+    auto slot = parse_contiguous(body, memres);
+    REQUIRE((slot && slot->is_map()));
+    CHECK(slot->size_unchecked() == dnsec::kWafMaxContainerSize);
+  }
+
+  SECTION("depth") {
+    std::string body;
+    for (std::size_t i = 0; i < dnsec::kWafMaxContainerDepth + 5; i++) {
+      body += "[";
+    }
+    for (std::size_t i = 0; i < dnsec::kWafMaxContainerDepth + 5; i++) {
+      body += "]";
+    }
+
+    auto slot = parse_contiguous(body, memres);
+    REQUIRE(slot);
+    std::size_t depth = 0;
+    ddwaf_obj cur = *slot;
+    while (cur.is_array() && cur.size_unchecked() > 0) {
+      cur = dnsec::ddwaf_arr_obj{cur}.at_unchecked(0);
+      depth++;
+    }
+    CHECK(cur.is_array());
+    CHECK(depth == dnsec::kWafMaxContainerDepth);
+  }
+
+  SECTION("string length") {
+    std::string body =
+        "\"" + std::string(dnsec::kWafMaxStringLength + 1, 'a') + "\"";
+
+    auto slot = parse_contiguous(body, memres);
+    REQUIRE((slot && slot->is_string()));
+    CHECK(slot->string_val_unchecked().size() == dnsec::kWafMaxStringLength);
+  }
+}
@@ -859,3 +859,158 @@ TEST_CASE("invalid multipart examples", "[multipart]") {
               memres);
   }
 }
+
+TEST_CASE("multipart parsing of a contiguous body", "[multipart]") {
+  static ngx_log_t log{};
+  static ngx_connection_t empty_conn{.log = &log};
+  ngx_http_request_t req{.connection = &empty_conn};
+  auto ct = dnsec::HttpContentType::for_string(
+      "multipart/form-data; boundary=myboundary");
+  REQUIRE(ct);
+
+  std::string_view body =
+      "preamble\r\n"
+      "--myboundary\r\n"
+      "Content-Disposition: form-data; name=\"field1\"\r\n"
+      "\r\n"
+      "a --myboundary in the middle of a line\r\n"
+      "--myboundary\r\n"
+      "Content-Disposition: form-data; name=\"field1\"\r\n"
+      "\r\n"
+      "value2\r\n"
+      "--myboun";
+
+  dnsec::DdwafMemres memres;
+  ddwaf_obj slot;
+  REQUIRE(parse_multipart(slot, req, *ct, body, memres));
+  REQUIRE(slot.is_map());
+  auto map = dnsec::ddwaf_map_obj{slot};
+  REQUIRE(map.size() == 1);
+  std::optional<ddwaf_obj> values = map.get_opt("field1");
+  REQUIRE((values && values->is_array() && values->size_unchecked() == 2));
+
+  auto arr = dnsec::ddwaf_arr_obj{*values};
+  auto v1 = arr.at_unchecked<ddwaf_obj>(0).string_val_unchecked();
+  CHECK(v1 == "a --myboundary in the middle of a line");
+  // the content references the body
+  CHECK((v1.data() >= body.data() && v1.data() < body.data() + body.size()));
+  CHECK(arr.at_unchecked<ddwaf_obj>(1).string_val_unchecked() == "value2");
+}
+
+TEST_CASE("multipart parsing of a body fed in chunks", "[multipart]") {
+  static ngx_log_t log{};
+  static ngx_connection_t empty_conn{.log = &log};
+  ngx_http_request_t req{.connection = &empty_conn};
+
+  std::string_view body =
+      "preamble\r\n"
+      "--myboundary\r\n"
+      "Content-Disposition: form-data; name=\"field1\"\r\n"
+      "\r\n"
+      "a --myboundary in the middle of a line\r\n"
+      "--myboundary\r\n"
+      "Content-Type: text/plain\r\n"
+      "\r\n"
+      "no name\r\n"
+      "--myboundary\r\n"
+      "Content-Disposition: form-data; name=\"field2\"\r\n"
+      "\r\n"
+      "value\r\n"
+      "--myboundary\r\n"
+      "Content-Disposition: form-data; name=\"field1\"\r\n"
+      "\r\n"
+      "value2\r\n"
+      "--myboundary--\r\n"
+      "epilogue";
+
+  for (std::size_t chunk = 1; chunk <= body.size(); chunk++) {
+    dnsec::MultipartBodyParser parser{"myboundary"};
+    // copy the data each time, like the collected body that is moved as it
+    // grows
+    std::string collected;
+    for (std::size_t len = chunk; len < body.size(); len += chunk) {
+      collected = std::string{body.substr(0, len)};
+      parser.feed(req, collected);
+    }
+    collected = std::string{body};
+
+    dnsec::DdwafMemres memres;
+    ddwaf_obj slot;
+    REQUIRE(parser.finish(slot, req, collected, memres));
+    REQUIRE(slot.is_map());
+    auto map = dnsec::ddwaf_map_obj{slot};
+    REQUIRE(map.size() == 2);
+
+    std::optional<ddwaf_obj> values = map.get_opt("field1");
+    REQUIRE((values && values->is_array() && values->size_unchecked() == 2));
+    auto arr = dnsec::ddwaf_arr_obj{*values};
+    CHECK(arr.at_unchecked<ddwaf_obj>(0).string_val_unchecked() ==
+          "a --myboundary in the middle of a line");
+    CHECK(arr.at_unchecked<ddwaf_obj>(1).string_val_unchecked() == "value2");
+
+    std::optional<ddwaf_obj> value = map.get_opt("field2");
+    REQUIRE((value && value->is_string()));
+    CHECK(value->string_val_unchecked() == "value");
+  }
+}
+
+TEST_CASE("multipart body fed in chunks: truncated and invalid", "[multipart]") {
+  static ngx_log_t log{};
+  static ngx_connection_t empty_conn{.log = &log};
+  ngx_http_request_t req{.connection = &empty_conn};
+
+  auto parse_chunked = [&](std::string_view body, std::size_t chunk,
+                           dnsec::DdwafMemres &memres) {
+    dnsec::MultipartBodyParser parser{"myboundary"};
+    for (std::size_t len = chunk; len < body.size(); len += chunk) {
+      parser.feed(req, body.substr(0, len));
+    }
+    ddwaf_obj slot;
+    bool success = parser.finish(slot, req, body, memres);
+    return success ? std::optional{slot} : std::nullopt;
+  };
+
+  for (std::size_t chunk = 1; chunk <= 8; chunk++) {
+    dnsec::DdwafMemres memres;
+
+    // end boundary before first boundary
+    CHECK_FALSE(parse_chunked("--myboundary--\r\n"
+                              "--myboundary\r\n"
+                              "Content-Disposition: form-data; name=a\r\n"
+                              "\r\n"
+                              "value\r\n",
+                              chunk, memres));
+
+    // eof right after first boundary
+    CHECK_FALSE(parse_chunked("--myboundary\r\n", chunk, memres));
+
+    // truncated in the final boundary
+    auto slot = parse_chunked(
+        "--myboundary\r\n"
+        "Content-Disposition: form-data; name=a\r\n"
+        "\r\n"
+        "value\r\n"
+        "--mybou",
+        chunk, memres);
+    REQUIRE((slot && slot->is_map()));
+    auto value = dnsec::ddwaf_map_obj{*slot}.get_opt("a");
+    REQUIRE((value && value->is_string()));
+    CHECK(value->string_val_unchecked() == "value");
+
+    // truncated in the headers
+    slot = parse_chunked(
+        "--myboundary\r\n"
+        "Content-Disposition: form-data; name=a\r\n"
+        "\r\n"
+        "value\r\n"
+        "--myboundary\r\n"
+        "Content-Disposition: form-data; name=b\r\n",
+        chunk, memres);
+    REQUIRE((slot && slot->is_map()));
+    auto map = dnsec::ddwaf_map_obj{*slot};
+    CHECK(map.size() == 2);
+    value = map.get_opt("b");
+    REQUIRE((value && value->is_string()));
+    CHECK(value->string_val_unchecked() == "");
+  }
+}
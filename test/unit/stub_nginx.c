@@ -28,6 +28,19 @@ void* ngx_pcalloc(ngx_pool_t* pool, size_t size) {
   return calloc(1, size);
 }
 
+ngx_pool_cleanup_t* ngx_pool_cleanup_add(ngx_pool_t* p, size_t size) {
+  ngx_pool_cleanup_t* c = calloc(1, sizeof(ngx_pool_cleanup_t));
+  if (c == NULL) {
+    return NULL;
+  }
+  if (size) {
+    c->data = calloc(1, size);
+  }
+  c->next = p->cleanup;
+  p->cleanup = c;
+  return c;
+}
+
 u_char* ngx_snprintf(u_char* buf, size_t max, const char* fmt, ...) {
   (void)buf;
   (void)max;
@@ -0,0 +1,103 @@
+#include <catch2/catch_test_macros.hpp>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "security/bounded_queue.h"
+
+namespace dnsec = datadog::nginx::security;
+
+TEST_CASE("BoundedQueue single-threaded behavior", "[bounded_queue]") {
+    SECTION("Capacity is rounded up to a power of 2") {
+        dnsec::BoundedQueue<int> queue{5};
+        REQUIRE(queue.capacity() == 8);
+
+        dnsec::BoundedQueue<int> tiny{0};
+        REQUIRE(tiny.capacity() == 2);
+    }
+
+    SECTION("Pop on empty queue fails") {
+        dnsec::BoundedQueue<int> queue{4};
+        int value = -1;
+        REQUIRE_FALSE(queue.try_pop(value));
+        REQUIRE(value == -1);
+    }
+
+    SECTION("Elements come out in FIFO order") {
+        dnsec::BoundedQueue<int> queue{4};
+        REQUIRE(queue.try_push(1));
+        REQUIRE(queue.try_push(2));
+        REQUIRE(queue.try_push(3));
+
+        int value;
+        REQUIRE(queue.try_pop(value));
+        REQUIRE(value == 1);
+        REQUIRE(queue.try_pop(value));
+        REQUIRE(value == 2);
+        REQUIRE(queue.try_pop(value));
+        REQUIRE(value == 3);
+        REQUIRE_FALSE(queue.try_pop(value));
+    }
+
+    SECTION("Push on full queue fails until an element is popped") {
+        dnsec::BoundedQueue<int> queue{4};
+        for (int i = 0; i < 4; i++) {
+            REQUIRE(queue.try_push(i));
+        }
+        REQUIRE_FALSE(queue.try_push(4));
+
+        int value;
+        REQUIRE(queue.try_pop(value));
+        REQUIRE(value == 0);
+        REQUIRE(queue.try_push(4));
+    }
+
+    SECTION("Wraps around many times") {
+        dnsec::BoundedQueue<int> queue{2};
+        for (int i = 0; i < 1000; i++) {
+            REQUIRE(queue.try_push(i));
+            int value;
+            REQUIRE(queue.try_pop(value));
+            REQUIRE(value == i);
+        }
+    }
+}
+
+TEST_CASE("BoundedQueue with one producer and several consumers",
+          "[bounded_queue]") {
+    constexpr std::uint64_t kNumItems = 100000;
+    constexpr int kNumConsumers = 4;
+
+    dnsec::BoundedQueue<std::uint64_t> queue{64};
+    std::atomic<std::uint64_t> consumed_count{0};
+    std::atomic<std::uint64_t> consumed_sum{0};
+
+    std::vector<std::thread> consumers;
+    for (int i = 0; i < kNumConsumers; i++) {
+        consumers.emplace_back([&] {
+            while (consumed_count.load() < kNumItems) {
+                std::uint64_t value;
+                if (queue.try_pop(value)) {
+                    consumed_sum.fetch_add(value);
+                    consumed_count.fetch_add(1);
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    for (std::uint64_t i = 1; i <= kNumItems; i++) {
+        while (!queue.try_push(i)) {
+            std::this_thread::yield();
+        }
+    }
+
+    for (auto &consumer : consumers) {
+        consumer.join();
+    }
+
+    REQUIRE(consumed_count.load() == kNumItems);
+    REQUIRE(consumed_sum.load() == kNumItems * (kNumItems + 1) / 2);
+}
@@ -0,0 +1,56 @@
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+
+#include "security/endpoint_sample_cache.h"
+
+namespace dnsec = datadog::nginx::security;
+
+namespace {
+class MockClock {
+public:
+    using duration = std::chrono::steady_clock::duration;
+    using rep = std::chrono::steady_clock::rep;
+    using period = std::chrono::steady_clock::period;
+    using time_point = std::chrono::time_point<MockClock, duration>;
+    static constexpr bool is_steady = true;
+
+    static time_point now() noexcept { return current_time_; }
+
+    static void advance_time(duration d) { current_time_ += d; }
+
+private:
+    static time_point current_time_;
+};
+
+MockClock::time_point MockClock::current_time_ = MockClock::time_point{};
+
+using Cache = dnsec::EndpointSampleCache<16, MockClock>;
+}  // namespace
+
+TEST_CASE("EndpointSampleCache", "[endpoint_sample_cache]") {
+    Cache cache{std::chrono::seconds{30}};
+
+    SECTION("Unknown endpoints were not sampled recently") {
+        REQUIRE_FALSE(cache.sampled_recently(0));
+        REQUIRE_FALSE(cache.sampled_recently(12345));
+    }
+
+    SECTION("Recorded endpoints are remembered until the delay expires") {
+        cache.record_sample(42);
+        REQUIRE(cache.sampled_recently(42));
+        REQUIRE_FALSE(cache.sampled_recently(43));
+
+        MockClock::advance_time(std::chrono::seconds{29});
+        REQUIRE(cache.sampled_recently(42));
+
+        MockClock::advance_time(std::chrono::seconds{1});
+        REQUIRE_FALSE(cache.sampled_recently(42));
+    }
+
+    SECTION("Endpoints mapping to the same slot evict each other") {
+        cache.record_sample(1);
+        cache.record_sample(1 + 16);
+        REQUIRE(cache.sampled_recently(1 + 16));
+        REQUIRE_FALSE(cache.sampled_recently(1));
+    }
+}
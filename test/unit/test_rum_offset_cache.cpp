@@ -0,0 +1,71 @@
+#include <catch2/catch_test_macros.hpp>
+#include <string>
+#include <string_view>
+
+#include "rum/offset_cache.h"
+
+namespace rum = datadog::nginx::rum;
+
+namespace {
+using Cache = rum::InjectionOffsetCache<16>;
+
+std::string_view context_of(const Cache::Entry &entry) {
+    return {reinterpret_cast<const char *>(entry.context.data()),
+            entry.context_len};
+}
+
+const int snippet_a = 0;
+const int snippet_b = 0;
+}  // namespace
+
+TEST_CASE("InjectionOffsetCache", "[rum][offset_cache]") {
+    Cache cache;
+
+    SECTION("Unknown responses have no entry") {
+        REQUIRE(cache.find(0) == nullptr);
+        REQUIRE(cache.find(12345) == nullptr);
+    }
+
+    SECTION("Stored entries can be found") {
+        cache.store(42, 120, "<html><head>", &snippet_a, "<script/>");
+        const Cache::Entry *entry = cache.find(42);
+        REQUIRE(entry != nullptr);
+        REQUIRE(entry->offset == 120);
+        REQUIRE(context_of(*entry) == "<html><head>");
+        REQUIRE(*entry->snippet == "<script/>");
+        REQUIRE(cache.find(43) == nullptr);
+    }
+
+    SECTION("Only the end of the context is kept") {
+        std::string context(40, 'a');
+        context += "<head>";
+        cache.store(1, 1000, context, &snippet_a, "<script/>");
+        const Cache::Entry *entry = cache.find(1);
+        REQUIRE(entry != nullptr);
+        REQUIRE(context_of(*entry).size() == Cache::kMaxContext);
+        REQUIRE(context_of(*entry).ends_with("<head>"));
+    }
+
+    SECTION("Entries for the same snippet share its bytes") {
+        cache.store(1, 10, "<head>", &snippet_a, "<script/>");
+        cache.store(2, 20, "<head>", &snippet_a, "<script/>");
+        cache.store(3, 30, "<head>", &snippet_b, "<script src=x/>");
+        REQUIRE(cache.find(1)->snippet == cache.find(2)->snippet);
+        REQUIRE(*cache.find(3)->snippet == "<script src=x/>");
+    }
+
+    SECTION("Entries mapping to the same slot evict each other") {
+        cache.store(1, 10, "<head>", &snippet_a, "<script/>");
+        cache.store(1 + 16, 20, "<head>", &snippet_a, "<script/>");
+        REQUIRE(cache.find(1) == nullptr);
+        REQUIRE(cache.find(1 + 16)->offset == 20);
+    }
+
+    SECTION("Evicted entries are gone, others are kept") {
+        cache.store(1, 10, "<head>", &snippet_a, "<script/>");
+        cache.evict(1 + 16);
+        REQUIRE(cache.find(1) != nullptr);
+        cache.evict(1);
+        REQUIRE(cache.find(1) == nullptr);
+    }
+}
@@ -0,0 +1,126 @@
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+#include "tracing/sample_rate_overrides.h"
+
+using datadog::nginx::parse_sample_rate_overrides;
+using datadog::nginx::SampleRateOverrides;
+using datadog::nginx::TraceRateLimiter;
+
+TEST_CASE("parse_sample_rate_overrides", "[sample_rate_overrides]") {
+    SECTION("Entries, comments and blank lines") {
+        auto parsed = parse_sample_rate_overrides(
+            "# tuned during the incident\n"
+            "/etc/nginx/nginx.conf:23#1 0.05\n"
+            "\n"
+            "  /etc/nginx/sites/my site.conf:7#2\t1 \r\n"
+            "* 0.5");
+        REQUIRE(parsed.rates.size() == 2);
+        REQUIRE(parsed.rates.at("/etc/nginx/nginx.conf:23#1") == 0.05);
+        REQUIRE(parsed.rates.at("/etc/nginx/sites/my site.conf:7#2") == 1.0);
+        REQUIRE(parsed.default_rate == 0.5);
+    }
+
+    SECTION("Empty file") {
+        auto parsed = parse_sample_rate_overrides("");
+        REQUIRE(parsed.rates.empty());
+        REQUIRE_FALSE(parsed.default_rate);
+    }
+
+    SECTION("Invalid lines") {
+        REQUIRE_THROWS_AS(parse_sample_rate_overrides("0.5"),
+                          std::invalid_argument);
+        REQUIRE_THROWS_AS(parse_sample_rate_overrides("a.conf:1#1 half"),
+                          std::invalid_argument);
+        REQUIRE_THROWS_AS(parse_sample_rate_overrides("a.conf:1#1 0.5x"),
+                          std::invalid_argument);
+        REQUIRE_THROWS_AS(parse_sample_rate_overrides("* 1.5"),
+                          std::invalid_argument);
+        REQUIRE_THROWS_AS(parse_sample_rate_overrides("* -0.1"),
+                          std::invalid_argument);
+    }
+}
+
+TEST_CASE("SampleRateOverrides", "[sample_rate_overrides]") {
+    alignas(std::uint64_t) unsigned char
+        memory[SampleRateOverrides::state_size(3)];
+    auto overrides = SampleRateOverrides::initialize(memory, 3);
+    REQUIRE(overrides.num_rules() == 3);
+
+    SECTION("Nothing is overridden initially") {
+        for (std::size_t i = 0; i < 3; ++i) {
+            REQUIRE_FALSE(overrides.rate(i));
+        }
+        REQUIRE_FALSE(overrides.rate(std::nullopt));
+    }
+
+    SECTION("Published rates are visible through another handle") {
+        overrides.publish({0.25, std::nullopt, 1.0, 0.0});
+        SampleRateOverrides other{memory};
+        REQUIRE(other.rate(0) == 250000u);
+        REQUIRE_FALSE(other.rate(1));
+        REQUIRE(other.rate(2) == SampleRateOverrides::kPrecision);
+        REQUIRE(other.rate(std::nullopt) == 0u);
+        REQUIRE_FALSE(other.rate(4));
+
+        overrides.publish({});
+        REQUIRE_FALSE(other.rate(0));
+        REQUIRE_FALSE(other.rate(std::nullopt));
+    }
+
+    SECTION("Sampling depends on the trace ID and the rate") {
+        REQUIRE(SampleRateOverrides::keep(12345,
+                                          SampleRateOverrides::kPrecision));
+        REQUIRE_FALSE(SampleRateOverrides::keep(12345, 0));
+
+        int kept = 0;
+        for (std::uint64_t id = 1; id <= 10000; ++id) {
+            const bool keep = SampleRateOverrides::keep(id, 100000);
+            REQUIRE(keep == SampleRateOverrides::keep(id, 100000));
+            kept += keep;
+        }
+        REQUIRE(kept > 800);
+        REQUIRE(kept < 1200);
+    }
+}
+
+TEST_CASE("TraceRateLimiter", "[sample_rate_overrides]") {
+    TraceRateLimiter limiter{2};
+    const std::uint64_t start = 1000000;
+
+    SECTION("Up to the limit per second") {
+        REQUIRE(limiter.allow(start));
+        REQUIRE(limiter.allow(start));
+        REQUIRE_FALSE(limiter.allow(start + 10));
+        REQUIRE(limiter.effective_rate() == 2.0 / 3);
+
+        // refilled at the rate of the limit
+        REQUIRE(limiter.allow(start + 600));
+        REQUIRE_FALSE(limiter.allow(start + 600));
+        REQUIRE(limiter.allow(start + 2000));
+        REQUIRE(limiter.allow(start + 2000));
+        REQUIRE_FALSE(limiter.allow(start + 2000));
+    }
+
+    SECTION("Less than one trace per second") {
+        TraceRateLimiter slow{0.5};
+        REQUIRE(slow.allow(start));
+        REQUIRE_FALSE(slow.allow(start + 1000));
+        REQUIRE(slow.allow(start + 2000));
+    }
+
+    SECTION("The effective rate covers the previous second") {
+        REQUIRE(limiter.effective_rate() == 1.0);
+        REQUIRE(limiter.allow(start));
+        REQUIRE(limiter.allow(start));
+        REQUIRE_FALSE(limiter.allow(start));
+        REQUIRE_FALSE(limiter.allow(start));
+        REQUIRE(limiter.allow(start + 1000));
+        REQUIRE(limiter.effective_rate() == 3.0 / 5);
+        REQUIRE(limiter.allow(start + 5000));
+        REQUIRE(limiter.effective_rate() == 1.0);
+    }
+}
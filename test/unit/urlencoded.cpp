@@ -139,3 +139,70 @@ TEST_CASE("empty key", "[urlencoded]") {
   REQUIRE(maybe_value->is_string());
   CHECK(maybe_value->string_val_unchecked() == "value");
 }
+
+TEST_CASE("percent decoding across long data", "[urlencoded]") {
+  // long enough for the separators to be found several bytes at a time
+  std::vector parts = {"utm_source=newsletter&utm_campaign=spring%20sale"
+                       "&ref=a%2Fb%2fc+d&bad=%zz%4&plain=value_without_escapes"
+                       "&tail=%41"sv};
+  dnsec::DdwafMemres memres;
+  auto slot = parse(parts, memres);
+
+  REQUIRE((slot && slot->is_map()));
+  dnsec::ddwaf_map_obj map{*slot};
+  CHECK(map.size() == 6);
+  CHECK(map.get_opt("utm_campaign")->string_val_unchecked() == "spring sale");
+  CHECK(map.get_opt("ref")->string_val_unchecked() == "a/b/c d");
+  // invalid escapes are kept verbatim
+  CHECK(map.get_opt("bad")->string_val_unchecked() == "%zz%4");
+  CHECK(map.get_opt("plain")->string_val_unchecked() ==
+        "value_without_escapes");
+  CHECK(map.get_opt("tail")->string_val_unchecked() == "A");
+}
+
+TEST_CASE("urlencoded body fed in chunks", "[urlencoded]") {
+  std::string_view body =
+      "a=1&b=x%20y&a=2&&c&=v&d=%41%42+c&long_key_without_escapes=value&a=3&";
+
+  for (std::size_t chunk = 1; chunk <= body.size(); chunk++) {
+    dnsec::DdwafMemres memres;
+    dnsec::UrlencodedBodyParser parser;
+    // copy the data each time, like the collected body that is moved as it
+    // grows
+    std::string collected;
+    for (std::size_t len = chunk; len < body.size(); len += chunk) {
+      collected = std::string{body.substr(0, len)};
+      parser.feed(collected, memres);
+    }
+    collected = std::string{body};
+
+    ddwaf_obj slot;
+    REQUIRE(parser.finish(slot, collected, memres));
+    REQUIRE(slot.is_map());
+    dnsec::ddwaf_map_obj map{slot};
+    // a, b, c, d, the empty key and long_key_without_escapes
+    CHECK(map.size() == 6);
+
+    auto a = map.get_opt("a");
+    REQUIRE((a && a->is_array() && a->size_unchecked() == 3));
+    dnsec::ddwaf_arr_obj a_arr{*a};
+    CHECK(a_arr.at_unchecked<ddwaf_obj>(0).string_val_unchecked() == "1");
+    CHECK(a_arr.at_unchecked<ddwaf_obj>(1).string_val_unchecked() == "2");
+    CHECK(a_arr.at_unchecked<ddwaf_obj>(2).string_val_unchecked() == "3");
+    CHECK(map.get_opt("b")->string_val_unchecked() == "x y");
+    CHECK(map.get_opt("c")->string_val_unchecked() == "");
+    // from && and =v
+    auto empty_key = map.get_opt("");
+    REQUIRE((empty_key && empty_key->is_array() &&
+             empty_key->size_unchecked() == 2));
+    dnsec::ddwaf_arr_obj empty_key_arr{*empty_key};
+    CHECK(empty_key_arr.at_unchecked<ddwaf_obj>(1).string_val_unchecked() ==
+          "v");
+    CHECK(map.get_opt("d")->string_val_unchecked() == "AB c");
+    auto long_value = map.get_opt("long_key_without_escapes");
+    REQUIRE(long_value);
+    CHECK(long_value->string_val_unchecked() == "value");
+    // not decoded, so it references the final data
+    CHECK(long_value->string_val_unchecked().data() >= collected.data());
+  }
+}